@@ -0,0 +1,253 @@
+// Disclaimer: IMPORTANT: This Apple software is supplied to you, by Apple Inc. ("Apple"), in your
+// capacity as a current, and in good standing, Licensee in the MFi Licensing Program. Use of this
+// Apple software is governed by and subject to the terms and conditions of your MFi License,
+// including, but not limited to, the restrictions specified in the provision entitled "Public
+// Software", and is further subject to your agreement to the following additional terms, and your
+// agreement that the use, installation, modification or redistribution of this Apple software
+// constitutes acceptance of these additional terms. If you do not agree with these additional terms,
+// you may not use, install, modify or redistribute this Apple software.
+//
+// Subject to all of these terms and in consideration of your agreement to abide by them, Apple grants
+// you, for as long as you are a current and in good-standing MFi Licensee, a personal, non-exclusive
+// license, under Apple's copyrights in this Apple software (the "Apple Software"), to use,
+// reproduce, and modify the Apple Software in source form, and to use, reproduce, modify, and
+// redistribute the Apple Software, with or without modifications, in binary form, in each of the
+// foregoing cases to the extent necessary to develop and/or manufacture "Proposed Products" and
+// "Licensed Products" in accordance with the terms of your MFi License. While you may not
+// redistribute the Apple Software in source form, should you redistribute the Apple Software in binary
+// form, you must retain this notice and the following text and disclaimers in all such redistributions
+// of the Apple Software. Neither the name, trademarks, service marks, or logos of Apple Inc. may be
+// used to endorse or promote products derived from the Apple Software without specific prior written
+// permission from Apple. Except as expressly stated in this notice, no other rights or licenses,
+// express or implied, are granted by Apple herein, including but not limited to any patent rights that
+// may be infringed by your derivative works or by other works in which the Apple Software may be
+// incorporated. Apple may terminate this license to the Apple Software by removing it from the list
+// of Licensed Technology in the MFi License, or otherwise in accordance with the terms of such MFi License.
+//
+// Unless you explicitly state otherwise, if you provide any ideas, suggestions, recommendations, bug
+// fixes or enhancements to Apple in connection with this software ("Feedback"), you hereby grant to
+// Apple a non-exclusive, fully paid-up, perpetual, irrevocable, worldwide license to make, use,
+// reproduce, incorporate, modify, display, perform, sell, make or have made derivative works of,
+// distribute (directly or indirectly) and sublicense, such Feedback in connection with Apple products
+// and services. Providing this Feedback is voluntary, but if you do provide Feedback to Apple, you
+// acknowledge and agree that Apple may exercise the license granted above without the payment of
+// royalties or further consideration to Participant.
+
+// The Apple Software is provided by Apple on an "AS IS" basis. APPLE MAKES NO WARRANTIES, EXPRESS OR
+// IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY
+// AND FITNESS FOR A PARTICULAR PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR
+// IN COMBINATION WITH YOUR PRODUCTS.
+//
+// IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION
+// AND/OR DISTRIBUTION OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+// (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// Copyright (C) 2015-2021 Apple Inc. All Rights Reserved.
+
+#ifndef HAP_PLATFORM_KEY_VALUE_STORE_INIT_H
+#define HAP_PLATFORM_KEY_VALUE_STORE_INIT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "HAPPlatform.h"
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull begin
+#endif
+
+/**@file
+ * Key-value store for host builds, with a flash latency and wear model.
+ *
+ * The store emulates a NOR flash in a memory-mapped file, so PAL code can be benchmarked and fuzzed off-target with
+ * the write and erase patterns of a device.
+ *
+ * - The file is divided into pages. Records are appended to the active page and never overwritten in place.
+ * - A removal appends a tombstone. Each record carries a CRC, so torn writes are detected on the next start. A page
+ *   with a torn write is not appended to anymore.
+ * - When the active page is full, the next page becomes active. The live records of the oldest page are copied to it
+ *   and the oldest page is erased. One erased page is always kept ahead of the active page.
+ * - The flash model accounts a latency for every programmed word and every page erase, and optionally sleeps for it.
+ *   Bytes written and erases per page are counted.
+ *
+ * All operations complete synchronously, so `HAPPlatformKeyValueStoreIsBusy` always returns false.
+ *
+ * Harness/HAPPlatformKeyValueStoreHarness.c checks the recovery from torn writes with injected power losses.
+ *
+ * **Example**
+
+   @code{.c}
+
+   static HAPPlatformKeyValueStore keyValueStore;
+
+   HAPPlatformKeyValueStoreCreate(&keyValueStore,
+       &(const HAPPlatformKeyValueStoreOptions) {
+           .filePath = "kvs.bin",
+           .pageSize = 4096,
+           .numPages = 4,
+           .flashModel = {
+               .pageEraseMicroseconds = 85000,   // nRF52840 page erase.
+               .wordProgramMicroseconds = 41,    // nRF52840 word write.
+           },
+       });
+
+   // Run code under test, then read the flash statistics.
+   HAPPlatformKeyValueStoreFlashStats stats;
+   HAPPlatformKeyValueStoreGetFlashStats(&keyValueStore, &stats);
+
+   HAPPlatformKeyValueStoreRelease(&keyValueStore);
+
+   @endcode
+ */
+
+/**
+ * Flash latency model.
+ */
+typedef struct {
+    /** Duration of a page erase in microseconds. */
+    uint32_t pageEraseMicroseconds;
+
+    /** Duration of programming one 4 byte word in microseconds. */
+    uint32_t wordProgramMicroseconds;
+
+    /** Whether the calling thread sleeps for the modelled latency, in addition to accounting it. */
+    bool injectsLatency;
+} HAPPlatformKeyValueStoreFlashModel;
+
+/**
+ * Key-value store initialization options.
+ */
+typedef struct {
+    /**
+     * Path of the file that backs the emulated flash. The file is created if it does not exist.
+     */
+    const char* filePath;
+
+    /**
+     * Size of a flash page in bytes.
+     *
+     * - Must be a multiple of 4 and at least 64.
+     * - Limits the size of a record.
+     */
+    size_t pageSize;
+
+    /**
+     * Number of flash pages. Must be at least 2.
+     */
+    size_t numPages;
+
+    /**
+     * Flash latency model.
+     */
+    HAPPlatformKeyValueStoreFlashModel flashModel;
+
+    /**
+     * Power loss injection, for torn write tests.
+     *
+     * If non-zero, the process exits with kHAPPlatformKeyValueStorePowerLossExitStatus once this many bytes have been
+     * programmed, leaving the write in progress torn in the file.
+     */
+    uint64_t numBytesUntilPowerLoss;
+} HAPPlatformKeyValueStoreOptions;
+
+/**
+ * Exit status of a process whose power loss was injected with HAPPlatformKeyValueStoreOptions.numBytesUntilPowerLoss.
+ */
+#define kHAPPlatformKeyValueStorePowerLossExitStatus 75
+
+/**
+ * Flash statistics.
+ */
+typedef struct {
+    /** Number of bytes programmed, including record headers and records copied by garbage collection. */
+    uint64_t numBytesWritten;
+
+    /** Number of bytes programmed by garbage collection. */
+    uint64_t numBytesCopied;
+
+    /** Number of page erases. */
+    uint64_t numErases;
+
+    /** Highest number of erases of a single page. */
+    uint32_t maxPageErases;
+
+    /** Modelled flash busy time in microseconds. */
+    uint64_t flashMicroseconds;
+} HAPPlatformKeyValueStoreFlashStats;
+
+/**
+ * Key-value store.
+ */
+struct HAPPlatformKeyValueStore {
+    // Opaque type. Do not access the instance fields directly.
+    /**@cond */
+    HAPPlatformKeyValueStoreOptions _;
+    int fileDescriptor;
+    uint8_t* flash;
+    uint32_t* pageErases;
+    uint32_t* recordOffsets;
+    size_t activePage;
+    size_t writeOffset;
+    uint32_t sequenceNumber;
+    HAPPlatformKeyValueStoreFlashStats stats;
+    /**@endcond */
+};
+
+/**
+ * Initializes the key-value store.
+ *
+ * @param[out] keyValueStore        Pointer to an allocated but uninitialized HAPPlatformKeyValueStore structure.
+ * @param      options              Initialization options.
+ */
+void HAPPlatformKeyValueStoreCreate(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        const HAPPlatformKeyValueStoreOptions* options);
+
+/**
+ * Deinitializes the key-value store and unmaps its file.
+ *
+ * @param      keyValueStore        Key-value store.
+ */
+void HAPPlatformKeyValueStoreRelease(HAPPlatformKeyValueStoreRef keyValueStore);
+
+/**
+ * Checks whether there are outstanding key-value store operations that have not yet been committed to persistent store.
+ *
+ * @param      keyValueStore        Key-value store.
+ *
+ * @return true                     If there are outstanding KVS operations
+ * @return false                    Otherwise.
+ */
+HAP_RESULT_USE_CHECK
+bool HAPPlatformKeyValueStoreIsBusy(HAPPlatformKeyValueStoreRef keyValueStore);
+
+/**
+ * Gets the flash statistics since the key-value store was created or the statistics were reset.
+ *
+ * @param      keyValueStore        Key-value store.
+ * @param[out] stats                Flash statistics.
+ */
+void HAPPlatformKeyValueStoreGetFlashStats(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        HAPPlatformKeyValueStoreFlashStats* stats);
+
+/**
+ * Resets the flash statistics. Erase counts per page are kept.
+ *
+ * @param      keyValueStore        Key-value store.
+ */
+void HAPPlatformKeyValueStoreResetFlashStats(HAPPlatformKeyValueStoreRef keyValueStore);
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull end
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,584 @@
+// Disclaimer: IMPORTANT: This Apple software is supplied to you, by Apple Inc. ("Apple"), in your
+// capacity as a current, and in good standing, Licensee in the MFi Licensing Program. Use of this
+// Apple software is governed by and subject to the terms and conditions of your MFi License,
+// including, but not limited to, the restrictions specified in the provision entitled "Public
+// Software", and is further subject to your agreement to the following additional terms, and your
+// agreement that the use, installation, modification or redistribution of this Apple software
+// constitutes acceptance of these additional terms. If you do not agree with these additional terms,
+// you may not use, install, modify or redistribute this Apple software.
+//
+// Subject to all of these terms and in consideration of your agreement to abide by them, Apple grants
+// you, for as long as you are a current and in good-standing MFi Licensee, a personal, non-exclusive
+// license, under Apple's copyrights in this Apple software (the "Apple Software"), to use,
+// reproduce, and modify the Apple Software in source form, and to use, reproduce, modify, and
+// redistribute the Apple Software, with or without modifications, in binary form, in each of the
+// foregoing cases to the extent necessary to develop and/or manufacture "Proposed Products" and
+// "Licensed Products" in accordance with the terms of your MFi License. While you may not
+// redistribute the Apple Software in source form, should you redistribute the Apple Software in binary
+// form, you must retain this notice and the following text and disclaimers in all such redistributions
+// of the Apple Software. Neither the name, trademarks, service marks, or logos of Apple Inc. may be
+// used to endorse or promote products derived from the Apple Software without specific prior written
+// permission from Apple. Except as expressly stated in this notice, no other rights or licenses,
+// express or implied, are granted by Apple herein, including but not limited to any patent rights that
+// may be infringed by your derivative works or by other works in which the Apple Software may be
+// incorporated. Apple may terminate this license to the Apple Software by removing it from the list
+// of Licensed Technology in the MFi License, or otherwise in accordance with the terms of such MFi License.
+//
+// Unless you explicitly state otherwise, if you provide any ideas, suggestions, recommendations, bug
+// fixes or enhancements to Apple in connection with this software ("Feedback"), you hereby grant to
+// Apple a non-exclusive, fully paid-up, perpetual, irrevocable, worldwide license to make, use,
+// reproduce, incorporate, modify, display, perform, sell, make or have made derivative works of,
+// distribute (directly or indirectly) and sublicense, such Feedback in connection with Apple products
+// and services. Providing this Feedback is voluntary, but if you do provide Feedback to Apple, you
+// acknowledge and agree that Apple may exercise the license granted above without the payment of
+// royalties or further consideration to Participant.
+
+// The Apple Software is provided by Apple on an "AS IS" basis. APPLE MAKES NO WARRANTIES, EXPRESS OR
+// IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY
+// AND FITNESS FOR A PARTICULAR PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR
+// IN COMBINATION WITH YOUR PRODUCTS.
+//
+// IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION
+// AND/OR DISTRIBUTION OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+// (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// Copyright (C) 2015-2021 Apple Inc. All Rights Reserved.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "HAPPlatform.h"
+#include "HAPPlatformKeyValueStore+Init.h"
+
+static const HAPLogObject logObject = { .subsystem = kHAPPlatform_LogSubsystem, .category = "KeyValueStore" };
+
+/** Value of erased flash. */
+#define kErasedByte ((uint8_t) 0xFF)
+
+/** Flash word size. Records are programmed in whole words. */
+#define kWordSize ((size_t) 4)
+
+/** Page header magic, "HKVS". */
+#define kPageMagic ((uint32_t) 0x53564B48)
+
+/** Number of (domain, key) combinations. */
+#define kNumDomainKeys ((size_t) 1 << 16)
+
+/** Offset of a record that is not stored. */
+#define kRecordOffsetNone UINT32_MAX
+
+/** Size field of a removal. */
+#define kRecordSizeRemoved ((uint16_t) 0xFFFE)
+
+/** Size field of erased flash. */
+#define kRecordSizeErased ((uint16_t) 0xFFFF)
+
+/**
+ * Page header, at the start of every page in use. The magic is programmed last, so a page with a valid magic has a
+ * complete sequence number.
+ */
+typedef struct {
+    uint32_t sequenceNumber;
+    uint32_t magic;
+} PageHeader;
+HAP_STATIC_ASSERT(sizeof(PageHeader) % kWordSize == 0, PageHeader_WordAligned);
+
+/**
+ * Record header, followed by the value padded to a whole word.
+ */
+typedef struct {
+    uint16_t domainKey;
+    uint16_t numBytes;
+    uint32_t crc;
+} RecordHeader;
+HAP_STATIC_ASSERT(sizeof(RecordHeader) % kWordSize == 0, RecordHeader_WordAligned);
+
+static size_t AlignedSize(size_t numBytes) {
+    return (numBytes + kWordSize - 1) / kWordSize * kWordSize;
+}
+
+static uint16_t DomainKey(HAPPlatformKeyValueStoreDomain domain, HAPPlatformKeyValueStoreKey key) {
+    return (uint16_t)(domain << 8 | key);
+}
+
+static uint32_t Crc32(uint32_t crc, const void* bytes, size_t numBytes) {
+    const uint8_t* b = bytes;
+    crc = ~crc;
+    for (size_t i = 0; i < numBytes; i++) {
+        crc ^= b[i];
+        for (int j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+static uint32_t RecordCrc(const RecordHeader* header, const void* _Nullable bytes) {
+    uint32_t crc = Crc32(0, &header->domainKey, sizeof header->domainKey);
+    crc = Crc32(crc, &header->numBytes, sizeof header->numBytes);
+    if (bytes && header->numBytes != kRecordSizeRemoved) {
+        crc = Crc32(crc, bytes, header->numBytes);
+    }
+    return crc;
+}
+
+static uint8_t* PageBytes(HAPPlatformKeyValueStoreRef keyValueStore, size_t page) {
+    return &keyValueStore->flash[page * keyValueStore->_.pageSize];
+}
+
+static bool IsErased(const uint8_t* bytes, size_t numBytes) {
+    for (size_t i = 0; i < numBytes; i++) {
+        if (bytes[i] != kErasedByte) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Accounts, and optionally injects, the modelled latency of a flash operation.
+ */
+static void ModelLatency(HAPPlatformKeyValueStoreRef keyValueStore, uint64_t microseconds) {
+    keyValueStore->stats.flashMicroseconds += microseconds;
+    if (keyValueStore->_.flashModel.injectsLatency && microseconds) {
+        usleep((useconds_t) microseconds);
+    }
+}
+
+/**
+ * Programs flash. Like NOR flash, programming can only clear bits.
+ */
+static void Program(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        size_t offset,
+        const void* bytes,
+        size_t numBytes,
+        bool isCopy) {
+    HAPPrecondition(offset % kWordSize == 0);
+    HAPPrecondition(offset + numBytes <= keyValueStore->_.pageSize * keyValueStore->_.numPages);
+
+    const uint8_t* b = bytes;
+    for (size_t i = 0; i < numBytes; i++) {
+        if ((keyValueStore->flash[offset + i] & b[i]) != b[i]) {
+            HAPLogError(&logObject, "%s: Programming non-erased flash at 0x%zX.", __func__, offset + i);
+            HAPFatalError();
+        }
+        keyValueStore->flash[offset + i] &= b[i];
+        if (keyValueStore->_.numBytesUntilPowerLoss && !--keyValueStore->_.numBytesUntilPowerLoss) {
+            HAPLogInfo(&logObject, "%s: Injecting power loss at 0x%zX.", __func__, offset + i);
+            _exit(kHAPPlatformKeyValueStorePowerLossExitStatus);
+        }
+    }
+
+    keyValueStore->stats.numBytesWritten += numBytes;
+    if (isCopy) {
+        keyValueStore->stats.numBytesCopied += numBytes;
+    }
+    ModelLatency(
+            keyValueStore,
+            (uint64_t) AlignedSize(numBytes) / kWordSize * keyValueStore->_.flashModel.wordProgramMicroseconds);
+}
+
+static void Erase(HAPPlatformKeyValueStoreRef keyValueStore, size_t page) {
+    memset(PageBytes(keyValueStore, page), kErasedByte, keyValueStore->_.pageSize);
+    keyValueStore->pageErases[page]++;
+    keyValueStore->stats.numErases++;
+    ModelLatency(keyValueStore, keyValueStore->_.flashModel.pageEraseMicroseconds);
+}
+
+static void OpenPage(HAPPlatformKeyValueStoreRef keyValueStore, size_t page) {
+    PageHeader header = { .magic = kPageMagic, .sequenceNumber = ++keyValueStore->sequenceNumber };
+    Program(keyValueStore, page * keyValueStore->_.pageSize, &header, sizeof header, false);
+    keyValueStore->activePage = page;
+    keyValueStore->writeOffset = sizeof header;
+}
+
+/**
+ * Appends a record to the active page.
+ *
+ * @return true                     If the record fit into the active page.
+ * @return false                    Otherwise.
+ */
+static bool Append(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        uint16_t domainKey,
+        const void* _Nullable bytes,
+        uint16_t numBytes,
+        bool isCopy) {
+    size_t dataSize = numBytes == kRecordSizeRemoved ? 0 : AlignedSize(numBytes);
+    if (keyValueStore->writeOffset + sizeof(RecordHeader) + dataSize > keyValueStore->_.pageSize) {
+        return false;
+    }
+
+    RecordHeader header = { .domainKey = domainKey, .numBytes = numBytes };
+    header.crc = RecordCrc(&header, bytes);
+
+    size_t offset = keyValueStore->activePage * keyValueStore->_.pageSize + keyValueStore->writeOffset;
+    if (dataSize) {
+        // The value is programmed before the header, so a torn write never leaves a valid header.
+        Program(keyValueStore, offset + sizeof header, bytes, numBytes, isCopy);
+    }
+    Program(keyValueStore, offset, &header, sizeof header, isCopy);
+    keyValueStore->writeOffset += sizeof header + dataSize;
+
+    keyValueStore->recordOffsets[domainKey] = numBytes == kRecordSizeRemoved ? kRecordOffsetNone : (uint32_t) offset;
+    return true;
+}
+
+/**
+ * Copies the live records of a page to the active page and erases it.
+ */
+static void CollectGarbage(HAPPlatformKeyValueStoreRef keyValueStore, size_t page) {
+    const uint8_t* bytes = PageBytes(keyValueStore, page);
+    size_t pageOffset = page * keyValueStore->_.pageSize;
+
+    for (size_t offset = sizeof(PageHeader); offset + sizeof(RecordHeader) <= keyValueStore->_.pageSize;) {
+        RecordHeader header;
+        HAPRawBufferCopyBytes(&header, &bytes[offset], sizeof header);
+        if (header.numBytes == kRecordSizeErased) {
+            break;
+        }
+        size_t dataSize = header.numBytes == kRecordSizeRemoved ? 0 : AlignedSize(header.numBytes);
+
+        // Removals are dropped: older values of the record are only stored in this oldest page.
+        if (keyValueStore->recordOffsets[header.domainKey] == pageOffset + offset) {
+            bool fits = Append(
+                    keyValueStore, header.domainKey, &bytes[offset + sizeof header], header.numBytes, true);
+            HAPAssert(fits);
+        }
+        offset += sizeof header + dataSize;
+    }
+    Erase(keyValueStore, page);
+}
+
+/**
+ * Moves on to the next page, reclaiming the oldest page.
+ */
+static void AdvancePage(HAPPlatformKeyValueStoreRef keyValueStore) {
+    size_t numPages = keyValueStore->_.numPages;
+    size_t page = (keyValueStore->activePage + 1) % numPages;
+
+    OpenPage(keyValueStore, page);
+    if (!IsErased(PageBytes(keyValueStore, (page + 1) % numPages), keyValueStore->_.pageSize)) {
+        CollectGarbage(keyValueStore, (page + 1) % numPages);
+    }
+}
+
+static HAPError Write(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        uint16_t domainKey,
+        const void* _Nullable bytes,
+        uint16_t numBytes) {
+    // Every page collected without making room means the store is full of live records.
+    for (size_t i = 0; i < keyValueStore->_.numPages; i++) {
+        if (Append(keyValueStore, domainKey, bytes, numBytes, false)) {
+            return kHAPError_None;
+        }
+        AdvancePage(keyValueStore);
+    }
+    HAPLogError(&logObject, "%s: Out of flash space.", __func__);
+    return kHAPError_OutOfResources;
+}
+
+/**
+ * Replays the records of a page into the record offsets.
+ *
+ * The value of a record is programmed before its header. A write torn before its header was programmed leaves
+ * non-erased bytes behind an erased header, and a torn header fails the CRC. In both cases the page is treated as full,
+ * so no record is programmed over the torn bytes.
+ */
+static void MountPage(HAPPlatformKeyValueStoreRef keyValueStore, size_t page) {
+    const uint8_t* bytes = PageBytes(keyValueStore, page);
+    size_t offset = sizeof(PageHeader);
+
+    while (offset + sizeof(RecordHeader) <= keyValueStore->_.pageSize) {
+        RecordHeader header;
+        HAPRawBufferCopyBytes(&header, &bytes[offset], sizeof header);
+        if (header.numBytes == kRecordSizeErased) {
+            if (!IsErased(&bytes[offset], keyValueStore->_.pageSize - offset)) {
+                HAPLogError(&logObject, "%s: Torn record in page %zu at 0x%zX.", __func__, page, offset);
+                offset = keyValueStore->_.pageSize;
+            }
+            break;
+        }
+        size_t dataSize = header.numBytes == kRecordSizeRemoved ? 0 : AlignedSize(header.numBytes);
+        if (offset + sizeof header + dataSize > keyValueStore->_.pageSize ||
+            RecordCrc(&header, &bytes[offset + sizeof header]) != header.crc) {
+            HAPLogError(&logObject, "%s: Torn record in page %zu at 0x%zX.", __func__, page, offset);
+            offset = keyValueStore->_.pageSize;
+            break;
+        }
+        keyValueStore->recordOffsets[header.domainKey] =
+                header.numBytes == kRecordSizeRemoved ? kRecordOffsetNone :
+                                                        (uint32_t)(page * keyValueStore->_.pageSize + offset);
+        offset += sizeof header + dataSize;
+    }
+    keyValueStore->activePage = page;
+    keyValueStore->writeOffset = offset;
+}
+
+/**
+ * Page in use, found when the file is mounted.
+ */
+typedef struct {
+    uint32_t sequenceNumber;
+    size_t page;
+} UsedPage;
+
+static int CompareSequenceNumbers(const void* a, const void* b) {
+    uint32_t sa = ((const UsedPage*) a)->sequenceNumber;
+    uint32_t sb = ((const UsedPage*) b)->sequenceNumber;
+    return (sa > sb) - (sa < sb);
+}
+
+/**
+ * Replays the pages in the order they were written. Corrupted pages are erased.
+ *
+ * @return Number of pages in use.
+ */
+static size_t MountPages(HAPPlatformKeyValueStoreRef keyValueStore) {
+    size_t numPages = keyValueStore->_.numPages;
+
+    for (size_t i = 0; i < kNumDomainKeys; i++) {
+        keyValueStore->recordOffsets[i] = kRecordOffsetNone;
+    }
+    UsedPage* usedPages = calloc(numPages, sizeof *usedPages);
+    size_t numUsedPages = 0;
+    if (!usedPages) {
+        HAPLogError(&logObject, "%s: Out of memory.", __func__);
+        HAPFatalError();
+    }
+    for (size_t page = 0; page < numPages; page++) {
+        PageHeader header;
+        HAPRawBufferCopyBytes(&header, PageBytes(keyValueStore, page), sizeof header);
+        if (header.magic == kPageMagic) {
+            usedPages[numUsedPages].sequenceNumber = header.sequenceNumber;
+            usedPages[numUsedPages].page = page;
+            numUsedPages++;
+        } else if (!IsErased(PageBytes(keyValueStore, page), keyValueStore->_.pageSize)) {
+            HAPLogError(&logObject, "%s: Erasing corrupted page %zu.", __func__, page);
+            Erase(keyValueStore, page);
+        }
+    }
+    qsort(usedPages, numUsedPages, sizeof *usedPages, CompareSequenceNumbers);
+    for (size_t i = 0; i < numUsedPages; i++) {
+        MountPage(keyValueStore, usedPages[i].page);
+        keyValueStore->sequenceNumber = usedPages[i].sequenceNumber;
+    }
+    free(usedPages);
+    return numUsedPages;
+}
+
+void HAPPlatformKeyValueStoreCreate(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        const HAPPlatformKeyValueStoreOptions* options) {
+    HAPPrecondition(keyValueStore);
+    HAPPrecondition(options);
+    HAPPrecondition(options->filePath);
+    HAPPrecondition(options->pageSize >= 64 && options->pageSize % kWordSize == 0);
+    HAPPrecondition(options->numPages >= 2);
+
+    HAPRawBufferZero(keyValueStore, sizeof *keyValueStore);
+    keyValueStore->_ = *options;
+    size_t numBytes = options->pageSize * options->numPages;
+
+    keyValueStore->fileDescriptor = open(options->filePath, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (keyValueStore->fileDescriptor < 0) {
+        HAPLogError(&logObject, "%s: open %s failed: %d.", __func__, options->filePath, errno);
+        HAPFatalError();
+    }
+    struct stat fileStatus;
+    if (fstat(keyValueStore->fileDescriptor, &fileStatus) || ftruncate(keyValueStore->fileDescriptor, numBytes)) {
+        HAPLogError(&logObject, "%s: Resizing %s failed: %d.", __func__, options->filePath, errno);
+        HAPFatalError();
+    }
+    keyValueStore->flash = mmap(NULL, numBytes, PROT_READ | PROT_WRITE, MAP_SHARED, keyValueStore->fileDescriptor, 0);
+    if (keyValueStore->flash == MAP_FAILED) {
+        HAPLogError(&logObject, "%s: mmap failed: %d.", __func__, errno);
+        HAPFatalError();
+    }
+    keyValueStore->pageErases = calloc(options->numPages, sizeof keyValueStore->pageErases[0]);
+    keyValueStore->recordOffsets = malloc(kNumDomainKeys * sizeof keyValueStore->recordOffsets[0]);
+    if (!keyValueStore->pageErases || !keyValueStore->recordOffsets) {
+        HAPLogError(&logObject, "%s: Out of memory.", __func__);
+        HAPFatalError();
+    }
+
+    // A new or resized file is erased, without accounting it to the flash model.
+    if ((size_t) fileStatus.st_size != numBytes) {
+        HAPLogInfo(&logObject, "%s: Formatting %s.", __func__, options->filePath);
+        memset(keyValueStore->flash, kErasedByte, numBytes);
+    }
+
+    size_t numUsedPages = MountPages(keyValueStore);
+    size_t next = (keyValueStore->activePage + 1) % options->numPages;
+    if (numUsedPages && !IsErased(PageBytes(keyValueStore, next), options->pageSize)) {
+        if (keyValueStore->writeOffset >= options->pageSize) {
+            // A garbage collection was torn. The active page only holds copies of the next page, which is still
+            // intact, so the active page is dropped and the next write collects the next page again.
+            HAPLogError(&logObject, "%s: Redoing interrupted garbage collection of page %zu.", __func__, next);
+            Erase(keyValueStore, keyValueStore->activePage);
+            numUsedPages = MountPages(keyValueStore);
+        } else {
+            // Finish a garbage collection interrupted before the erase.
+            CollectGarbage(keyValueStore, next);
+        }
+    }
+    if (!numUsedPages) {
+        OpenPage(keyValueStore, 0);
+    }
+    HAPRawBufferZero(&keyValueStore->stats, sizeof keyValueStore->stats);
+}
+
+void HAPPlatformKeyValueStoreRelease(HAPPlatformKeyValueStoreRef keyValueStore) {
+    HAPPrecondition(keyValueStore);
+
+    munmap(keyValueStore->flash, keyValueStore->_.pageSize * keyValueStore->_.numPages);
+    close(keyValueStore->fileDescriptor);
+    free(keyValueStore->pageErases);
+    free(keyValueStore->recordOffsets);
+    HAPRawBufferZero(keyValueStore, sizeof *keyValueStore);
+}
+
+HAP_RESULT_USE_CHECK
+bool HAPPlatformKeyValueStoreIsBusy(HAPPlatformKeyValueStoreRef keyValueStore HAP_UNUSED) {
+    return false;
+}
+
+void HAPPlatformKeyValueStoreGetFlashStats(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        HAPPlatformKeyValueStoreFlashStats* stats) {
+    HAPPrecondition(keyValueStore);
+    HAPPrecondition(stats);
+
+    *stats = keyValueStore->stats;
+    stats->maxPageErases = 0;
+    for (size_t page = 0; page < keyValueStore->_.numPages; page++) {
+        stats->maxPageErases = HAPMax(stats->maxPageErases, keyValueStore->pageErases[page]);
+    }
+}
+
+void HAPPlatformKeyValueStoreResetFlashStats(HAPPlatformKeyValueStoreRef keyValueStore) {
+    HAPPrecondition(keyValueStore);
+
+    HAPRawBufferZero(&keyValueStore->stats, sizeof keyValueStore->stats);
+}
+
+HAP_RESULT_USE_CHECK
+HAPError HAPPlatformKeyValueStoreGet(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreKey key,
+        void* _Nullable bytes,
+        size_t maxBytes,
+        size_t* _Nullable numBytes,
+        bool* found) {
+    HAPPrecondition(keyValueStore);
+    HAPPrecondition(!maxBytes || bytes);
+    HAPPrecondition((bytes == NULL) == (numBytes == NULL));
+    HAPPrecondition(found);
+
+    uint32_t offset = keyValueStore->recordOffsets[DomainKey(domain, key)];
+    *found = offset != kRecordOffsetNone;
+    if (!*found) {
+        if (numBytes) {
+            *numBytes = 0;
+        }
+        return kHAPError_None;
+    }
+
+    RecordHeader header;
+    HAPRawBufferCopyBytes(&header, &keyValueStore->flash[offset], sizeof header);
+    if (bytes) {
+        *numBytes = HAPMin(header.numBytes, maxBytes);
+        HAPRawBufferCopyBytes(bytes, &keyValueStore->flash[offset + sizeof header], *numBytes);
+    }
+    return kHAPError_None;
+}
+
+HAP_RESULT_USE_CHECK
+HAPError HAPPlatformKeyValueStoreSet(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreKey key,
+        const void* bytes,
+        size_t numBytes) {
+    HAPPrecondition(keyValueStore);
+    HAPPrecondition(bytes);
+
+    if (sizeof(PageHeader) + sizeof(RecordHeader) + AlignedSize(numBytes) > keyValueStore->_.pageSize) {
+        HAPLogError(&logObject, "%s: Record of %zu bytes does not fit into a page.", __func__, numBytes);
+        return kHAPError_OutOfResources;
+    }
+    return Write(keyValueStore, DomainKey(domain, key), bytes, (uint16_t) numBytes);
+}
+
+HAP_RESULT_USE_CHECK
+HAPError HAPPlatformKeyValueStoreOverrideAndSet(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreKey key,
+        const void* bytes,
+        size_t numBytes) {
+    return HAPPlatformKeyValueStoreSet(keyValueStore, domain, key, bytes, numBytes);
+}
+
+HAP_RESULT_USE_CHECK
+HAPError HAPPlatformKeyValueStoreRemove(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreKey key) {
+    HAPPrecondition(keyValueStore);
+
+    uint16_t domainKey = DomainKey(domain, key);
+    if (keyValueStore->recordOffsets[domainKey] == kRecordOffsetNone) {
+        return kHAPError_None;
+    }
+    return Write(keyValueStore, domainKey, NULL, kRecordSizeRemoved);
+}
+
+HAP_RESULT_USE_CHECK
+HAPError HAPPlatformKeyValueStoreEnumerate(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreEnumerateCallback callback,
+        void* _Nullable context) {
+    HAPPrecondition(keyValueStore);
+    HAPPrecondition(callback);
+
+    bool shouldContinue = true;
+    for (unsigned key = 0; key <= UINT8_MAX && shouldContinue; key++) {
+        if (keyValueStore->recordOffsets[DomainKey(domain, (HAPPlatformKeyValueStoreKey) key)] ==
+            kRecordOffsetNone) {
+            continue;
+        }
+        HAPError err = callback(context, keyValueStore, domain, (HAPPlatformKeyValueStoreKey) key, &shouldContinue);
+        if (err) {
+            return err;
+        }
+    }
+    return kHAPError_None;
+}
+
+HAP_RESULT_USE_CHECK
+HAPError HAPPlatformKeyValueStorePurgeDomain(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        HAPPlatformKeyValueStoreDomain domain) {
+    HAPPrecondition(keyValueStore);
+
+    for (unsigned key = 0; key <= UINT8_MAX; key++) {
+        HAPError err = HAPPlatformKeyValueStoreRemove(keyValueStore, domain, (HAPPlatformKeyValueStoreKey) key);
+        if (err) {
+            return err;
+        }
+    }
+    return kHAPError_None;
+}
@@ -0,0 +1,287 @@
+// Disclaimer: IMPORTANT: This Apple software is supplied to you, by Apple Inc. ("Apple"), in your
+// capacity as a current, and in good standing, Licensee in the MFi Licensing Program. Use of this
+// Apple software is governed by and subject to the terms and conditions of your MFi License,
+// including, but not limited to, the restrictions specified in the provision entitled "Public
+// Software", and is further subject to your agreement to the following additional terms, and your
+// agreement that the use, installation, modification or redistribution of this Apple software
+// constitutes acceptance of these additional terms. If you do not agree with these additional terms,
+// you may not use, install, modify or redistribute this Apple software.
+//
+// Subject to all of these terms and in consideration of your agreement to abide by them, Apple grants
+// you, for as long as you are a current and in good-standing MFi Licensee, a personal, non-exclusive
+// license, under Apple's copyrights in this Apple software (the "Apple Software"), to use,
+// reproduce, and modify the Apple Software in source form, and to use, reproduce, modify, and
+// redistribute the Apple Software, with or without modifications, in binary form, in each of the
+// foregoing cases to the extent necessary to develop and/or manufacture "Proposed Products" and
+// "Licensed Products" in accordance with the terms of your MFi License. While you may not
+// redistribute the Apple Software in source form, should you redistribute the Apple Software in binary
+// form, you must retain this notice and the following text and disclaimers in all such redistributions
+// of the Apple Software. Neither the name, trademarks, service marks, or logos of Apple Inc. may be
+// used to endorse or promote products derived from the Apple Software without specific prior written
+// permission from Apple. Except as expressly stated in this notice, no other rights or licenses,
+// express or implied, are granted by Apple herein, including but not limited to any patent rights that
+// may be infringed by your derivative works or by other works in which the Apple Software may be
+// incorporated. Apple may terminate this license to the Apple Software by removing it from the list
+// of Licensed Technology in the MFi License, or otherwise in accordance with the terms of such MFi License.
+//
+// Unless you explicitly state otherwise, if you provide any ideas, suggestions, recommendations, bug
+// fixes or enhancements to Apple in connection with this software ("Feedback"), you hereby grant to
+// Apple a non-exclusive, fully paid-up, perpetual, irrevocable, worldwide license to make, use,
+// reproduce, incorporate, modify, display, perform, sell, make or have made derivative works of,
+// distribute (directly or indirectly) and sublicense, such Feedback in connection with Apple products
+// and services. Providing this Feedback is voluntary, but if you do provide Feedback to Apple, you
+// acknowledge and agree that Apple may exercise the license granted above without the payment of
+// royalties or further consideration to Participant.
+
+// The Apple Software is provided by Apple on an "AS IS" basis. APPLE MAKES NO WARRANTIES, EXPRESS OR
+// IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY
+// AND FITNESS FOR A PARTICULAR PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR
+// IN COMBINATION WITH YOUR PRODUCTS.
+//
+// IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION
+// AND/OR DISTRIBUTION OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+// (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// Copyright (C) 2015-2021 Apple Inc. All Rights Reserved.
+
+// Torn write harness of the host key-value store.
+//
+// Every round forks a child that runs random Sets and Removes until an injected power loss tears one of its flash
+// writes. The parent then mounts the file and checks it against a model of the writes: all completed writes are
+// stored, and the torn write is either stored completely or not at all. The next round writes on top of the
+// recovered store, so records are also programmed after torn ones.
+//
+// Build against the ADK host platform, for example:
+//
+//   cc -I<ADK>/HAP -I<ADK>/PAL -I<ADK>/PAL/Linux -Iadk/PAL/Linux
+//       adk/PAL/Linux/Harness/HAPPlatformKeyValueStoreHarness.c adk/PAL/Linux/HAPPlatformKeyValueStore.c
+//       <ADK host PAL and HAP sources>
+//
+// Usage: HAPPlatformKeyValueStoreHarness <file> [<rounds> [<seed>]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "HAPPlatform.h"
+#include "HAPPlatformKeyValueStore+Init.h"
+
+/** Number of domains written by the harness. */
+#define kNumDomains ((size_t) 4)
+
+/** Number of keys per domain written by the harness. */
+#define kNumKeys ((size_t) 8)
+
+/** Largest value written by the harness. */
+#define kMaxValueBytes ((size_t) 40)
+
+#define kPageSize ((size_t) 1024)
+#define kNumPages ((size_t) 4)
+
+/**
+ * Record of the model.
+ */
+typedef struct {
+    bool isStored;
+    uint8_t numBytes;
+    uint8_t bytes[kMaxValueBytes];
+} ModelRecord;
+
+/**
+ * Random Set or Remove.
+ */
+typedef struct {
+    HAPPlatformKeyValueStoreDomain domain;
+    HAPPlatformKeyValueStoreKey key;
+    ModelRecord record;
+} Operation;
+
+static uint32_t NextRandom(uint32_t* state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static void NextOperation(uint32_t* state, Operation* operation) {
+    operation->domain = (HAPPlatformKeyValueStoreDomain)(NextRandom(state) % kNumDomains);
+    operation->key = (HAPPlatformKeyValueStoreKey)(NextRandom(state) % kNumKeys);
+    operation->record.isStored = NextRandom(state) % 4 != 0;
+    operation->record.numBytes = (uint8_t)(NextRandom(state) % (kMaxValueBytes + 1));
+    for (size_t i = 0; i < operation->record.numBytes; i++) {
+        operation->record.bytes[i] = (uint8_t) NextRandom(state);
+    }
+}
+
+static void Apply(HAPPlatformKeyValueStoreRef keyValueStore, const Operation* operation) {
+    HAPError err = operation->record.isStored ?
+                           HAPPlatformKeyValueStoreSet(
+                                   keyValueStore,
+                                   operation->domain,
+                                   operation->key,
+                                   operation->record.bytes,
+                                   operation->record.numBytes) :
+                           HAPPlatformKeyValueStoreRemove(keyValueStore, operation->domain, operation->key);
+    if (err) {
+        fprintf(stderr, "Write of %02X.%02X failed: %d.\n", operation->domain, operation->key, err);
+        _exit(EXIT_FAILURE);
+    }
+}
+
+static bool IsEqual(const ModelRecord* a, const ModelRecord* b) {
+    if (a->isStored != b->isStored) {
+        return false;
+    }
+    return !a->isStored || (a->numBytes == b->numBytes && HAPRawBufferAreEqual(a->bytes, b->bytes, a->numBytes));
+}
+
+static void ReadRecord(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreKey key,
+        ModelRecord* record) {
+    uint8_t bytes[kMaxValueBytes + 1];
+    size_t numBytes;
+    bool found;
+    HAPError err = HAPPlatformKeyValueStoreGet(keyValueStore, domain, key, bytes, sizeof bytes, &numBytes, &found);
+    HAPAssert(!err);
+    HAPRawBufferZero(record, sizeof *record);
+    record->isStored = found;
+    if (found) {
+        HAPAssert(numBytes <= kMaxValueBytes);
+        record->numBytes = (uint8_t) numBytes;
+        HAPRawBufferCopyBytes(record->bytes, bytes, numBytes);
+    }
+}
+
+static HAPError CountKey(
+        void* _Nullable context,
+        HAPPlatformKeyValueStoreRef keyValueStore HAP_UNUSED,
+        HAPPlatformKeyValueStoreDomain domain HAP_UNUSED,
+        HAPPlatformKeyValueStoreKey key HAP_UNUSED,
+        bool* shouldContinue HAP_UNUSED) {
+    (*(size_t*) context)++;
+    return kHAPError_None;
+}
+
+/**
+ * Runs random writes on the store until the injected power loss. The index of the write in progress is stored in
+ * @p numStarted, which is shared with the parent.
+ */
+static void RunChild(const HAPPlatformKeyValueStoreOptions* options, uint32_t seed, volatile uint32_t* numStarted) {
+    HAPPlatformKeyValueStore keyValueStore;
+    HAPPlatformKeyValueStoreCreate(&keyValueStore, options);
+    for (uint32_t state = seed, i = 0;; i++) {
+        Operation operation;
+        NextOperation(&state, &operation);
+        *numStarted = i + 1;
+        Apply(&keyValueStore, &operation);
+    }
+}
+
+int main(int argc, char* _Nullable argv[_Nullable]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <file> [<rounds> [<seed>]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char* filePath = argv[1];
+    unsigned long numRounds = argc > 2 ? strtoul(argv[2], NULL, 0) : 1000;
+    uint32_t seed = argc > 3 ? (uint32_t) strtoul(argv[3], NULL, 0) : 1;
+    if (!seed) {
+        seed = 1;
+    }
+
+    volatile uint32_t* numStarted =
+            mmap(NULL, sizeof *numStarted, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (numStarted == MAP_FAILED) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+    unlink(filePath);
+
+    static ModelRecord model[kNumDomains][kNumKeys];
+    HAPPlatformKeyValueStoreOptions options = {
+        .filePath = filePath,
+        .pageSize = kPageSize,
+        .numPages = kNumPages,
+    };
+    uint64_t numWrites = 0;
+
+    for (unsigned long round = 0; round < numRounds; round++) {
+        uint32_t roundSeed = NextRandom(&seed);
+        options.numBytesUntilPowerLoss = 1 + NextRandom(&seed) % (2 * kPageSize * kNumPages);
+        *numStarted = 0;
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return EXIT_FAILURE;
+        }
+        if (!pid) {
+            RunChild(&options, roundSeed, numStarted);
+        }
+        int status;
+        if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != kHAPPlatformKeyValueStorePowerLossExitStatus) {
+            fprintf(stderr, "Round %lu: child did not end with a power loss (status 0x%X).\n", round, status);
+            return EXIT_FAILURE;
+        }
+
+        // Writes before the torn one completed.
+        Operation operation;
+        uint32_t state = roundSeed;
+        for (uint32_t i = 0; i + 1 < *numStarted; i++) {
+            NextOperation(&state, &operation);
+            model[operation.domain][operation.key] = operation.record;
+        }
+        numWrites += *numStarted;
+        bool isTornWrite = *numStarted != 0;
+        if (isTornWrite) {
+            NextOperation(&state, &operation);
+        }
+
+        HAPPlatformKeyValueStore keyValueStore;
+        options.numBytesUntilPowerLoss = 0;
+        HAPPlatformKeyValueStoreCreate(&keyValueStore, &options);
+        for (size_t domain = 0; domain < kNumDomains; domain++) {
+            size_t numExpected = 0;
+            for (size_t key = 0; key < kNumKeys; key++) {
+                ModelRecord record;
+                ReadRecord(&keyValueStore,
+                           (HAPPlatformKeyValueStoreDomain) domain,
+                           (HAPPlatformKeyValueStoreKey) key,
+                           &record);
+                if (isTornWrite && operation.domain == domain && operation.key == key &&
+                    IsEqual(&record, &operation.record)) {
+                    model[domain][key] = operation.record;
+                }
+                if (!IsEqual(&record, &model[domain][key])) {
+                    fprintf(stderr, "Round %lu: record %02zX.%02zX does not match.\n", round, domain, key);
+                    return EXIT_FAILURE;
+                }
+                numExpected += model[domain][key].isStored;
+            }
+            size_t numEnumerated = 0;
+            HAPError err = HAPPlatformKeyValueStoreEnumerate(
+                    &keyValueStore, (HAPPlatformKeyValueStoreDomain) domain, CountKey, &numEnumerated);
+            if (err || numEnumerated != numExpected) {
+                fprintf(stderr, "Round %lu: domain %02zX enumerates %zu keys.\n", round, domain, numEnumerated);
+                return EXIT_FAILURE;
+            }
+        }
+
+        HAPPlatformKeyValueStoreRelease(&keyValueStore);
+        if ((round + 1) % 100 == 0 || round + 1 == numRounds) {
+            printf("%lu rounds, %llu writes.\n", round + 1, (unsigned long long) numWrites);
+        }
+    }
+    unlink(filePath);
+    return EXIT_SUCCESS;
+}
@@ -47,10 +47,12 @@
 //
 // Copyright (C) 2015-2020 Apple Inc. All Rights Reserved.
 
+#include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
 
 #include "HAPPlatform.h"
 #include "HAPPlatformAccessorySetupNFC+Init.h"
+#include "HAPPlatformNfcCoexistence.h"
 
 #if HAVE_NFC
 #include <nfc_t2t_lib.h>
@@ -61,6 +63,92 @@ LOG_MODULE_REGISTER(pal_accessory_setup_nfc, CONFIG_PAL_ACCESSORY_SETUP_NFC_LOG_
 
 #if HAVE_NFC
 
+/**
+ * Number of encoded NDEF message buffers. One per pairing mode, and a spare so that the buffer of the running
+ * emulation is never re-encoded in place.
+ */
+#define kNumNDEFBuffers ((size_t) 3)
+
+/**
+ * Encoded NDEF message of a setup payload.
+ */
+typedef struct {
+    HAPSetupPayload setupPayload;
+    uint8_t bytes[100];
+    uint32_t numBytes;
+    uint32_t lastUsed;
+    bool isValid;
+} NDEFBuffer;
+
+static struct {
+    NDEFBuffer buffers[kNumNDEFBuffers];
+    NDEFBuffer* _Nullable active;
+    NDEFBuffer* _Nullable pending;
+    uint32_t useCounter;
+    bool emulationRunning;
+    struct k_mutex mutex;
+    struct k_work swapWork;
+} ndef;
+
+/**
+ * Set while a reader field is present, a payload swap then waits for the field to go away.
+ */
+static atomic_t fieldPresent;
+
+/**
+ * Restarts Type 2 Tag emulation with the given payload.
+ */
+static void RestartEmulation(const NDEFBuffer* buffer) {
+    HAPPrecondition(buffer);
+
+    if (ndef.emulationRunning) {
+        int e = nfc_t2t_emulation_stop();
+        if (e) {
+            LOG_ERR("nfc_t2t_emulation_stop failed: %lu.", (unsigned long) e);
+            HAPFatalError();
+        }
+        ndef.emulationRunning = false;
+    }
+
+    int e = nfc_t2t_payload_set(buffer->bytes, buffer->numBytes);
+    if (e) {
+        LOG_ERR("nfc_t2t_payload_set failed: %lu.", (unsigned long) e);
+        HAPFatalError();
+    }
+
+    e = nfc_t2t_emulation_start();
+    if (e) {
+        LOG_ERR("nfc_t2t_emulation_start failed: %lu.", (unsigned long) e);
+        HAPFatalError();
+    }
+    ndef.emulationRunning = true;
+}
+
+/**
+ * Makes the given payload the emulated one. Must be called with the mutex held, while no reader field is present.
+ *
+ * nfc_t2t_payload_set fails while emulation is running, so emulation is restarted. Without a field no reader can
+ * notice the short gap.
+ */
+static void SwapPayload(NDEFBuffer* buffer) {
+    HAPPrecondition(buffer);
+
+    ndef.pending = NULL;
+    RestartEmulation(buffer);
+    ndef.active = buffer;
+}
+
+/**
+ * Applies a payload swap deferred while a reader field was present.
+ */
+static void SwapWorkHandler(struct k_work* work HAP_UNUSED) {
+    k_mutex_lock(&ndef.mutex, K_FOREVER);
+    if (ndef.pending && !atomic_get(&fieldPresent)) {
+        SwapPayload(ndef.pending);
+    }
+    k_mutex_unlock(&ndef.mutex);
+}
+
 /**
  * NFC Event handler.
  */
@@ -70,10 +158,22 @@ static void NFCEventHandler(
         const uint8_t* p_data HAP_UNUSED,
         size_t data_length HAP_UNUSED) {
     switch (event) {
+        case NFC_T2T_EVENT_FIELD_ON: {
+            atomic_set(&fieldPresent, true);
+            HAPPlatformNfcCoexistenceEmulationFieldOn();
+            return;
+        }
+        case NFC_T2T_EVENT_FIELD_OFF: {
+            atomic_set(&fieldPresent, false);
+            HAPPlatformNfcCoexistenceEmulationFieldOff();
+            k_work_submit(&ndef.swapWork);
+            return;
+        }
+        case NFC_T2T_EVENT_DATA_READ: {
+            HAPPlatformNfcCoexistenceEmulationDataRead();
+            return;
+        }
         case NFC_T2T_EVENT_NONE:
-        case NFC_T2T_EVENT_FIELD_ON:
-        case NFC_T2T_EVENT_FIELD_OFF:
-        case NFC_T2T_EVENT_DATA_READ:
         case NFC_T2T_EVENT_STOPPED: {
             // No implementation required.
             return;
@@ -86,57 +186,76 @@ static void NFCEventHandler(
 }
 
 /**
- * Sets the NFC NDEF payload.
+ * Gets the buffer with the encoded NDEF message of a setup payload, encoding it if it is not cached yet.
+ * Must be called with the mutex held.
+ *
+ * @param      setupPayload         Setup payload.
  *
- * @param      payloadString        NFC payload string.
+ * @return Buffer containing the encoded NDEF message.
  */
-static void SetNFCPayload(char const* payloadString) {
-    HAPPrecondition(payloadString);
-
-    static uint8_t ndefMessageBytes[100];
-    static bool emulationRunning = false;
-
-    uint32_t numNDEFMessageBytes = sizeof ndefMessageBytes;
+static NDEFBuffer* GetNDEFBuffer(const HAPSetupPayload* setupPayload) {
+    HAPPrecondition(setupPayload);
 
-    // Stop Type 2 Tag emulation to encode new payload.
-    if (emulationRunning) {
-        int e = nfc_t2t_emulation_stop();
-        if (e) {
-            LOG_ERR("nfc_t2t_emulation_stop failed: %lu.", (unsigned long) e);
-            HAPFatalError();
+    NDEFBuffer* victim = NULL;
+    for (size_t i = 0; i < HAPArrayCount(ndef.buffers); i++) {
+        NDEFBuffer* buffer = &ndef.buffers[i];
+        if (buffer->isValid && HAPStringAreEqual(buffer->setupPayload.stringValue, setupPayload->stringValue)) {
+            buffer->lastUsed = ++ndef.useCounter;
+            return buffer;
+        }
+        // Never re-encode the buffer of the running emulation or of a pending swap.
+        if (buffer == ndef.active || buffer == ndef.pending) {
+            continue;
+        }
+        if (!victim || !buffer->isValid || (victim->isValid && buffer->lastUsed < victim->lastUsed)) {
+            victim = buffer;
         }
-        emulationRunning = false;
     }
+    HAPAssert(victim);
 
     // Encode URI message into buffer.
-    size_t numPayloadBytes = HAPStringGetNumBytes(payloadString);
+    size_t numPayloadBytes = HAPStringGetNumBytes(setupPayload->stringValue);
     HAPAssert(numPayloadBytes <= UINT8_MAX);
+    victim->numBytes = sizeof victim->bytes;
     int e = nfc_ndef_uri_msg_encode(
             NFC_URI_NONE,
-            (const uint8_t*) payloadString,
+            (const uint8_t*) setupPayload->stringValue,
             (uint8_t) numPayloadBytes,
-            ndefMessageBytes,
-            &numNDEFMessageBytes);
+            victim->bytes,
+            &victim->numBytes);
     if (e) {
         LOG_ERR("nfc_uri_msg_encode failed: %lu.", (unsigned long) e);
         HAPFatalError();
     }
+    HAPRawBufferCopyBytes(&victim->setupPayload, setupPayload, sizeof victim->setupPayload);
+    victim->lastUsed = ++ndef.useCounter;
+    victim->isValid = true;
 
-    // Set created message as the NFC payload.
-    e = nfc_t2t_payload_set(ndefMessageBytes, numNDEFMessageBytes);
-    if (e) {
-        LOG_ERR("nfc_t2t_payload_set failed: %lu.", (unsigned long) e);
-        HAPFatalError();
-    }
+    return victim;
+}
 
-    // Start Type 2 Tag emulation.
-    e = nfc_t2t_emulation_start();
-    if (e) {
-        LOG_ERR("nfc_t2t_emulation_start failed: %lu.", (unsigned long) e);
-        HAPFatalError();
+/**
+ * Sets the NFC NDEF payload.
+ *
+ * @param      setupPayload         Setup payload.
+ */
+static void SetNFCPayload(const HAPSetupPayload* setupPayload) {
+    HAPPrecondition(setupPayload);
+
+    k_mutex_lock(&ndef.mutex, K_FOREVER);
+
+    NDEFBuffer* buffer = GetNDEFBuffer(setupPayload);
+    if (buffer == ndef.active) {
+        // Unchanged payload, or a change reverted before the deferred swap.
+        ndef.pending = NULL;
+    } else if (ndef.emulationRunning && atomic_get(&fieldPresent)) {
+        // A phone may be reading the tag, swap once the field is gone.
+        ndef.pending = buffer;
+    } else {
+        SwapPayload(buffer);
     }
 
-    emulationRunning = true;
+    k_mutex_unlock(&ndef.mutex);
 }
 
 #endif
@@ -148,6 +267,9 @@ void HAPPlatformAccessorySetupNFCCreate(HAPPlatformAccessorySetupNFCRef setupNFC
     HAPRawBufferZero(setupNFC, sizeof *setupNFC);
 
 #if HAVE_NFC
+    k_mutex_init(&ndef.mutex);
+    k_work_init(&ndef.swapWork, SwapWorkHandler);
+
     // Set up NFC Type 2 Tag library.
     int e = nfc_t2t_setup(NFCEventHandler, NULL);
     if (e) {
@@ -169,7 +291,7 @@ void HAPPlatformAccessorySetupNFCUpdateSetupPayload(
             setupPayload->stringValue,
             isPairable ? "pairable" : "not pairable");
 #if HAVE_NFC
-    SetNFCPayload(setupPayload->stringValue);
+    SetNFCPayload(setupPayload);
 #endif
 }
 
@@ -77,6 +77,9 @@ extern "C" {
  * This is necessary because flash operations may take significant time in hardly predictable patterns.
  * If power is lost before all changes have been persisted, pending writes and deletions may be lost.
  * The implementation ensures that writes and deletions occur in the same order in which they have been requested.
+ * Reads return pending data. Pending writes are persisted by a work item on the dedicated `hap_kvs` work queue, which
+ * runs at CONFIG_HAP_KVS_WORKQ_PRIORITY. When the buffer is full, a write persists all pending writes before it
+ * returns.
  *
  * /!\ If critical data is being written it may be necessary to delay BLE communication until the data is persisted.
  * The `HAPPlatformKeyValueStoreIsBusy` function may be used to query whether there is still pending data.
@@ -146,6 +149,8 @@ typedef struct {
      * Buffer that contains data while it is being written to flash.
      *
      * - Buffer must have 4 byte alignment.
+     * - The first half is used to read and format records, and limits the size of a record.
+     * - The second half queues pending writes and deletions.
      */
     void *bytes;
 
@@ -190,6 +195,125 @@ void HAPPlatformKeyValueStoreCreate(
 HAP_RESULT_USE_CHECK
 bool HAPPlatformKeyValueStoreIsBusy(HAPPlatformKeyValueStoreRef keyValueStore);
 
+/**
+ * Begins a batch of writes.
+ *
+ * Until the batch is committed, `HAPPlatformKeyValueStoreSet`, `HAPPlatformKeyValueStoreOverrideAndSet` and
+ * `HAPPlatformKeyValueStoreRemove` calls of the calling thread are staged in the batch. Writes of other threads wait
+ * until the batch is committed.
+ *
+ * Reads are not isolated: Gets and enumerations of all threads, not only of the calling thread, return staged data
+ * before the batch is committed, and stop returning it if the batch is aborted.
+ *
+ * A committed batch is persisted as a whole: a journal with all its records is written first, so after a power loss
+ * either all or none of the records are in effect. Records written more than once in a batch are only persisted once.
+ * The staged records must fit into the second half of the buffer. A write that does not fit fails with
+ * kHAPError_OutOfResources, and the batch should be aborted.
+ *
+ * Batches may be nested. Only the outermost batch is committed. A domain cannot be purged in a batch.
+ *
+ * @param      keyValueStore        Key-value store.
+ */
+void HAPPlatformKeyValueStoreBeginBatch(HAPPlatformKeyValueStoreRef keyValueStore);
+
+/**
+ * Commits a batch of writes begun with `HAPPlatformKeyValueStoreBeginBatch`.
+ *
+ * If the batch or a nested batch was aborted, the outermost batch discards its writes instead.
+ *
+ * @param      keyValueStore        Key-value store.
+ */
+void HAPPlatformKeyValueStoreCommitBatch(HAPPlatformKeyValueStoreRef keyValueStore);
+
+/**
+ * Ends a batch of writes begun with `HAPPlatformKeyValueStoreBeginBatch` without committing it.
+ *
+ * The writes staged in the outermost batch are discarded. Writes staged after the abort, until the outermost batch
+ * ends, are discarded as well, so an outer batch is never committed without the writes of an aborted nested batch.
+ *
+ * @param      keyValueStore        Key-value store.
+ */
+void HAPPlatformKeyValueStoreAbortBatch(HAPPlatformKeyValueStoreRef keyValueStore);
+
+/**
+ * Contention counters of the key-value store lock.
+ *
+ * Gets share the lock. All other operations hold it exclusively.
+ */
+typedef struct {
+    /** Number of shared acquisitions. */
+    uint32_t numReads;
+
+    /** Number of shared acquisitions while another reader held the lock. */
+    uint32_t numConcurrentReads;
+
+    /** Number of shared acquisitions that waited for a writer. */
+    uint32_t numReadWaits;
+
+    /** Number of exclusive acquisitions. Recursive acquisitions are not counted. */
+    uint32_t numWrites;
+
+    /** Number of exclusive acquisitions that waited for readers or another writer. */
+    uint32_t numWriteWaits;
+
+    /** Largest number of readers that held the lock at the same time. */
+    uint32_t peakNumReaders;
+} HAPPlatformKeyValueStoreLockStats;
+
+/**
+ * Gets the contention counters of the key-value store lock.
+ *
+ * @param      keyValueStore        Key-value store.
+ * @param[out] stats                Contention counters.
+ */
+void HAPPlatformKeyValueStoreGetLockStats(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        HAPPlatformKeyValueStoreLockStats* stats);
+
+#if defined(CONFIG_HAP_KVS_PROVISIONING_IMPORT)
+/**
+ * Magic at the start of a provisioning blob, "HAPP" in little endian.
+ */
+#define kHAPPlatformKeyValueStoreProvisioningBlobMagic ((uint32_t) 0x50504148)
+
+/**
+ * Format version of a provisioning blob.
+ */
+#define kHAPPlatformKeyValueStoreProvisioningBlobVersion ((uint8_t) 1)
+
+/**
+ * Writes the records of the provisioning domain from one blob.
+ *
+ * The blob is little endian:
+ * - 4 bytes magic `kHAPPlatformKeyValueStoreProvisioningBlobMagic`.
+ * - 1 byte version `kHAPPlatformKeyValueStoreProvisioningBlobVersion`.
+ * - 1 byte number of records.
+ * - 2 bytes reserved, 0.
+ * - For each record: 1 byte key, 1 byte reserved 0, 2 bytes value length, value.
+ * - 4 bytes CRC-32 (IEEE 802.3, as computed by zlib) of all preceding bytes.
+ *
+ * The whole blob is validated before any record is written. The blob is only checked for integrity, not
+ * authenticity, which has to come from the factory channel. The records are then written and flushed, so they are in
+ * flash when this function returns. Records of the domain that are not in the blob are kept.
+ *
+ * Each record is written to flash once, without the journal of a batch. If power is lost before this function
+ * returns, some of the records may have been written, and the import must be repeated.
+ *
+ * @param      keyValueStore        Key-value store.
+ * @param      bytes                Blob.
+ * @param      numBytes             Length of the blob.
+ *
+ * @return kHAPError_None           If successful.
+ * @return kHAPError_InvalidData    If the blob is malformed or its checksum does not match.
+ * @return kHAPError_OutOfResources If the NVS ID table is full. Some records may have been written.
+ */
+HAP_RESULT_USE_CHECK
+HAPError HAPPlatformKeyValueStoreImportProvisioning(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        const void* bytes,
+        size_t numBytes);
+#endif
+
 #if __has_feature(nullability)
 #pragma clang assume_nonnull end
 #endif
@@ -58,105 +58,653 @@
 #include "HAPAssert.h"
 #include "HAPPlatformKeyValueStore+Init.h"
 #include "HAPPlatformKeyValueStore+SDKDomains.h"
+#include "HAPPlatformKeyValueStoreStats.h"
+#include "HAPPlatformTapTrace.h"
+
+#if defined(CONFIG_SETTINGS_NVS)
+#include <zephyr/fs/nvs.h>
+#endif
+
+#if defined(CONFIG_HAP_KVS_IDLE_GC)
+#include <zephyr/version.h>
+#if KERNEL_VERSION_NUMBER < ZEPHYR_VERSION(3, 4, 0)
+#error "CONFIG_HAP_KVS_IDLE_GC needs nvs_sector_use_next of Zephyr 3.4 or later."
+#endif
+#endif
+
+#if defined(CONFIG_HAP_KVS_PROVISIONING_IMPORT)
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+#endif
+
+#if defined(CONFIG_HAP_KVS_BENCHMARK)
+#include <zephyr/shell/shell.h>
+#endif
 
 LOG_MODULE_REGISTER(pal_key_value_store, CONFIG_PAL_KEY_VALUE_STORE_LOG_LEVEL);
 
 /**
  * Using "happl"/"fileID"/"recordID" as the tree structure for the settings subsys.
  *
+ * With CONFIG_HAP_KVS_BACKEND_NVS, records are stored under compact NVS IDs of the settings NVS file system instead,
+ * and the settings names are only used to migrate existing records.
  */
 
 #define MODULE_NAME            "happl"
 #define MAX_RECORD_LEN         60
-#define kMaxDomainSubtreeDepth 40
 
 #define SIZE_OF_WORD      4
 #define PADDING_INFO_SIZE 1
 
+/** The padding information holds the number of padded bytes in the lower bits. */
+#define kRecordPaddingMask     ((uint8_t) 0x03)
+/** The padding information flags a record with LZSS compressed value. */
+#define kRecordCompressedFlag  ((uint8_t) 0x80)
+
 #define SIZE_IN_WORDS(bytes) (((bytes) / SIZE_OF_WORD) + (size_t)((numBytesWithPaddingInfo) % SIZE_OF_WORD != 0))
 
+#define TRACE_ARG(domain, key) ((uint16_t)((domain) << 8 | (key)))
+
 #define DOMAIN_CHARS    5
 #define KEY_CHARS       5
 
+#ifndef CONFIG_HAP_KVS_WORKQ_STACK_SIZE
+#define CONFIG_HAP_KVS_WORKQ_STACK_SIZE 2048
+#endif
+
+#ifndef CONFIG_HAP_KVS_WORKQ_PRIORITY
+#define CONFIG_HAP_KVS_WORKQ_PRIORITY 10
+#endif
+
+#ifndef CONFIG_HAP_KVS_INDEX_SIZE
+#define CONFIG_HAP_KVS_INDEX_SIZE 128
+#endif
+
+#ifndef CONFIG_HAP_KVS_COMPRESSION_THRESHOLD
+#define CONFIG_HAP_KVS_COMPRESSION_THRESHOLD 64
+#endif
+
+#ifndef CONFIG_HAP_KVS_COMPRESSION_BUFFER_SIZE
+#define CONFIG_HAP_KVS_COMPRESSION_BUFFER_SIZE 512
+#endif
+
+#ifndef CONFIG_HAP_KVS_NVS_MAX_RECORDS
+#define CONFIG_HAP_KVS_NVS_MAX_RECORDS 128
+#endif
+
+#ifndef CONFIG_HAP_KVS_PROVISIONING_CACHE_SIZE
+#define CONFIG_HAP_KVS_PROVISIONING_CACHE_SIZE 1536
+#endif
+
+/** Number of records of the provisioning domain the provisioning cache holds. */
+#define kProvisioningCacheMaxRecords ((size_t) 8)
+
+#if defined(CONFIG_SETTINGS_NVS)
+/**
+ * Layout of the settings NVS backend: the settings name of a record is stored under an NVS ID starting at
+ * kSettingsNVSNameCountID + 1, and its value under the name ID + kSettingsNVSNameIDOffset. The highest name ID in use
+ * is stored under kSettingsNVSNameCountID.
+ */
+#define kSettingsNVSNameCountID  0x8000
+#define kSettingsNVSNameIDOffset 0x4000
+#endif
+
+#if defined(CONFIG_HAP_KVS_BACKEND_NVS)
+/**
+ * NVS ID of the NVS ID table. Records are stored under the IDs 0 to CONFIG_HAP_KVS_NVS_MAX_RECORDS - 1, so all IDs
+ * stay below the IDs of the settings NVS backend.
+ */
+#define kNVSTableID ((uint16_t) 0x7FFF)
+
+HAP_STATIC_ASSERT(CONFIG_HAP_KVS_NVS_MAX_RECORDS <= kNVSTableID, NVSMaxRecordsBelowTableID);
+
+/** Entry of the NVS ID table. The table is stored as an array of these entries. */
+typedef struct {
+    uint16_t domainKey;
+    uint16_t id;
+} NVSTableEntry;
+#endif
+
+/** Name ID of an index entry whose record location is not known. */
+#define kIndexNameIDUnknown 0
+
+/**
+ * Settings name of the batch journal. The journal holds the pending entries of a committed batch while they are
+ * persisted, and is replayed at start up if the device lost power before all of them were written.
+ */
+#define JOURNAL_NAME "batch"
+#define JOURNAL_PATH MODULE_NAME "/" JOURNAL_NAME
+
+/** Set in PendingEntry.numBytes of a batch header. The header is followed by the entries of the batch. */
+#define kPendingBatchFlag 0x8000
+
 static char separator_char = '/';
 
 struct settings_load_args {
-    char file_record_key[MAX_RECORD_LEN];
-    void* buf;
+    bool is_indexing;
+} settings_load_args;
+
+/**
+ * State of one Get call.
+ */
+typedef struct {
+    /** Buffer that holds the record once it has been read. */
+    uint8_t* buf;
+
+    /** Size of the stored record. */
     size_t file_record_size;
-    bool is_loading;
-    bool is_enumerating;
+
+    /** Number of bytes of the record read into buf, less than file_record_size if buf is too small. */
+    size_t num_read_bytes;
+
+    /** Buffer of the caller of Get. Records that fit are read into it, and not into the IO buffer. */
+    void* _Nullable in_place_buf;
+    size_t in_place_capacity;
+
     bool record_found;
-} settings_load_args;
+
+    /** Whether io_mutex is held, because the record is read into the IO buffer. */
+    bool holds_io_buffer;
+} ReadContext;
+
+/**
+ * Index entry of a stored record.
+ */
+typedef struct {
+    /** Domain in the upper byte, key in the lower byte. Entries are sorted by this field. */
+    uint16_t domainKey;
+
+    /** Backend ID of the settings name of the record, or kIndexNameIDUnknown. */
+    uint16_t nameID;
+
+    /** Size of the stored record including the padding information. */
+    uint16_t numBytes;
+} IndexEntry;
+
+/**
+ * Pending write of the write-back queue, followed by the formatted record.
+ */
+typedef struct {
+    /** Domain in the upper byte, key in the lower byte. */
+    uint16_t domainKey;
+
+    /**
+     * Size of the formatted record, or 0 if the record is removed. For a batch header, kPendingBatchFlag and the total
+     * size of the entries of the batch.
+     */
+    uint16_t numBytes;
+} PendingEntry;
+HAP_STATIC_ASSERT(sizeof(PendingEntry) % SIZE_OF_WORD == 0, PendingEntry_WordAligned);
 
 static struct {
     bool initialized;
     uint8_t* IOBuffor;
     size_t IOBufforCapacity;
 
-    /* Since all the set handlers in the settings are called once before the control reaches back to
-     * the caller of settings_load, we need to save the found keys under the given domain subtree
+    char domainKeyID[MAX_RECORD_LEN];
+
+    /**
+     * Reader/writer lock of the write-back queue, the index and the backend. Gets and the key lookups of Enumerate
+     * share it, everything else holds it exclusively. The exclusive lock is recursive. Waiting writers block new
+     * readers.
+     */
+    struct {
+        struct k_mutex mutex;
+        struct k_condvar condvar;
+        size_t numReaders;
+        size_t numWaitingWriters;
+        k_tid_t _Nullable writer;
+        size_t writerDepth;
+        HAPPlatformKeyValueStoreLockStats stats;
+    } lock;
+
+    /** Held by a Get that reads a record into the IO buffer, which is shared by all readers. */
+    struct k_mutex io_mutex;
+
+    /**
+     * RAM index of all records of the key-value store, built when the settings are loaded and kept up to date by
+     * Set, Remove and PurgeDomain. Records not in the index do not exist unless the index overflowed.
+     */
+    struct {
+        IndexEntry entries[CONFIG_HAP_KVS_INDEX_SIZE];
+        size_t numEntries;
+        bool isComplete;
+        bool isBypassed;
+    } index;
+
+#if defined(CONFIG_SETTINGS_NVS)
+    struct nvs_fs* _Nullable nvs;
+#endif
+
+#if defined(CONFIG_HAP_KVS_BACKEND_NVS)
+    /**
+     * NVS ID table that maps every record to the NVS ID it is stored under, sorted by domain and key. It is loaded at
+     * start up and stored again when a record is added or removed. A record is added to the table before it is
+     * written, and removed after it is deleted, so entries without a record are dropped when the table is loaded.
+     */
+    struct {
+        NVSTableEntry entries[CONFIG_HAP_KVS_NVS_MAX_RECORDS];
+        size_t numEntries;
+        bool isDirty;
+        struct k_mutex mutex;
+
+        /** Size of the record stored under each NVS ID, or 0. Kept in RAM only, so Get can read records in place. */
+        uint16_t recordSizes[CONFIG_HAP_KVS_NVS_MAX_RECORDS];
+    } nvsTable;
+#endif
+
+#if defined(CONFIG_HAP_KVS_IDLE_GC)
+    /**
+     * Idle garbage collection. Scheduled after every flush, it moves to the next NVS sector when the active sector has
+     * less free space than the reserve, so the garbage collection of NVS runs while the store is idle, and not inline
+     * in a later write.
      */
-    uint8_t keyDepthCount;
-    uint8_t keys[kMaxDomainSubtreeDepth];
+    struct {
+        struct k_work_delayable work;
+        bool isDisabled;
+    } gc;
+#endif
+
+#if defined(CONFIG_HAP_KVS_BENCHMARK)
+    /** Longest write to the backend, in cycles. */
+    uint32_t maxPersistCycles;
+#endif
+
+    /**
+     * Write-back queue in the second half of the buffer passed at creation. Sets and removals are appended at the
+     * tail and persisted in order by flush_work. The queue is reset when it runs empty.
+     */
+    struct {
+        uint8_t* bytes;
+        size_t capacity;
+        size_t head;
+        size_t tail;
+    } queue;
+    HAPPlatformKeyValueStoreRef keyValueStore;
+
+    /** Held while a pending write is persisted, to keep the order of writes. */
+    struct k_mutex flush_mutex;
+    struct k_work flush_work;
+
+    /**
+     * Low priority work queue of flush_work and the idle garbage collection, so that flash writes, sector erases and
+     * garbage collection of NVS do not block Bluetooth host work on the system work queue.
+     */
+    struct k_work_q workq;
+    bool isWorkqStarted;
 
-    char domainKeyID[MAX_RECORD_LEN];
-    struct k_mutex settings_load_subtree_mutex;
+    /** Incremented whenever a record is persisted or a domain purged, so enumerations know their keys are stale. */
+    atomic_t storedGeneration;
+
+    /**
+     * Open batch. Its header is not persisted before the batch is committed. Writes of other threads wait on
+     * batch_mutex while a batch is open.
+     */
+    struct {
+        size_t header;
+        size_t depth;
+        bool isOpen;
+
+        /** The batch was aborted. Its entries, including later ones, are discarded when the outermost batch ends. */
+        bool isAborted;
+    } batch;
+    struct k_mutex batch_mutex;
+
+#if defined(CONFIG_HAP_KVS_COMPRESSION)
+    /**
+     * Compressed value of the write in progress. Write compresses before it takes the lock, so it is guarded by
+     * batch_mutex.
+     */
+    uint8_t compressed[CONFIG_HAP_KVS_COMPRESSION_BUFFER_SIZE];
+#endif
+
+#if defined(CONFIG_HAP_KVS_PROVISIONING_CACHE)
+    /**
+     * Read-through cache of the provisioning domain, which is read repeatedly during pair setup and advertising but
+     * rarely written. Populated at start up, and again after writes to the domain.
+     */
+    struct {
+        struct k_mutex mutex;
+        struct {
+            HAPPlatformKeyValueStoreKey key;
+            uint16_t offset;
+            uint16_t numBytes;
+        } records[kProvisioningCacheMaxRecords];
+        size_t numRecords;
+        uint8_t bytes[CONFIG_HAP_KVS_PROVISIONING_CACHE_SIZE];
+        size_t numBytes;
+
+        /** The cache holds all records of the domain. */
+        bool isValid;
+
+        /**
+         * Incremented with the lock held exclusively whenever a write to the domain takes effect. The cache is stale
+         * if it was populated at an older generation.
+         */
+        atomic_t generation;
+        atomic_val_t populatedGeneration;
+
+        /** Gets of the populating thread bypass the cache. */
+        bool isPopulating;
+    } provisioningCache;
+#endif
 } local_context;
 
-struct direct_loader_param {
-// arbitrary value, optimized for maximum expected number of keys under domain
-// in case of bigger domain, purge will still work - it will use tail recurency to remove all elements from domain
-#define MAX_REPO_SIZE 10
-    uint8_t id_repo[MAX_REPO_SIZE];
-    uint8_t id;
-    enum { SUCCESS, NO_SPACE_FOR_ID } status;
-};
+K_THREAD_STACK_DEFINE(kvs_workq_stack, CONFIG_HAP_KVS_WORKQ_STACK_SIZE);
 
-static int setFromSettings(const char* key, size_t len, settings_read_cb read_cb, void* cb_arg) {
-    if (local_context.initialized) {
-        // loading from record and enumerating cannot happen at the same time
-        HAPPrecondition(!(settings_load_args.is_loading && settings_load_args.is_enumerating));
-        if (settings_load_args.is_loading) {
+#if defined(CONFIG_HAP_KVS_BENCHMARK)
+static HAPPlatformKeyValueStoreRef _Nullable benchmarkKeyValueStore;
+#endif
 
-            // load the value from persistance storage into given buffer
-            if (!strcmp(key, settings_load_args.file_record_key)) {
-                // Found the record
-                size_t read_len = read_cb(cb_arg, settings_load_args.buf, len);
+static uint16_t IndexDomainKey(HAPPlatformKeyValueStoreDomain domain, HAPPlatformKeyValueStoreKey key) {
+    return (uint16_t)(domain << 8 | key);
+}
+
+static void ReadLock(void) {
+    k_mutex_lock(&local_context.lock.mutex, K_FOREVER);
+    if (local_context.lock.writer == k_current_get()) {
+        // Read within a write of the same thread.
+        local_context.lock.writerDepth++;
+        k_mutex_unlock(&local_context.lock.mutex);
+        return;
+    }
+    HAPPlatformKeyValueStoreLockStats* stats = &local_context.lock.stats;
+    stats->numReads++;
+    if (local_context.lock.writer || local_context.lock.numWaitingWriters) {
+        stats->numReadWaits++;
+        do {
+            k_condvar_wait(&local_context.lock.condvar, &local_context.lock.mutex, K_FOREVER);
+        } while (local_context.lock.writer || local_context.lock.numWaitingWriters);
+    }
+    if (local_context.lock.numReaders++) {
+        stats->numConcurrentReads++;
+    }
+    stats->peakNumReaders = HAPMax(stats->peakNumReaders, (uint32_t) local_context.lock.numReaders);
+    k_mutex_unlock(&local_context.lock.mutex);
+}
+
+static void WriteLock(void) {
+    k_mutex_lock(&local_context.lock.mutex, K_FOREVER);
+    if (local_context.lock.writer == k_current_get()) {
+        local_context.lock.writerDepth++;
+        k_mutex_unlock(&local_context.lock.mutex);
+        return;
+    }
+    HAPPlatformKeyValueStoreLockStats* stats = &local_context.lock.stats;
+    stats->numWrites++;
+    if (local_context.lock.writer || local_context.lock.numReaders) {
+        stats->numWriteWaits++;
+        local_context.lock.numWaitingWriters++;
+        do {
+            k_condvar_wait(&local_context.lock.condvar, &local_context.lock.mutex, K_FOREVER);
+        } while (local_context.lock.writer || local_context.lock.numReaders);
+        local_context.lock.numWaitingWriters--;
+    }
+    local_context.lock.writer = k_current_get();
+    local_context.lock.writerDepth = 1;
+    k_mutex_unlock(&local_context.lock.mutex);
+}
+
+/**
+ * Releases a read or a write lock.
+ */
+static void Unlock(void) {
+    k_mutex_lock(&local_context.lock.mutex, K_FOREVER);
+    if (local_context.lock.writer == k_current_get()) {
+        if (!--local_context.lock.writerDepth) {
+            local_context.lock.writer = NULL;
+            k_condvar_broadcast(&local_context.lock.condvar);
+        }
+    } else {
+        HAPAssert(local_context.lock.numReaders);
+        if (!--local_context.lock.numReaders) {
+            k_condvar_broadcast(&local_context.lock.condvar);
+        }
+    }
+    k_mutex_unlock(&local_context.lock.mutex);
+}
+
+/**
+ * Finds the position of a record in the index.
+ *
+ * @param      domainKey            Domain and key of the record.
+ * @param[out] position             Position of the record, or where it would be inserted.
+ *
+ * @return true                     If the record is in the index.
+ * @return false                    Otherwise.
+ */
+static bool IndexFind(uint16_t domainKey, size_t* position) {
+    size_t low = 0;
+    size_t high = local_context.index.numEntries;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (local_context.index.entries[mid].domainKey < domainKey) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    *position = low;
+    return low < local_context.index.numEntries && local_context.index.entries[low].domainKey == domainKey;
+}
+
+static IndexEntry* _Nullable IndexGet(uint16_t domainKey) {
+    size_t position;
+    return IndexFind(domainKey, &position) ? &local_context.index.entries[position] : NULL;
+}
 
-                settings_load_args.file_record_size = read_len;
-                settings_load_args.record_found = true;
+static void IndexPut(uint16_t domainKey, uint16_t nameID, size_t numBytes) {
+    size_t position;
+    IndexEntry* entries = local_context.index.entries;
 
-                // Found the key, stop loading more values into the buffer
-                settings_load_args.is_loading = false;
+    if (!IndexFind(domainKey, &position)) {
+        if (local_context.index.numEntries >= HAPArrayCount(local_context.index.entries)) {
+            if (local_context.index.isComplete) {
+                LOG_WRN("Record index is full. Increase CONFIG_HAP_KVS_INDEX_SIZE.");
             }
+            local_context.index.isComplete = false;
+            return;
+        }
+        memmove(&entries[position + 1],
+                &entries[position],
+                (local_context.index.numEntries - position) * sizeof entries[0]);
+        local_context.index.numEntries++;
+        entries[position].domainKey = domainKey;
+        entries[position].nameID = nameID;
+    } else if (nameID != kIndexNameIDUnknown) {
+        entries[position].nameID = nameID;
+    }
+    entries[position].numBytes = (uint16_t) numBytes;
+}
+
+static void IndexRemoveDomain(HAPPlatformKeyValueStoreDomain domain) {
+    size_t first;
+    size_t last;
+    IndexEntry* entries = local_context.index.entries;
+
+    IndexFind(IndexDomainKey(domain, 0), &first);
+    for (last = first; last < local_context.index.numEntries && entries[last].domainKey >> 8 == domain; last++) {
+    }
+    memmove(&entries[first], &entries[last], (local_context.index.numEntries - last) * sizeof entries[0]);
+    local_context.index.numEntries -= last - first;
+}
+
+static void IndexRemove(uint16_t domainKey) {
+    size_t position;
+    IndexEntry* entries = local_context.index.entries;
+
+    if (IndexFind(domainKey, &position)) {
+        local_context.index.numEntries--;
+        memmove(&entries[position],
+                &entries[position + 1],
+                (local_context.index.numEntries - position) * sizeof entries[0]);
+    }
+}
+
+/**
+ * Parses the "<domain>/<key>" part of a settings name.
+ */
+static bool ParseRecordName(const char* name, HAPPlatformKeyValueStoreDomain* domain, HAPPlatformKeyValueStoreKey* key) {
+    char* end;
+    unsigned long value = strtoul(name, &end, 10);
+    if (end == name || *end != separator_char || value > UINT8_MAX) {
+        return false;
+    }
+    *domain = (HAPPlatformKeyValueStoreDomain) value;
+
+    name = end + 1;
+    value = strtoul(name, &end, 10);
+    if (end == name || *end != '\0' || value > UINT8_MAX) {
+        return false;
+    }
+    *key = (HAPPlatformKeyValueStoreKey) value;
+    return true;
+}
+
+/**
+ * Selects the buffer a record is read into: the buffer of the caller of Get if the record fits, otherwise the IO
+ * buffer, which is locked for the rest of the Get. Sets context->buf.
+ *
+ * @return Capacity of the selected buffer.
+ */
+static size_t SelectReadBuffer(ReadContext* context, size_t numBytes) {
+    if (context->in_place_buf && numBytes <= context->in_place_capacity) {
+        context->buf = context->in_place_buf;
+        return context->in_place_capacity;
+    }
+    if (!context->holds_io_buffer) {
+        k_mutex_lock(&local_context.io_mutex, K_FOREVER);
+        context->holds_io_buffer = true;
+    }
+    context->buf = local_context.IOBuffor;
+    return local_context.IOBufforCapacity;
+}
+
+#if defined(CONFIG_SETTINGS_NVS)
+/**
+ * Reads the settings name stored under an NVS ID.
+ *
+ * @return true                     If the ID holds a name of this module.
+ */
+static bool ReadNVSName(uint16_t nameID, char* name, size_t capacity) {
+    ssize_t rc = nvs_read(local_context.nvs, nameID, name, capacity - 1);
+    if (rc <= 0 || (size_t) rc >= capacity) {
+        return false;
+    }
+    name[rc] = '\0';
+    return !strncmp(name, MODULE_NAME, sizeof MODULE_NAME - 1) && name[sizeof MODULE_NAME - 1] == separator_char;
+}
+
+static uint16_t LastNVSNameID(void) {
+    uint16_t lastNameID;
+    if (nvs_read(local_context.nvs, kSettingsNVSNameCountID, &lastNameID, sizeof lastNameID) != sizeof lastNameID) {
+        return kSettingsNVSNameCountID;
+    }
+    return lastNameID;
+}
+
+/**
+ * Assigns the backend name IDs to all index entries, with one pass over the names stored in NVS.
+ */
+static void IndexResolveNameIDs(void) {
+    char name[MAX_RECORD_LEN];
+
+    for (uint16_t nameID = LastNVSNameID(); nameID > kSettingsNVSNameCountID; nameID--) {
+        HAPPlatformKeyValueStoreDomain domain;
+        HAPPlatformKeyValueStoreKey key;
+        if (!ReadNVSName(nameID, name, sizeof name) ||
+            !ParseRecordName(&name[sizeof MODULE_NAME], &domain, &key)) {
+            continue;
+        }
+        IndexEntry* entry = IndexGet(IndexDomainKey(domain, key));
+        if (entry && entry->nameID == kIndexNameIDUnknown) {
+            entry->nameID = nameID;
+        }
+    }
+}
+
+/**
+ * Looks up the name ID of a record that was just written. New names are appended by the backend, so the search starts
+ * with the highest name ID.
+ */
+static uint16_t FindNVSNameID(const char* recordName) {
+    char name[MAX_RECORD_LEN];
+
+    for (uint16_t nameID = LastNVSNameID(); nameID > kSettingsNVSNameCountID; nameID--) {
+        if (ReadNVSName(nameID, name, sizeof name) && !strcmp(name, recordName)) {
+            return nameID;
         }
+    }
+    return kIndexNameIDUnknown;
+}
+
+/**
+ * Reads the value of an indexed record directly by its backend ID.
+ *
+ * Called with the lock shared. Concurrent readers of a stale entry both clear its name ID.
+ *
+ * @return true                     If the record was read into context->buf.
+ */
+static bool IndexRead(IndexEntry* entry, ReadContext* context) {
+    if (!local_context.nvs || entry->nameID == kIndexNameIDUnknown) {
+        return false;
+    }
+    size_t capacity = SelectReadBuffer(context, entry->numBytes);
+    ssize_t rc = nvs_read(local_context.nvs, entry->nameID + kSettingsNVSNameIDOffset, context->buf, capacity);
+    if (rc != entry->numBytes) {
+        // The backend moved the record. Fall back to a lookup by name.
+        LOG_DBG("Index entry %04X is stale (%d).", entry->domainKey, (int) rc);
+        entry->nameID = kIndexNameIDUnknown;
+        return false;
+    }
+    context->file_record_size = (size_t) rc;
+    context->num_read_bytes = HAPMin((size_t) rc, capacity);
+    context->record_found = true;
+    return true;
+}
+#else
+static void IndexResolveNameIDs(void) {
+}
+
+static uint16_t FindNVSNameID(const char* recordName HAP_UNUSED) {
+    return kIndexNameIDUnknown;
+}
+
+static bool IndexRead(IndexEntry* entry HAP_UNUSED, ReadContext* context HAP_UNUSED) {
+    return false;
+}
+#endif
+
+/**
+ * Loads a record for Get, from a direct load of the settings name of the record.
+ */
+static int ReadLoader(const char* _Nullable name, size_t len, settings_read_cb read_cb, void* cb_arg, void* param) {
+    ReadContext* context = (ReadContext*) param;
+
+    if ((name && *name) || context->record_found) {
+        // Not the record itself.
+        return 0;
+    }
+    ssize_t read_len = read_cb(cb_arg, context->buf, HAPMin(len, SelectReadBuffer(context, len)));
+    if (read_len >= 0) {
+        context->file_record_size = len;
+        context->num_read_bytes = (size_t) read_len;
+        context->record_found = true;
+    }
+    return 0;
+}
 
-        else if (settings_load_args.is_enumerating) {
-            // just compare the key and extract the recordId string
-            if (!strncmp(key, settings_load_args.file_record_key, DOMAIN_CHARS)) {
-                // New RecordID found, return this the caller
-                if (local_context.keyDepthCount >= kMaxDomainSubtreeDepth) {
-                    LOG_ERR("More keys under given domain. Increase kMaxDomainSubtreeDepth value");
-                    HAPFatalError();
-                }
-
-                const int key_begin  = DOMAIN_CHARS + sizeof(separator_char);
-                if (strlen(key) <= key_begin) {
-                    LOG_DBG("There is no key in this file |%s| (len = %d)", key, key_begin);
-                    return 0;
-                }
-
-                const char* recordID_str = (char*) &key[key_begin];
-                const uint8_t recordID_int = atoi(recordID_str);
-
-                if ((0 == recordID_int) && (NULL == strstr(recordID_str,"0"))) {
-                    LOG_DBG("Invalid key |%s|", recordID_str);
-                }
-                else {
-                    local_context.keys[local_context.keyDepthCount++] = recordID_int;
-                    settings_load_args.record_found = true;
-                }
+static int setFromSettings(const char* key, size_t len, settings_read_cb read_cb, void* cb_arg) {
+    if (local_context.initialized) {
+        if (settings_load_args.is_indexing) {
+            // build the record index while the settings are loaded at start up
+            HAPPlatformKeyValueStoreDomain recordDomain;
+            HAPPlatformKeyValueStoreKey recordKey;
+            if (ParseRecordName(key, &recordDomain, &recordKey)) {
+                IndexPut(IndexDomainKey(recordDomain, recordKey), kIndexNameIDUnknown, len);
+            } else {
+                LOG_DBG("Invalid record name |%s|", key);
             }
         }
     }
@@ -165,9 +713,6 @@ static int setFromSettings(const char* key, size_t len, settings_read_cb read_cb
 
 static int commit(void) {
     // All settings are loaded
-    settings_load_args.is_loading = false;
-    settings_load_args.is_enumerating = false;
-
     return 0;
 }
 
@@ -177,18 +722,6 @@ static struct settings_handler HAPPlatform_settings = {
     .h_commit = commit,
 };
 
-static int direct_loader(const char* name, size_t len, settings_read_cb read_cb, void* cb_arg, void* param) {
-    struct direct_loader_param* loader = (struct direct_loader_param*) param;
-    if (loader->id < MAX_REPO_SIZE) {
-        loader->id_repo[loader->id++] = (uint8_t) atoi(name);
-        loader->status = SUCCESS;
-    } else {
-        loader->status = NO_SPACE_FOR_ID;
-    }
-
-    return loader->status;
-}
-
 static char digit_to_char(uint8_t digit) {
     static char map[] = { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9' };
     if (digit < sizeof(map))
@@ -213,34 +746,1135 @@ static void print_dec(char* out, size_t val, uint8_t chars) {
     out[chars] = 0;
 }
 
-static void domainKeyId_query(
-        char* out,
-        size_t capacity,
-        const char* module,
-        HAPPlatformKeyValueStoreDomain* domain,
-        HAPPlatformKeyValueStoreKey* key) {
-    HAPAssert(capacity >= strlen(module ? module : "") + sizeof(separator_char) + DOMAIN_CHARS + sizeof(separator_char) + KEY_CHARS + 1);
-
-    memset(out, 0, capacity);
-    size_t written = 0;
-    if (module) {
-        memcpy(out, module, strlen(module));
-        written += strlen(module);
-        out[written++] = separator_char;
+static void domainKeyId_query(
+        char* out,
+        size_t capacity,
+        const char* module,
+        HAPPlatformKeyValueStoreDomain* domain,
+        HAPPlatformKeyValueStoreKey* key) {
+    HAPAssert(capacity >= strlen(module ? module : "") + sizeof(separator_char) + DOMAIN_CHARS + sizeof(separator_char) + KEY_CHARS + 1);
+
+    memset(out, 0, capacity);
+    size_t written = 0;
+    if (module) {
+        memcpy(out, module, strlen(module));
+        written += strlen(module);
+        out[written++] = separator_char;
+    }
+
+    if (domain) {
+        print_dec(&out[written], (size_t) *domain, DOMAIN_CHARS);
+        written += DOMAIN_CHARS;
+    }
+
+    if (key) {
+        out[written++] = separator_char;
+        print_dec(&out[written], *key, KEY_CHARS);
+        written += KEY_CHARS;
+    }
+    out[written] = '\0';
+}
+
+static size_t RecordSize(size_t numBytes) {
+    return (PADDING_INFO_SIZE + numBytes + SIZE_OF_WORD - 1) / SIZE_OF_WORD * SIZE_OF_WORD;
+}
+
+#if defined(CONFIG_HAP_KVS_COMPRESSION)
+/**
+ * LZSS coding of compressed records.
+ *
+ * Items are grouped by eight behind a control byte, least significant bit first. A clear bit is a literal byte, a set
+ * bit a back-reference of two bytes: distance - 1 and length - kLZSSMinMatch. References may overlap their output.
+ */
+#define kLZSSWindow   ((size_t) 256)
+#define kLZSSMinMatch ((size_t) 3)
+#define kLZSSMaxMatch (kLZSSMinMatch + UINT8_MAX)
+
+/** Number of leading bytes of a value the incompressibility probe looks at. */
+#define kLZSSProbeBytes ((size_t) 64)
+
+/** Repeated sequences of kLZSSMinMatch bytes the probe must find for the value to be compressed. */
+#define kLZSSProbeMinMatches ((size_t) 4)
+
+/**
+ * Probes whether @p bytes are worth compressing, by counting sequences of kLZSSMinMatch bytes in the first
+ * kLZSSProbeBytes that repeat an earlier one. Keys, nonces and other random values have next to none, and are
+ * rejected after a single pass over the probe instead of a full search of the window for every byte.
+ *
+ * @return true                     If the value may compress.
+ */
+static bool LZSSProbe(const uint8_t* bytes, size_t numBytes) {
+    uint8_t last[64];
+    size_t numMatches = 0;
+
+    HAPRawBufferFill(last, sizeof last, UINT8_MAX);
+    numBytes = HAPMin(numBytes, kLZSSProbeBytes);
+    for (size_t i = 0; i + kLZSSMinMatch <= numBytes; i++) {
+        size_t hash = ((size_t) bytes[i] * 7 + (size_t) bytes[i + 1] * 3 + bytes[i + 2]) % sizeof last;
+        uint8_t j = last[hash];
+        if (j != UINT8_MAX && HAPRawBufferAreEqual(&bytes[j], &bytes[i], kLZSSMinMatch)) {
+            numMatches++;
+        }
+        last[hash] = (uint8_t) i;
+    }
+    return numMatches >= kLZSSProbeMinMatches;
+}
+
+/**
+ * Compresses @p bytes.
+ *
+ * @return Size of the compressed data, or 0 if it does not fit into @p maxOutBytes.
+ */
+static size_t LZSSCompress(uint8_t* out, size_t maxOutBytes, const uint8_t* bytes, size_t numBytes) {
+    size_t o = 0;
+    size_t control = 0;
+    unsigned bit = 8;
+
+    for (size_t i = 0; i < numBytes;) {
+        if (bit == 8) {
+            if (o == maxOutBytes) {
+                return 0;
+            }
+            control = o++;
+            out[control] = 0;
+            bit = 0;
+        }
+
+        size_t bestLength = 0;
+        size_t bestDistance = 0;
+        size_t maxLength = HAPMin(kLZSSMaxMatch, numBytes - i);
+        for (size_t distance = 1; distance <= HAPMin(i, kLZSSWindow) && bestLength < maxLength; distance++) {
+            size_t length = 0;
+            while (length < maxLength && bytes[i - distance + length] == bytes[i + length]) {
+                length++;
+            }
+            if (length > bestLength) {
+                bestLength = length;
+                bestDistance = distance;
+            }
+        }
+
+        if (bestLength >= kLZSSMinMatch) {
+            if (maxOutBytes - o < 2) {
+                return 0;
+            }
+            out[control] |= (uint8_t)(1u << bit);
+            out[o++] = (uint8_t)(bestDistance - 1);
+            out[o++] = (uint8_t)(bestLength - kLZSSMinMatch);
+            i += bestLength;
+        } else {
+            if (o == maxOutBytes) {
+                return 0;
+            }
+            out[o++] = bytes[i++];
+        }
+        bit++;
+    }
+    return o;
+}
+
+/**
+ * Decompresses @p bytes. Output beyond @p maxOutBytes is dropped.
+ *
+ * @return true                     If the compressed data is valid.
+ */
+static bool LZSSDecompress(
+        uint8_t* out,
+        size_t maxOutBytes,
+        size_t* numOutBytes,
+        const uint8_t* bytes,
+        size_t numBytes) {
+    size_t o = 0;
+
+    for (size_t i = 0; i < numBytes && o < maxOutBytes;) {
+        uint8_t control = bytes[i++];
+        for (unsigned bit = 0; bit < 8 && i < numBytes && o < maxOutBytes; bit++) {
+            if (!(control & (1u << bit))) {
+                out[o++] = bytes[i++];
+                continue;
+            }
+            if (numBytes - i < 2 || (size_t) bytes[i] + 1 > o) {
+                return false;
+            }
+            size_t distance = (size_t) bytes[i] + 1;
+            size_t length = HAPMin((size_t) bytes[i + 1] + kLZSSMinMatch, maxOutBytes - o);
+            i += 2;
+            for (size_t j = 0; j < length; j++, o++) {
+                out[o] = out[o - distance];
+            }
+        }
+    }
+    *numOutBytes = o;
+    return true;
+}
+#endif
+
+#if defined(CONFIG_HAP_KVS_COMPRESSION)
+/**
+ * Compresses a value above the threshold into local_context.compressed, if that saves at least a word.
+ * Called by Write with batch_mutex held, before it takes the lock.
+ *
+ * @return Size of the compressed value, or 0 if the value is stored uncompressed.
+ */
+static size_t CompressValue(const void* bytes, size_t numBytes) {
+    if (numBytes <= CONFIG_HAP_KVS_COMPRESSION_THRESHOLD) {
+        return 0;
+    }
+    HAPPlatformKeyValueStoreStatsStamp stamp = HAPPlatformKeyValueStoreStatsBegin();
+    size_t numCompressedBytes = 0;
+    if (LZSSProbe(bytes, numBytes)) {
+        numCompressedBytes = LZSSCompress(
+                local_context.compressed,
+                HAPMin(sizeof local_context.compressed, RecordSize(numBytes) - PADDING_INFO_SIZE - SIZE_OF_WORD),
+                bytes,
+                numBytes);
+    }
+    HAPPlatformKeyValueStoreStatsRecordCompression(
+            numCompressedBytes ? RecordSize(numBytes) - RecordSize(numCompressedBytes) : 0, stamp);
+    return numCompressedBytes;
+}
+#endif
+
+/**
+ * Formats a record: the number of padding bytes and @p flags, followed by the value, padded to a multiple of the word
+ * size.
+ *
+ * @return Size of the formatted record, RecordSize(numBytes).
+ */
+static size_t FormatRecord(uint8_t* record, const void* bytes, size_t numBytes, uint8_t flags) {
+    size_t recordSize = RecordSize(numBytes);
+    size_t numPaddedBytes = recordSize - PADDING_INFO_SIZE - numBytes;
+
+    record[0] = (uint8_t)(flags | numPaddedBytes);
+    HAPRawBufferCopyBytes(record + PADDING_INFO_SIZE, bytes, numBytes);
+    HAPRawBufferZero(record + PADDING_INFO_SIZE + numBytes, numPaddedBytes);
+    return recordSize;
+}
+
+#if defined(CONFIG_HAP_KVS_BACKEND_NVS)
+/**
+ * Finds the position of a record in the NVS ID table. Must be called with the table mutex held.
+ *
+ * @param      domainKey            Domain and key of the record.
+ * @param[out] position             Position of the record, or where it would be inserted.
+ *
+ * @return true                     If the record is in the table.
+ * @return false                    Otherwise.
+ */
+static bool NVSTableFind(uint16_t domainKey, size_t* position) {
+    const NVSTableEntry* entries = local_context.nvsTable.entries;
+    size_t low = 0;
+    size_t high = local_context.nvsTable.numEntries;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (entries[mid].domainKey < domainKey) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    *position = low;
+    return low < local_context.nvsTable.numEntries && entries[low].domainKey == domainKey;
+}
+
+/**
+ * Finds the NVS ID of a record, and adds the record to the table with the lowest free ID if it is not in the table.
+ * Must be called with the table mutex held.
+ *
+ * @return true                     If the record has an NVS ID.
+ * @return false                    If the table is full.
+ */
+static bool NVSTableAdd(uint16_t domainKey, uint16_t* id) {
+    NVSTableEntry* entries = local_context.nvsTable.entries;
+    size_t position;
+
+    if (NVSTableFind(domainKey, &position)) {
+        *id = entries[position].id;
+        return true;
+    }
+    if (local_context.nvsTable.numEntries >= HAPArrayCount(local_context.nvsTable.entries)) {
+        return false;
+    }
+
+    uint8_t isUsed[(CONFIG_HAP_KVS_NVS_MAX_RECORDS + 7) / 8];
+    HAPRawBufferZero(isUsed, sizeof isUsed);
+    for (size_t i = 0; i < local_context.nvsTable.numEntries; i++) {
+        isUsed[entries[i].id / 8] |= (uint8_t)(1u << (entries[i].id % 8));
+    }
+    uint16_t freeID = 0;
+    while (isUsed[freeID / 8] & (1u << (freeID % 8))) {
+        freeID++;
+    }
+
+    memmove(&entries[position + 1],
+            &entries[position],
+            (local_context.nvsTable.numEntries - position) * sizeof entries[0]);
+    local_context.nvsTable.numEntries++;
+    entries[position].domainKey = domainKey;
+    entries[position].id = freeID;
+    local_context.nvsTable.isDirty = true;
+    *id = freeID;
+    return true;
+}
+
+/**
+ * Stores the NVS ID table if it changed. Must be called with the table mutex held.
+ */
+static void NVSTableStore(void) {
+    if (!local_context.nvsTable.isDirty) {
+        return;
+    }
+    ssize_t rc = local_context.nvsTable.numEntries ?
+                         nvs_write(local_context.nvs,
+                                   kNVSTableID,
+                                   local_context.nvsTable.entries,
+                                   local_context.nvsTable.numEntries * sizeof local_context.nvsTable.entries[0]) :
+                         nvs_delete(local_context.nvs, kNVSTableID);
+    if (rc < 0) {
+        LOG_ERR("Cannot store NVS ID table: %d", (int) rc);
+        HAPFatalError();
+    }
+    local_context.nvsTable.isDirty = false;
+}
+
+/**
+ * Returns the NVS ID of a record that is about to be written, adding the record to the stored table if needed.
+ */
+static uint16_t NVSWriteID(uint16_t domainKey) {
+    uint16_t id;
+    k_mutex_lock(&local_context.nvsTable.mutex, K_FOREVER);
+    if (!NVSTableAdd(domainKey, &id)) {
+        LOG_ERR("NVS ID table is full. Increase CONFIG_HAP_KVS_NVS_MAX_RECORDS.");
+        HAPFatalError();
+    }
+    NVSTableStore();
+    k_mutex_unlock(&local_context.nvsTable.mutex);
+    return id;
+}
+
+/**
+ * Writes a formatted record under its NVS ID, and remembers its size.
+ *
+ * @return Result of nvs_write.
+ */
+static ssize_t NVSWrite(uint16_t domainKey, const void* record, size_t numBytes) {
+    uint16_t id = NVSWriteID(domainKey);
+    ssize_t rc = nvs_write(local_context.nvs, id, record, numBytes);
+    if (rc >= 0) {
+        k_mutex_lock(&local_context.nvsTable.mutex, K_FOREVER);
+        local_context.nvsTable.recordSizes[id] = (uint16_t) numBytes;
+        k_mutex_unlock(&local_context.nvsTable.mutex);
+    }
+    return rc;
+}
+
+/**
+ * Finds the NVS ID of a record, and the size of the stored record.
+ *
+ * @return true                     If the record is in the NVS ID table.
+ * @return false                    Otherwise.
+ */
+static bool NVSReadID(uint16_t domainKey, uint16_t* id, size_t* numBytes) {
+    size_t position;
+    k_mutex_lock(&local_context.nvsTable.mutex, K_FOREVER);
+    bool found = NVSTableFind(domainKey, &position);
+    if (found) {
+        *id = local_context.nvsTable.entries[position].id;
+        *numBytes = local_context.nvsTable.recordSizes[*id];
+    }
+    k_mutex_unlock(&local_context.nvsTable.mutex);
+    return found;
+}
+
+/**
+ * Reserves an NVS ID for a record that is written later.
+ *
+ * @return true                     If the record has an NVS ID.
+ * @return false                    If the table is full.
+ */
+static bool NVSReserveID(uint16_t domainKey) {
+    uint16_t id;
+    k_mutex_lock(&local_context.nvsTable.mutex, K_FOREVER);
+    bool isReserved = NVSTableAdd(domainKey, &id);
+    k_mutex_unlock(&local_context.nvsTable.mutex);
+    return isReserved;
+}
+
+/**
+ * Releases the NVS ID reserved for a record whose write was discarded, unless the record is stored.
+ */
+static void NVSReleaseID(uint16_t domainKey) {
+    size_t position;
+    k_mutex_lock(&local_context.nvsTable.mutex, K_FOREVER);
+    if (NVSTableFind(domainKey, &position)) {
+        NVSTableEntry* entries = local_context.nvsTable.entries;
+        uint8_t probe[SIZE_OF_WORD];
+        if (nvs_read(local_context.nvs, entries[position].id, probe, sizeof probe) == -ENOENT) {
+            local_context.nvsTable.numEntries--;
+            memmove(&entries[position],
+                    &entries[position + 1],
+                    (local_context.nvsTable.numEntries - position) * sizeof entries[0]);
+            local_context.nvsTable.isDirty = true;
+        }
+    }
+    k_mutex_unlock(&local_context.nvsTable.mutex);
+}
+
+/**
+ * Deletes a record and removes it from the NVS ID table.
+ */
+static void NVSDelete(uint16_t domainKey) {
+    size_t position;
+    k_mutex_lock(&local_context.nvsTable.mutex, K_FOREVER);
+    if (NVSTableFind(domainKey, &position)) {
+        NVSTableEntry* entries = local_context.nvsTable.entries;
+        int err = nvs_delete(local_context.nvs, entries[position].id);
+        if (err) {
+            LOG_ERR("Failed to delete record %04X: %d", domainKey, err);
+            HAPFatalError();
+        }
+        local_context.nvsTable.recordSizes[entries[position].id] = 0;
+        local_context.nvsTable.numEntries--;
+        memmove(&entries[position],
+                &entries[position + 1],
+                (local_context.nvsTable.numEntries - position) * sizeof entries[0]);
+        local_context.nvsTable.isDirty = true;
+        NVSTableStore();
+    }
+    k_mutex_unlock(&local_context.nvsTable.mutex);
+}
+
+/**
+ * Loads the NVS ID table, and drops entries that are invalid or whose record was never written.
+ */
+static void NVSTableLoad(void) {
+    NVSTableEntry* entries = local_context.nvsTable.entries;
+
+    k_mutex_lock(&local_context.nvsTable.mutex, K_FOREVER);
+    ssize_t rc = nvs_read(local_context.nvs, kNVSTableID, entries, sizeof local_context.nvsTable.entries);
+    if (rc == -ENOENT) {
+        rc = 0;
+    }
+    if (rc < 0) {
+        LOG_ERR("Cannot load NVS ID table: %d", (int) rc);
+        HAPFatalError();
+    }
+    if ((size_t) rc > sizeof local_context.nvsTable.entries) {
+        LOG_ERR("NVS ID table holds %zu records. Increase CONFIG_HAP_KVS_NVS_MAX_RECORDS.",
+                (size_t) rc / sizeof entries[0]);
+        HAPFatalError();
+    }
+    size_t numStored = (size_t) rc / sizeof entries[0];
+
+    uint8_t isUsed[(CONFIG_HAP_KVS_NVS_MAX_RECORDS + 7) / 8];
+    HAPRawBufferZero(isUsed, sizeof isUsed);
+    size_t numEntries = 0;
+    for (size_t i = 0; i < numStored; i++) {
+        uint16_t id = entries[i].id;
+        uint8_t probe[SIZE_OF_WORD];
+        ssize_t numBytes = -1;
+        if (id < CONFIG_HAP_KVS_NVS_MAX_RECORDS) {
+            numBytes = nvs_read(local_context.nvs, id, probe, sizeof probe);
+        }
+        if (numBytes < 0 || (isUsed[id / 8] & (1u << (id % 8))) ||
+            (numEntries && entries[numEntries - 1].domainKey >= entries[i].domainKey)) {
+            LOG_WRN("Dropping NVS ID table entry %04X -> %u.", entries[i].domainKey, id);
+            continue;
+        }
+        isUsed[id / 8] |= (uint8_t)(1u << (id % 8));
+        local_context.nvsTable.recordSizes[id] = (uint16_t) numBytes;
+        entries[numEntries++] = entries[i];
+    }
+    local_context.nvsTable.numEntries = numEntries;
+    local_context.nvsTable.isDirty = numEntries != numStored;
+    NVSTableStore();
+    k_mutex_unlock(&local_context.nvsTable.mutex);
+}
+
+/**
+ * Reads a record into the IO buffer. If the value is not requested, only the first word is read into @p probe.
+ */
+static void NVSRead(uint16_t domainKey, ReadContext* context, uint8_t probe[_Nonnull SIZE_OF_WORD]) {
+    uint16_t id;
+    size_t numBytes;
+    if (!NVSReadID(domainKey, &id, &numBytes)) {
+        return;
+    }
+    size_t capacity = SIZE_OF_WORD;
+    context->buf = probe;
+    if (context->in_place_buf) {
+        capacity = SelectReadBuffer(context, numBytes);
+    }
+    ssize_t rc = nvs_read(local_context.nvs, id, context->buf, capacity);
+    if (rc > (ssize_t) capacity && context->buf == context->in_place_buf) {
+        // The remembered size is stale, so the record did not fit into the buffer of the caller after all.
+        capacity = SelectReadBuffer(context, SIZE_MAX);
+        rc = nvs_read(local_context.nvs, id, context->buf, capacity);
+    }
+    if (rc == -ENOENT) {
+        return;
+    }
+    if (rc < 0) {
+        LOG_ERR("Cannot read record %04X: %d", domainKey, (int) rc);
+        HAPFatalError();
+    }
+    // The size of the stored record is returned even if only a part of it is read.
+    context->file_record_size = (size_t) rc;
+    context->num_read_bytes = HAPMin((size_t) rc, capacity);
+    context->record_found = true;
+}
+
+/**
+ * Marks the stored keys of a domain in @p keys, from the NVS ID table. Entries of records whose write is still pending,
+ * or was discarded, are skipped.
+ */
+static void NVSCollectKeys(HAPPlatformKeyValueStoreDomain domain, uint8_t keys[_Nonnull (UINT8_MAX + 1) / 8]) {
+    const NVSTableEntry* entries = local_context.nvsTable.entries;
+    size_t position;
+
+    k_mutex_lock(&local_context.nvsTable.mutex, K_FOREVER);
+    NVSTableFind(IndexDomainKey(domain, 0), &position);
+    for (; position < local_context.nvsTable.numEntries && entries[position].domainKey >> 8 == domain; position++) {
+        uint8_t probe[SIZE_OF_WORD];
+        if (nvs_read(local_context.nvs, entries[position].id, probe, sizeof probe) >= 0) {
+            uint8_t key = (uint8_t)(entries[position].domainKey & 0xFF);
+            keys[key / 8] |= (uint8_t)(1u << (key % 8));
+        }
+    }
+    k_mutex_unlock(&local_context.nvsTable.mutex);
+}
+
+/**
+ * Deletes the records of a domain listed in the NVS ID table, and stores the table once.
+ */
+static void NVSPurgeDomain(HAPPlatformKeyValueStoreDomain domain) {
+    NVSTableEntry* entries = local_context.nvsTable.entries;
+    size_t first;
+    size_t last;
+
+    k_mutex_lock(&local_context.nvsTable.mutex, K_FOREVER);
+    NVSTableFind(IndexDomainKey(domain, 0), &first);
+    for (last = first; last < local_context.nvsTable.numEntries && entries[last].domainKey >> 8 == domain; last++) {
+        // Deleting a missing ID does not write to flash.
+        int err = nvs_delete(local_context.nvs, entries[last].id);
+        if (err) {
+            LOG_ERR("Delete of %04X failed with err %d", entries[last].domainKey, err);
+            HAPFatalError();
+        }
+        local_context.nvsTable.recordSizes[entries[last].id] = 0;
+    }
+    if (last != first) {
+        memmove(&entries[first], &entries[last], (local_context.nvsTable.numEntries - last) * sizeof entries[0]);
+        local_context.nvsTable.numEntries -= last - first;
+        local_context.nvsTable.isDirty = true;
+        NVSTableStore();
+    }
+    k_mutex_unlock(&local_context.nvsTable.mutex);
+}
+
+// arbitrary value, records are migrated in passes of this many records
+#define MAX_REPO_SIZE 10
+
+struct migration_param {
+    uint16_t domainKeys[MAX_REPO_SIZE];
+    size_t count;
+};
+
+static int MigrateRecord(const char* name, size_t len, settings_read_cb read_cb, void* cb_arg, void* param) {
+    struct migration_param* migration = (struct migration_param*) param;
+    HAPPlatformKeyValueStoreDomain domain;
+    HAPPlatformKeyValueStoreKey key;
+
+    if (!strcmp(name, JOURNAL_NAME)) {
+        return 0;
+    }
+    if (!ParseRecordName(name, &domain, &key)) {
+        LOG_WRN("Record |%s| cannot be migrated.", name);
+        return 0;
+    }
+    if (migration->count >= MAX_REPO_SIZE) {
+        // Continue in the next pass.
+        return 1;
+    }
+
+    ssize_t numBytes = read_cb(cb_arg, local_context.IOBuffor, HAPMin(len, local_context.IOBufforCapacity));
+    if (numBytes < 0) {
+        return 0;
+    }
+    ssize_t rc = NVSWrite(IndexDomainKey(domain, key), local_context.IOBuffor, numBytes);
+    if (rc < 0) {
+        LOG_ERR("Cannot migrate record |%s|: %d", name, (int) rc);
+        HAPFatalError();
+    }
+    migration->domainKeys[migration->count++] = IndexDomainKey(domain, key);
+    return 0;
+}
+
+/**
+ * Moves records stored by the settings backend to their NVS IDs. A record is deleted from the settings after it has
+ * been written, so an interrupted migration resumes at the next start.
+ */
+static void MigrateFromSettings(void) {
+    struct migration_param migration;
+    size_t numMigrated = 0;
+
+    do {
+        migration.count = 0;
+        int err = settings_load_subtree_direct(MODULE_NAME, MigrateRecord, &migration);
+        if (err) {
+            LOG_ERR("Cannot load settings for migration: %d", err);
+            HAPFatalError();
+        }
+        for (size_t i = 0; i < migration.count; i++) {
+            HAPPlatformKeyValueStoreDomain domain = (HAPPlatformKeyValueStoreDomain)(migration.domainKeys[i] >> 8);
+            HAPPlatformKeyValueStoreKey key = (HAPPlatformKeyValueStoreKey)(migration.domainKeys[i] & 0xFF);
+            domainKeyId_query(
+                    local_context.domainKeyID, sizeof(local_context.domainKeyID), MODULE_NAME, &domain, &key);
+            err = settings_delete(local_context.domainKeyID);
+            if (err) {
+                LOG_ERR("Delete %s failed with err %d", local_context.domainKeyID, err);
+                HAPFatalError();
+            }
+        }
+        numMigrated += migration.count;
+    } while (migration.count);
+
+    if (numMigrated) {
+        LOG_INF("Migrated %zu records from settings to NVS IDs.", numMigrated);
+    }
+}
+#endif
+
+/**
+ * Writes a formatted record to the settings storage, or deletes it if @p record is NULL, and updates the index.
+ */
+static void Persist(uint16_t domainKey, const uint8_t* _Nullable record, size_t numBytes) {
+#if defined(CONFIG_HAP_KVS_BENCHMARK)
+    uint32_t start = k_cycle_get_32();
+#endif
+    atomic_inc(&local_context.storedGeneration);
+    HAPPlatformKeyValueStoreStatsRecordPersist(
+            (HAPPlatformKeyValueStoreDomain)(domainKey >> 8),
+            (HAPPlatformKeyValueStoreKey)(domainKey & 0xFF),
+            record ? numBytes : 0);
+#if defined(CONFIG_HAP_KVS_BACKEND_NVS)
+    if (record) {
+        ssize_t rc = NVSWrite(domainKey, record, numBytes);
+        if (rc < 0) {
+            LOG_ERR("Failed to write record %04X: %d", domainKey, (int) rc);
+            HAPFatalError();
+        }
+    } else {
+        NVSDelete(domainKey);
+    }
+#else
+    HAPPlatformKeyValueStoreDomain domain = (HAPPlatformKeyValueStoreDomain)(domainKey >> 8);
+    HAPPlatformKeyValueStoreKey key = (HAPPlatformKeyValueStoreKey)(domainKey & 0xFF);
+    char name[MAX_RECORD_LEN];
+
+    domainKeyId_query(name, sizeof name, MODULE_NAME, &domain, &key);
+    if (record) {
+        int err = settings_save_one(name, record, numBytes);
+        if (err) {
+            LOG_ERR("Failed to write record %s: %d", name, err);
+            HAPFatalError();
+        }
+    } else {
+        // removing the exact matched key (not a subtree)
+        settings_delete(name);
+    }
+
+    WriteLock();
+    if (record) {
+        // The backend keeps the name ID of an existing record, so only new records need a lookup.
+        IndexEntry* entry = IndexGet(domainKey);
+        IndexPut(domainKey,
+                 (entry && entry->nameID != kIndexNameIDUnknown) ? entry->nameID : FindNVSNameID(name),
+                 numBytes);
+    } else {
+        IndexRemove(domainKey);
+    }
+    Unlock();
+#endif
+#if defined(CONFIG_HAP_KVS_BENCHMARK)
+    local_context.maxPersistCycles = HAPMax(local_context.maxPersistCycles, k_cycle_get_32() - start);
+#endif
+}
+
+static bool IsBatchHeader(const PendingEntry* entry) {
+    return (entry->numBytes & kPendingBatchFlag) != 0;
+}
+
+/**
+ * Size of a pending entry in the queue. The entries of a batch follow its header.
+ */
+static size_t PendingEntrySize(const PendingEntry* entry) {
+    return sizeof *entry + (IsBatchHeader(entry) ? 0 : entry->numBytes);
+}
+
+/**
+ * Finds the latest pending write of a record.
+ */
+static const PendingEntry* _Nullable QueueFind(uint16_t domainKey) {
+    const PendingEntry* latest = NULL;
+
+    for (size_t offset = local_context.queue.head; offset < local_context.queue.tail;) {
+        const PendingEntry* entry = (const PendingEntry*) &local_context.queue.bytes[offset];
+        if (!IsBatchHeader(entry) && entry->domainKey == domainKey) {
+            latest = entry;
+        }
+        offset += PendingEntrySize(entry);
+    }
+    return latest;
+}
+
+#if defined(CONFIG_HAP_KVS_PROVISIONING_CACHE)
+/**
+ * Invalidates the provisioning cache after a write to @p domain. It is populated again by the next Get.
+ *
+ * Must be called with the lock held exclusively, together with the write, so that no Get populates the cache with the
+ * old record in between. Takes no mutex, as the cache is populated with the cache mutex held.
+ */
+static void ProvisioningCacheInvalidate(HAPPlatformKeyValueStoreDomain domain) {
+    if (domain == kSDKKeyValueStoreDomain_Provisioning) {
+        atomic_inc(&local_context.provisioningCache.generation);
+    }
+}
+#endif
+
+static void QueueUpdateNumBytes(void) {
+    HAPPlatformKeyValueStoreRef keyValueStore = local_context.keyValueStore;
+
+    keyValueStore->numBytes = local_context.queue.tail - local_context.queue.head;
+    keyValueStore->peakNumBytes = HAPMax(keyValueStore->peakNumBytes, keyValueStore->numBytes);
+    keyValueStore->busy = keyValueStore->numBytes != 0;
+}
+
+/**
+ * Appends a write, or a removal if @p bytes is NULL, to the write-back queue. The value is copied as it is, with the
+ * record flags @p flags.
+ *
+ * @return true                     If the write was queued.
+ * @return false                    If the queue is full.
+ */
+static bool QueuePush(uint16_t domainKey, const void* _Nullable bytes, size_t numBytes, uint8_t flags) {
+    size_t recordSize = bytes ? RecordSize(numBytes) : 0;
+
+    if (local_context.queue.capacity - local_context.queue.tail < sizeof(PendingEntry) + recordSize) {
+        return false;
+    }
+
+    PendingEntry* entry = (PendingEntry*) &local_context.queue.bytes[local_context.queue.tail];
+    entry->domainKey = domainKey;
+    if (bytes) {
+        FormatRecord((uint8_t*) &entry[1], bytes, numBytes, flags);
+    }
+    entry->numBytes = (uint16_t) recordSize;
+    local_context.queue.tail += sizeof *entry + recordSize;
+    QueueUpdateNumBytes();
+
+    if (!local_context.batch.isOpen) {
+        k_work_submit_to_queue(&local_context.workq, &local_context.flush_work);
+    }
+    return true;
+}
+
+/**
+ * Moves the pending entries to the start of the queue, to reuse the space of persisted entries while a batch is open.
+ * Must be called with flush_mutex held.
+ */
+static void QueueCompact(void) {
+    size_t head = local_context.queue.head;
+
+    memmove(local_context.queue.bytes, &local_context.queue.bytes[head], local_context.queue.tail - head);
+    local_context.queue.tail -= head;
+    local_context.queue.head = 0;
+    if (local_context.batch.isOpen) {
+        local_context.batch.header -= head;
+    }
+}
+
+/**
+ * Drops the entries of the open batch that are superseded by a later entry of the batch.
+ */
+static void BatchDropSuperseded(void) {
+    for (size_t offset = local_context.batch.header + sizeof(PendingEntry); offset < local_context.queue.tail;) {
+        const PendingEntry* entry = (const PendingEntry*) &local_context.queue.bytes[offset];
+        size_t entrySize = PendingEntrySize(entry);
+        bool isSuperseded = false;
+        for (size_t later = offset + entrySize; later < local_context.queue.tail && !isSuperseded;) {
+            const PendingEntry* laterEntry = (const PendingEntry*) &local_context.queue.bytes[later];
+            isSuperseded = laterEntry->domainKey == entry->domainKey;
+            later += PendingEntrySize(laterEntry);
+        }
+        if (isSuperseded) {
+            memmove(&local_context.queue.bytes[offset],
+                    &local_context.queue.bytes[offset + entrySize],
+                    local_context.queue.tail - offset - entrySize);
+            local_context.queue.tail -= entrySize;
+        } else {
+            offset += entrySize;
+        }
+    }
+    QueueUpdateNumBytes();
+}
+
+/**
+ * Drops the superseded entries of the open batch, and closes the batch so that it can be persisted.
+ */
+static void BatchClose(void) {
+    PendingEntry* header = (PendingEntry*) &local_context.queue.bytes[local_context.batch.header];
+
+    BatchDropSuperseded();
+    header->numBytes = (uint16_t)(kPendingBatchFlag | (local_context.queue.tail - local_context.batch.header - sizeof *header));
+    local_context.batch.isOpen = false;
+    QueueUpdateNumBytes();
+
+    k_work_submit_to_queue(&local_context.workq, &local_context.flush_work);
+}
+
+/**
+ * Persists a sequence of pending entries. More than one entry are first written as a journal in a single settings
+ * record, which commits them: if power is lost before all entries are persisted, the journal is replayed at start up.
+ */
+static void PersistEntries(const uint8_t* entries, size_t numBytes) {
+    size_t numEntries = 0;
+    for (size_t offset = 0; offset < numBytes; numEntries++) {
+        offset += PendingEntrySize((const PendingEntry*) &entries[offset]);
+    }
+
+    if (numEntries > 1) {
+        int err = settings_save_one(JOURNAL_PATH, entries, numBytes);
+        if (err) {
+            LOG_ERR("Failed to write batch journal: %d", err);
+            HAPFatalError();
+        }
+        HAPPlatformKeyValueStoreStatsRecordJournal(numBytes);
+    }
+    for (size_t offset = 0; offset < numBytes;) {
+        const PendingEntry* entry = (const PendingEntry*) &entries[offset];
+        Persist(entry->domainKey, entry->numBytes ? (const uint8_t*) &entry[1] : NULL, entry->numBytes);
+        offset += PendingEntrySize(entry);
+    }
+    if (numEntries > 1) {
+        settings_delete(JOURNAL_PATH);
+    }
+}
+
+static int LoadJournal(
+        const char* name HAP_UNUSED,
+        size_t len,
+        settings_read_cb read_cb,
+        void* cb_arg,
+        void* param) {
+    size_t* numBytes = (size_t*) param;
+
+    ssize_t rc = read_cb(cb_arg, local_context.queue.bytes, HAPMin(len, local_context.queue.capacity));
+    *numBytes = rc > 0 ? (size_t) rc : 0;
+    return 0;
+}
+
+/**
+ * Completes a batch that was committed but not completely persisted before the device lost power.
+ */
+static void ReplayJournal(void) {
+    size_t numBytes = 0;
+
+    int err = settings_load_subtree_direct(JOURNAL_PATH, LoadJournal, &numBytes);
+    if (err) {
+        LOG_ERR("Cannot load batch journal: %d", err);
+        HAPFatalError();
+    }
+    if (!numBytes) {
+        return;
+    }
+
+    // Only complete entries are replayed. The journal itself is written atomically.
+    size_t offset = 0;
+    while (offset + sizeof(PendingEntry) <= numBytes &&
+           offset + PendingEntrySize((const PendingEntry*) &local_context.queue.bytes[offset]) <= numBytes) {
+        offset += PendingEntrySize((const PendingEntry*) &local_context.queue.bytes[offset]);
+    }
+    LOG_INF("Replaying %zu bytes of an interrupted batch.", offset);
+    PersistEntries(local_context.queue.bytes, offset);
+    settings_delete(JOURNAL_PATH);
+}
+
+/**
+ * Persists the oldest pending write, or the oldest committed batch.
+ *
+ * @return true                     If a write was persisted.
+ * @return false                    If no write is pending.
+ */
+static bool FlushOne(void) {
+    k_mutex_lock(&local_context.flush_mutex, K_FOREVER);
+    WriteLock();
+    bool isPending = local_context.queue.head != local_context.queue.tail &&
+                     !(local_context.batch.isOpen && local_context.batch.header == local_context.queue.head);
+    const PendingEntry* entry = (const PendingEntry*) &local_context.queue.bytes[local_context.queue.head];
+    Unlock();
+
+    if (isPending) {
+        // The entry stays queued, and visible to Get, until it is persisted. Only the flush advances the head.
+        size_t entrySize = PendingEntrySize(entry);
+        if (IsBatchHeader(entry)) {
+            size_t numBatchBytes = entry->numBytes & ~kPendingBatchFlag;
+            PersistEntries((const uint8_t*) &entry[1], numBatchBytes);
+            entrySize += numBatchBytes;
+        } else {
+            Persist(entry->domainKey, entry->numBytes ? (const uint8_t*) &entry[1] : NULL, entry->numBytes);
+        }
+
+        WriteLock();
+        local_context.queue.head += entrySize;
+        if (local_context.queue.head == local_context.queue.tail) {
+            local_context.queue.head = 0;
+            local_context.queue.tail = 0;
+        }
+        QueueUpdateNumBytes();
+        Unlock();
+    }
+    k_mutex_unlock(&local_context.flush_mutex);
+    return isPending;
+}
+
+static void FlushAll(void) {
+    while (FlushOne()) {
+    }
+}
+
+#if defined(CONFIG_HAP_KVS_IDLE_GC)
+static void GCWorkHandler(struct k_work* work HAP_UNUSED) {
+    if (!local_context.nvs || local_context.gc.isDisabled) {
+        return;
+    }
+
+    k_mutex_lock(&local_context.flush_mutex, K_FOREVER);
+    if (local_context.queue.head != local_context.queue.tail) {
+        // Not idle. The flush of the pending writes schedules the next attempt.
+        k_mutex_unlock(&local_context.flush_mutex);
+        return;
+    }
+    ssize_t freeBytes = nvs_sector_max_data_size(local_context.nvs);
+    if (freeBytes >= 0 && (size_t) freeBytes < CONFIG_HAP_KVS_IDLE_GC_RESERVE) {
+        uint32_t start = k_cycle_get_32();
+        int err = nvs_sector_use_next(local_context.nvs);
+        if (err) {
+            LOG_WRN("Idle garbage collection failed: %d", err);
+        } else {
+            LOG_DBG("Idle garbage collection took %u us, %d bytes free in the active sector.",
+                    (unsigned) k_cyc_to_us_floor32(k_cycle_get_32() - start),
+                    (int) nvs_sector_max_data_size(local_context.nvs));
+        }
+    }
+    k_mutex_unlock(&local_context.flush_mutex);
+}
+#endif
+
+static void FlushWorkHandler(struct k_work* work HAP_UNUSED) {
+    FlushAll();
+#if defined(CONFIG_HAP_KVS_IDLE_GC)
+    k_work_reschedule_for_queue(&local_context.workq, &local_context.gc.work, K_MSEC(CONFIG_HAP_KVS_IDLE_GC_DELAY_MS));
+#endif
+}
+
+/**
+ * Queues a write, or a removal if @p bytes is NULL. If the queue is full, all pending writes are persisted first, and
+ * a record that does not fit into the empty queue is written through.
+ *
+ * A batch is committed as a whole, so a write that does not fit into the queue next to the open batch fails.
+ *
+ * @return kHAPError_None           If successful.
+ * @return kHAPError_OutOfResources If the open batch does not fit into the write-back queue.
+ */
+static HAPError Write(uint16_t domainKey, const void* _Nullable bytes, size_t numBytes) {
+    k_mutex_lock(&local_context.batch_mutex, K_FOREVER);
+    if (local_context.batch.isOpen && local_context.batch.isAborted) {
+        // The outermost batch discards the write anyway.
+        k_mutex_unlock(&local_context.batch_mutex);
+        return kHAPError_None;
+    }
+#if defined(CONFIG_HAP_KVS_BACKEND_NVS)
+    // A full table fails the write here instead of the flush.
+    if (bytes && !NVSReserveID(domainKey)) {
+        LOG_ERR("NVS ID table is full. Increase CONFIG_HAP_KVS_NVS_MAX_RECORDS.");
+        k_mutex_unlock(&local_context.batch_mutex);
+        return kHAPError_OutOfResources;
+    }
+#endif
+    uint8_t flags = 0;
+#if defined(CONFIG_HAP_KVS_COMPRESSION)
+    // Compress before taking the lock, so Gets are not blocked by the search for matches.
+    size_t numCompressedBytes = bytes ? CompressValue(bytes, numBytes) : 0;
+    if (numCompressedBytes) {
+        bytes = local_context.compressed;
+        numBytes = numCompressedBytes;
+        flags = kRecordCompressedFlag;
+    }
+#endif
+    WriteLock();
+    bool isQueued = QueuePush(domainKey, bytes, numBytes, flags);
+#if defined(CONFIG_HAP_KVS_PROVISIONING_CACHE)
+    if (isQueued) {
+        ProvisioningCacheInvalidate((HAPPlatformKeyValueStoreDomain)(domainKey >> 8));
+    }
+#endif
+    Unlock();
+    if (isQueued) {
+        k_mutex_unlock(&local_context.batch_mutex);
+        return kHAPError_None;
+    }
+
+    HAPError err = kHAPError_None;
+    k_mutex_lock(&local_context.flush_mutex, K_FOREVER);
+    FlushAll();
+    WriteLock();
+    QueueCompact();
+    isQueued = QueuePush(domainKey, bytes, numBytes, flags);
+    if (!isQueued && local_context.batch.isOpen) {
+        BatchDropSuperseded();
+        isQueued = QueuePush(domainKey, bytes, numBytes, flags);
+        if (!isQueued) {
+            LOG_ERR("Batch does not fit into the write-back queue.");
+            err = kHAPError_OutOfResources;
+#if defined(CONFIG_HAP_KVS_BACKEND_NVS)
+            if (!QueueFind(domainKey)) {
+                NVSReleaseID(domainKey);
+            }
+#endif
+        }
+    } else if (!isQueued) {
+        HAPAssert(RecordSize(numBytes) <= local_context.IOBufforCapacity);
+        size_t recordSize = bytes ? FormatRecord(local_context.IOBuffor, bytes, numBytes, flags) : 0;
+        Persist(domainKey, bytes ? local_context.IOBuffor : NULL, recordSize);
+    }
+#if defined(CONFIG_HAP_KVS_PROVISIONING_CACHE)
+    if (!err) {
+        ProvisioningCacheInvalidate((HAPPlatformKeyValueStoreDomain)(domainKey >> 8));
+    }
+#endif
+    Unlock();
+    k_mutex_unlock(&local_context.flush_mutex);
+    k_mutex_unlock(&local_context.batch_mutex);
+    return err;
+}
+
+#if defined(CONFIG_HAP_KVS_PROVISIONING_CACHE)
+static HAPError PopulateProvisioningCacheCallback(
+        void* _Nullable context,
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreKey key,
+        bool* shouldContinue) {
+    bool* isComplete = (bool*) context;
+    HAPAssert(isComplete);
+
+    size_t maxBytes = sizeof local_context.provisioningCache.bytes - local_context.provisioningCache.numBytes;
+    if (local_context.provisioningCache.numRecords == HAPArrayCount(local_context.provisioningCache.records) ||
+        !maxBytes) {
+        *isComplete = false;
+        *shouldContinue = false;
+        return kHAPError_None;
+    }
+    uint8_t* bytes = &local_context.provisioningCache.bytes[local_context.provisioningCache.numBytes];
+    size_t numBytes;
+    bool found;
+    HAPError err = HAPPlatformKeyValueStoreGet(keyValueStore, domain, key, bytes, maxBytes, &numBytes, &found);
+    if (err || !found) {
+        return err;
+    }
+    if (numBytes == maxBytes) {
+        // The record may be truncated.
+        *isComplete = false;
+        *shouldContinue = false;
+        return kHAPError_None;
+    }
+    local_context.provisioningCache.records[local_context.provisioningCache.numRecords].key = key;
+    local_context.provisioningCache.records[local_context.provisioningCache.numRecords].offset =
+            (uint16_t) local_context.provisioningCache.numBytes;
+    local_context.provisioningCache.records[local_context.provisioningCache.numRecords].numBytes = (uint16_t) numBytes;
+    local_context.provisioningCache.numRecords++;
+    local_context.provisioningCache.numBytes += numBytes;
+    return kHAPError_None;
+}
+
+/**
+ * Reads all records of the provisioning domain into the cache. Must be called with the cache mutex held.
+ */
+static void PopulateProvisioningCache(HAPPlatformKeyValueStoreRef keyValueStore) {
+    bool isComplete = true;
+
+    local_context.provisioningCache.numRecords = 0;
+    local_context.provisioningCache.numBytes = 0;
+    local_context.provisioningCache.isPopulating = true;
+    // Read before the records, so a write while the cache is populated leaves it stale.
+    atomic_val_t generation = atomic_get(&local_context.provisioningCache.generation);
+    HAPError err = HAPPlatformKeyValueStoreEnumerate(
+            keyValueStore, kSDKKeyValueStoreDomain_Provisioning, PopulateProvisioningCacheCallback, &isComplete);
+    local_context.provisioningCache.isPopulating = false;
+    local_context.provisioningCache.populatedGeneration = generation;
+    local_context.provisioningCache.isValid = !err && isComplete;
+    if (local_context.provisioningCache.isValid) {
+        LOG_DBG("Cached %zu provisioning records, %zu bytes.",
+                local_context.provisioningCache.numRecords,
+                local_context.provisioningCache.numBytes);
+    } else {
+        LOG_WRN("Provisioning records do not fit into the cache.");
     }
+}
 
-    if (domain) {
-        print_dec(&out[written], (size_t) *domain, DOMAIN_CHARS);
-        written += DOMAIN_CHARS;
+/**
+ * Answers a Get of the provisioning domain from the cache.
+ *
+ * @return true                     If the Get was answered.
+ * @return false                    If the record has to be read from the store.
+ */
+static bool ProvisioningCacheGet(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        HAPPlatformKeyValueStoreKey key,
+        void* _Nullable bytes,
+        size_t maxBytes,
+        size_t* _Nullable numBytes,
+        bool* found) {
+    k_mutex_lock(&local_context.provisioningCache.mutex, K_FOREVER);
+    if (local_context.provisioningCache.isPopulating) {
+        // Read by PopulateProvisioningCache.
+        k_mutex_unlock(&local_context.provisioningCache.mutex);
+        return false;
+    }
+    atomic_val_t generation = atomic_get(&local_context.provisioningCache.generation);
+    if (local_context.provisioningCache.populatedGeneration != generation) {
+        PopulateProvisioningCache(keyValueStore);
+    }
+    if (!local_context.provisioningCache.isValid) {
+        k_mutex_unlock(&local_context.provisioningCache.mutex);
+        return false;
     }
 
-    if (key) {
-        out[written++] = separator_char;
-        print_dec(&out[written], *key, KEY_CHARS);
-        written += KEY_CHARS;
+    *found = false;
+    if (numBytes) {
+        *numBytes = 0;
     }
-    out[written] = '\0';
+    for (size_t i = 0; i < local_context.provisioningCache.numRecords; i++) {
+        if (local_context.provisioningCache.records[i].key != key) {
+            continue;
+        }
+        *found = true;
+        if (bytes) {
+            HAPAssert(numBytes);
+            *numBytes = HAPMin(local_context.provisioningCache.records[i].numBytes, maxBytes);
+            HAPRawBufferCopyBytes(
+                    bytes,
+                    &local_context.provisioningCache.bytes[local_context.provisioningCache.records[i].offset],
+                    *numBytes);
+        }
+        break;
+    }
+    k_mutex_unlock(&local_context.provisioningCache.mutex);
+    return true;
 }
+#endif
 
 // ///////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -251,20 +1885,66 @@ void HAPPlatformKeyValueStoreCreate(
     HAPPrecondition(keyValueStore);
     HAPPrecondition(options);
     HAPPrecondition(!((uintptr_t) options->bytes % SIZE_OF_WORD));
-    HAPPrecondition(options->maxBytes >= 2);
+    HAPPrecondition(options->maxBytes >= 2 * (SIZE_OF_WORD + sizeof(PendingEntry)));
 
     keyValueStore->_ = *options;
     keyValueStore->busy = true;
     keyValueStore->initialized = false;
     local_context.initialized = false;
     keyValueStore->peakNumBytes = 0;
-    settings_load_args.is_loading = 0;
-    settings_load_args.is_enumerating = 0;
-    settings_load_args.record_found = 0;
+    settings_load_args.is_indexing = 0;
+    local_context.index.numEntries = 0;
+    local_context.index.isComplete = true;
+    local_context.index.isBypassed = false;
 
+    // The first half of the buffer formats records, the second half queues pending writes.
     local_context.IOBuffor = keyValueStore->_.bytes;
-    local_context.IOBufforCapacity = keyValueStore->_.maxBytes;
-    k_mutex_init(&local_context.settings_load_subtree_mutex);
+    local_context.IOBufforCapacity = keyValueStore->_.maxBytes / 2 / SIZE_OF_WORD * SIZE_OF_WORD;
+    local_context.queue.bytes = local_context.IOBuffor + local_context.IOBufforCapacity;
+    local_context.queue.capacity = keyValueStore->_.maxBytes - local_context.IOBufforCapacity;
+    local_context.queue.head = 0;
+    local_context.queue.tail = 0;
+    HAPPrecondition(local_context.queue.capacity < kPendingBatchFlag);
+    local_context.keyValueStore = keyValueStore;
+    local_context.batch.depth = 0;
+    local_context.batch.isOpen = false;
+    local_context.batch.isAborted = false;
+    keyValueStore->numBytes = 0;
+    k_mutex_init(&local_context.lock.mutex);
+    k_condvar_init(&local_context.lock.condvar);
+    local_context.lock.numReaders = 0;
+    local_context.lock.numWaitingWriters = 0;
+    local_context.lock.writer = NULL;
+    HAPRawBufferZero(&local_context.lock.stats, sizeof local_context.lock.stats);
+    k_mutex_init(&local_context.io_mutex);
+    k_mutex_init(&local_context.flush_mutex);
+    k_mutex_init(&local_context.batch_mutex);
+#if defined(CONFIG_HAP_KVS_BACKEND_NVS)
+    k_mutex_init(&local_context.nvsTable.mutex);
+    local_context.nvsTable.numEntries = 0;
+    local_context.nvsTable.isDirty = false;
+#endif
+    k_work_init(&local_context.flush_work, FlushWorkHandler);
+    if (!local_context.isWorkqStarted) {
+        const struct k_work_queue_config config = { .name = "hap_kvs" };
+        k_work_queue_start(
+                &local_context.workq,
+                kvs_workq_stack,
+                K_THREAD_STACK_SIZEOF(kvs_workq_stack),
+                CONFIG_HAP_KVS_WORKQ_PRIORITY,
+                &config);
+        local_context.isWorkqStarted = true;
+    }
+#if defined(CONFIG_HAP_KVS_PROVISIONING_CACHE)
+    k_mutex_init(&local_context.provisioningCache.mutex);
+    local_context.provisioningCache.isValid = false;
+    atomic_inc(&local_context.provisioningCache.generation);
+    local_context.provisioningCache.isPopulating = false;
+#endif
+#if defined(CONFIG_HAP_KVS_IDLE_GC)
+    k_work_init_delayable(&local_context.gc.work, GCWorkHandler);
+    local_context.gc.isDisabled = false;
+#endif
 
     err = settings_subsys_init();
     if (err) {
@@ -282,11 +1962,43 @@ void HAPPlatformKeyValueStoreCreate(
     keyValueStore->initialized = true;
     local_context.initialized = true;
 
+    settings_load_args.is_indexing = !IS_ENABLED(CONFIG_HAP_KVS_BACKEND_NVS);
     err = settings_load();
+    settings_load_args.is_indexing = false;
     if (err) {
         LOG_ERR("Cannot load settings");
         HAPFatalError();
     }
+
+#if defined(CONFIG_SETTINGS_NVS)
+    void* storage;
+    local_context.nvs = settings_storage_get(&storage) ? NULL : (struct nvs_fs*) storage;
+#endif
+#if defined(CONFIG_HAP_KVS_BACKEND_NVS)
+    if (!local_context.nvs) {
+        LOG_ERR("Settings storage is not available.");
+        HAPFatalError();
+    }
+    NVSTableLoad();
+    MigrateFromSettings();
+#endif
+    IndexResolveNameIDs();
+    ReplayJournal();
+    LOG_INF("Indexed %zu records%s.",
+            local_context.index.numEntries,
+            local_context.index.isComplete ? "" : " (index is full)");
+#if defined(CONFIG_HAP_KVS_BENCHMARK)
+    benchmarkKeyValueStore = keyValueStore;
+#endif
+#if defined(CONFIG_HAP_KVS_PROVISIONING_CACHE)
+    k_mutex_lock(&local_context.provisioningCache.mutex, K_FOREVER);
+    PopulateProvisioningCache(keyValueStore);
+    k_mutex_unlock(&local_context.provisioningCache.mutex);
+#endif
+#if defined(CONFIG_HAP_KVS_IDLE_GC)
+    // Restore the reserve if it was used up before the last reset.
+    k_work_reschedule_for_queue(&local_context.workq, &local_context.gc.work, K_MSEC(CONFIG_HAP_KVS_IDLE_GC_DELAY_MS));
+#endif
     keyValueStore->busy = false;
 }
 
@@ -295,6 +2007,143 @@ bool HAPPlatformKeyValueStoreIsBusy(HAPPlatformKeyValueStoreRef keyValueStore) {
     return keyValueStore->busy;
 }
 
+void HAPPlatformKeyValueStoreBeginBatch(HAPPlatformKeyValueStoreRef keyValueStore) {
+    HAPPrecondition(keyValueStore);
+    HAPPrecondition(keyValueStore->initialized);
+
+    k_mutex_lock(&local_context.batch_mutex, K_FOREVER);
+    if (local_context.batch.depth++) {
+        return;
+    }
+
+    WriteLock();
+    if (local_context.queue.capacity - local_context.queue.tail < sizeof(PendingEntry)) {
+        Unlock();
+        k_mutex_lock(&local_context.flush_mutex, K_FOREVER);
+        FlushAll();
+        k_mutex_unlock(&local_context.flush_mutex);
+        WriteLock();
+    }
+    PendingEntry* header = (PendingEntry*) &local_context.queue.bytes[local_context.queue.tail];
+    header->domainKey = 0;
+    header->numBytes = kPendingBatchFlag;
+    local_context.batch.header = local_context.queue.tail;
+    local_context.batch.isOpen = true;
+    local_context.queue.tail += sizeof *header;
+    QueueUpdateNumBytes();
+    Unlock();
+}
+
+/**
+ * Discards the staged entries of the open batch. The batch stays open. Must be called with the lock held.
+ *
+ * @return true                     If an entry of the provisioning domain was discarded.
+ * @return false                    Otherwise.
+ */
+static bool BatchDiscard(void) {
+    size_t first = local_context.batch.header + sizeof(PendingEntry);
+    size_t last = local_context.queue.tail;
+    bool isProvisioningDiscarded = false;
+
+    local_context.queue.tail = first;
+    QueueUpdateNumBytes();
+    for (size_t offset = first; offset < last;) {
+        // The discarded entries stay in the queue buffer until the next write.
+        const PendingEntry* entry = (const PendingEntry*) &local_context.queue.bytes[offset];
+        isProvisioningDiscarded |= entry->domainKey >> 8 == kSDKKeyValueStoreDomain_Provisioning;
+#if defined(CONFIG_HAP_KVS_BACKEND_NVS)
+        if (!QueueFind(entry->domainKey)) {
+            NVSReleaseID(entry->domainKey);
+        }
+#endif
+        offset += PendingEntrySize(entry);
+    }
+    return isProvisioningDiscarded;
+}
+
+/**
+ * Ends one level of the batch, and commits or discards the outermost batch.
+ */
+static void BatchEnd(void) {
+    HAPPrecondition(local_context.batch.depth);
+
+    if (!--local_context.batch.depth) {
+        WriteLock();
+        if (local_context.batch.isOpen && local_context.batch.isAborted) {
+            // Drop the empty batch header as well.
+            local_context.queue.tail = local_context.batch.header;
+            local_context.batch.isOpen = false;
+            QueueUpdateNumBytes();
+        } else if (local_context.batch.isOpen) {
+            BatchClose();
+        }
+        local_context.batch.isAborted = false;
+        Unlock();
+    }
+    k_mutex_unlock(&local_context.batch_mutex);
+}
+
+void HAPPlatformKeyValueStoreCommitBatch(HAPPlatformKeyValueStoreRef keyValueStore) {
+    HAPPrecondition(keyValueStore);
+    HAPPrecondition(keyValueStore->initialized);
+
+    BatchEnd();
+}
+
+void HAPPlatformKeyValueStoreAbortBatch(HAPPlatformKeyValueStoreRef keyValueStore) {
+    HAPPrecondition(keyValueStore);
+    HAPPrecondition(keyValueStore->initialized);
+    HAPPrecondition(local_context.batch.depth);
+
+    WriteLock();
+    bool isProvisioningDiscarded = local_context.batch.isOpen && BatchDiscard();
+    local_context.batch.isAborted = true;
+#if defined(CONFIG_HAP_KVS_PROVISIONING_CACHE)
+    if (isProvisioningDiscarded) {
+        // The cache may have been populated with the discarded entries.
+        ProvisioningCacheInvalidate(kSDKKeyValueStoreDomain_Provisioning);
+    }
+#else
+    (void) isProvisioningDiscarded;
+#endif
+    Unlock();
+    BatchEnd();
+}
+
+void HAPPlatformKeyValueStoreGetLockStats(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        HAPPlatformKeyValueStoreLockStats* stats) {
+    HAPPrecondition(keyValueStore);
+    HAPPrecondition(stats);
+
+    k_mutex_lock(&local_context.lock.mutex, K_FOREVER);
+    *stats = local_context.lock.stats;
+    k_mutex_unlock(&local_context.lock.mutex);
+}
+
+#if defined(CONFIG_HAP_KVS_COMPRESSION)
+/**
+ * Decompresses the value of a record read by Get into @p bytes.
+ */
+HAP_RESULT_USE_CHECK
+static HAPError DecompressRecord(
+        ReadContext* context,
+        void* bytes,
+        size_t maxBytes,
+        size_t* numBytes,
+        size_t numRecordBytes) {
+    if (context->buf == bytes) {
+        // Read in place. Decompressed output would overwrite its input, so the record moves to the IO buffer.
+        SelectReadBuffer(context, SIZE_MAX);
+        HAPRawBufferCopyBytes(context->buf, bytes, PADDING_INFO_SIZE + numRecordBytes);
+    }
+    HAPPlatformKeyValueStoreStatsStamp stamp = HAPPlatformKeyValueStoreStatsBegin();
+    bool isValid = LZSSDecompress(bytes, maxBytes, numBytes, &context->buf[PADDING_INFO_SIZE], numRecordBytes);
+    HAPPlatformKeyValueStoreStatsRecordDecompression(stamp);
+    return isValid ? kHAPError_None : kHAPError_Unknown;
+}
+#endif
+
 HAP_RESULT_USE_CHECK
 HAPError HAPPlatformKeyValueStoreGet(
         HAPPlatformKeyValueStoreRef keyValueStore,
@@ -312,66 +2161,112 @@ HAPError HAPPlatformKeyValueStoreGet(
     HAPPrecondition(!maxBytes || bytes);
     HAPPrecondition((bytes == NULL) == (numBytes == NULL));
     HAPPrecondition(found);
-    k_mutex_lock(&local_context.settings_load_subtree_mutex, K_FOREVER);
-    HAPPrecondition(!settings_load_args.is_enumerating);
-    HAPPrecondition(!settings_load_args.is_loading);
-
-    keyValueStore->busy = true;
-    settings_load_args.is_loading = true;
-    settings_load_args.buf = (void*) local_context.IOBuffor;
-    settings_load_args.record_found = false;
-
-    domainKeyId_query(local_context.domainKeyID, sizeof(local_context.domainKeyID), MODULE_NAME, &domain, &key);
-    domainKeyId_query(
-            settings_load_args.file_record_key, sizeof(settings_load_args.file_record_key), NULL, &domain, &key);
-
-    int err = settings_load_subtree(local_context.domainKeyID);
-    settings_load_args.is_loading = false;
-    if (err) {
-        LOG_ERR("Cannot load settings");
-        keyValueStore->busy = false;
-        *found = false;
-        HAPFatalError();
+    HAPPlatformTapTraceStamp traceStamp = HAPPlatformTapTraceBegin();
+    HAPPlatformKeyValueStoreStatsStamp statsStamp = HAPPlatformKeyValueStoreStatsBegin();
+#if defined(CONFIG_HAP_KVS_PROVISIONING_CACHE)
+    if (domain == kSDKKeyValueStoreDomain_Provisioning &&
+        ProvisioningCacheGet(keyValueStore, key, bytes, maxBytes, numBytes, found)) {
+        HAPPlatformTapTraceEnd(kHAPPlatformTapTraceEvent_KeyValueStoreGet, TRACE_ARG(domain, key), traceStamp);
+        HAPPlatformKeyValueStoreStatsRecordOperation(
+                kHAPPlatformKeyValueStoreStatsOperation_Get, domain, key, statsStamp);
+        return kHAPError_None;
+    }
+#endif
+    ReadContext context = {
+        .buf = local_context.IOBuffor,
+        .in_place_buf = bytes,
+        .in_place_capacity = maxBytes,
+        .record_found = false,
+        .holds_io_buffer = false,
+    };
+    HAPError err = kHAPError_None;
+    ReadLock();
+
+    // Writes that are still pending take precedence over the stored record.
+    const PendingEntry* pending = QueueFind(IndexDomainKey(domain, key));
+    if (pending) {
+        context.buf = (uint8_t*) &pending[1];
+        context.file_record_size = pending->numBytes;
+        context.num_read_bytes = pending->numBytes;
+        context.record_found = pending->numBytes != 0;
+    } else {
+#if defined(CONFIG_HAP_KVS_BACKEND_NVS)
+        uint8_t probe[SIZE_OF_WORD];
+        NVSRead(IndexDomainKey(domain, key), &context, probe);
+#else
+        IndexEntry* entry = IndexGet(IndexDomainKey(domain, key));
+        if (!bytes && entry && !local_context.index.isBypassed) {
+            // Only the existence of the record is queried, which the index answers without a read.
+            Unlock();
+            *found = true;
+            HAPPlatformTapTraceEnd(kHAPPlatformTapTraceEvent_KeyValueStoreGet, TRACE_ARG(domain, key), traceStamp);
+            HAPPlatformKeyValueStoreStatsRecordOperation(
+                    kHAPPlatformKeyValueStoreStatsOperation_Get, domain, key, statsStamp);
+            return kHAPError_None;
+        }
+        if (local_context.index.isBypassed || (!entry && !local_context.index.isComplete) ||
+            (entry && !IndexRead(entry, &context))) {
+            char name[MAX_RECORD_LEN];
+            domainKeyId_query(name, sizeof name, MODULE_NAME, &domain, &key);
+            int loadErr = settings_load_subtree_direct(name, ReadLoader, &context);
+            if (loadErr) {
+                LOG_ERR("Cannot load settings");
+                *found = false;
+                HAPFatalError();
+            }
+        }
+#endif
     }
 
-    *found = settings_load_args.record_found;
-    k_mutex_unlock(&local_context.settings_load_subtree_mutex);
-    if (!settings_load_args.record_found) {
+    *found = context.record_found;
+    if (!context.record_found) {
         if (numBytes != NULL) {
             *numBytes = 0;
         }
-        keyValueStore->busy = false;
-        return kHAPError_None;
-    }
-
-    uint16_t numWords = (settings_load_args.file_record_size / SIZE_OF_WORD);
-
-    // First byte contains number of padded bytes.
-    if (!numWords) {
+    } else if (context.num_read_bytes < SIZE_OF_WORD) {
+        // First byte contains number of padded bytes.
         LOG_INF("Corrupted file %02X.%02X contains no number of padded bytes.", domain, key);
-        keyValueStore->busy = false;
-        return kHAPError_Unknown;
+        err = kHAPError_Unknown;
+    } else if (context.buf[0] & ~(kRecordPaddingMask | kRecordCompressedFlag)) {
+        LOG_INF("Corrupted file %02X.%02X contains invalid padding length %u.", domain, key, context.buf[0]);
+        err = kHAPError_Unknown;
+    } else if (bytes) {
+        // Copy content.
+        size_t numWords = context.file_record_size / SIZE_OF_WORD;
+        size_t numRecordBytes = numWords * SIZE_OF_WORD - PADDING_INFO_SIZE - (context.buf[0] & kRecordPaddingMask);
+        // A record larger than the IO buffer was only read in part.
+        numRecordBytes = HAPMin(numRecordBytes, context.num_read_bytes - PADDING_INFO_SIZE);
+        if (context.buf[0] & kRecordCompressedFlag) {
+#if defined(CONFIG_HAP_KVS_COMPRESSION)
+            err = DecompressRecord(&context, bytes, maxBytes, numBytes, numRecordBytes);
+#else
+            // Written by a firmware with compression.
+            err = kHAPError_Unknown;
+#endif
+            if (err) {
+                LOG_INF("Corrupted file %02X.%02X contains invalid compressed data.", domain, key);
+            }
+        } else {
+            *numBytes = HAPMin(numRecordBytes, maxBytes);
+            if (context.buf == bytes) {
+                // Read in place, only the padding information is moved out.
+                memmove(bytes, &context.buf[1], *numBytes);
+            } else {
+                HAPRawBufferCopyBytes(bytes, &context.buf[1], *numBytes);
+            }
+        }
     }
 
-    uint8_t* read_data = (uint8_t*) settings_load_args.buf;
-
-    uint8_t numPaddedBytes = read_data[0];
-    if (numPaddedBytes >= SIZE_OF_WORD) {
-        LOG_INF("Corrupted file %02X.%02X contains invalid padding length %u.", domain, key, numPaddedBytes);
-        keyValueStore->busy = false;
-        return kHAPError_Unknown;
+    if (context.holds_io_buffer) {
+        k_mutex_unlock(&local_context.io_mutex);
     }
-
-    if (bytes) {
-        // Copy content.
-        *numBytes = (size_t) numWords * SIZE_OF_WORD - PADDING_INFO_SIZE - numPaddedBytes;
-        if (*numBytes > maxBytes) {
-            *numBytes = maxBytes;
-        }
-        HAPRawBufferCopyBytes(bytes, &read_data[1], *numBytes);
+    Unlock();
+    if (!err) {
+        HAPPlatformTapTraceEnd(kHAPPlatformTapTraceEvent_KeyValueStoreGet, TRACE_ARG(domain, key), traceStamp);
+        HAPPlatformKeyValueStoreStatsRecordOperation(
+                kHAPPlatformKeyValueStoreStatsOperation_Get, domain, key, statsStamp);
     }
-    keyValueStore->busy = false;
-    return kHAPError_None;
+    return err;
 }
 
 HAP_RESULT_USE_CHECK
@@ -386,38 +2281,14 @@ HAPError HAPPlatformKeyValueStoreSet(
     HAPPrecondition(keyValueStore->initialized);
     HAPPrecondition(bytes);
     HAPPrecondition(numBytes <= UINT16_MAX / SIZE_OF_WORD);
-    k_mutex_lock(&local_context.settings_load_subtree_mutex, K_FOREVER);
-    keyValueStore->busy = true;
+    HAPPlatformTapTraceStamp traceStamp = HAPPlatformTapTraceBegin();
+    HAPPlatformKeyValueStoreStatsStamp statsStamp = HAPPlatformKeyValueStoreStatsBegin();
 
-    HAPRawBufferCopyBytes(local_context.IOBuffor + PADDING_INFO_SIZE, bytes, numBytes);
-
-    size_t numBytesWithPaddingInfo = numBytes + PADDING_INFO_SIZE;
-    size_t numWords = SIZE_IN_WORDS(numBytesWithPaddingInfo);
-
-    size_t numPaddedBytes = numWords * SIZE_OF_WORD - numBytesWithPaddingInfo;
-    HAPRawBufferZero(local_context.IOBuffor + numBytesWithPaddingInfo, numPaddedBytes);
-    local_context.IOBuffor[0] = numPaddedBytes;
-
-    size_t bytes_with_padding = PADDING_INFO_SIZE + numBytes + numPaddedBytes;
-
-    HAPAssert(bytes_with_padding % SIZE_OF_WORD == 0);
-
-    domainKeyId_query(local_context.domainKeyID, sizeof(local_context.domainKeyID), MODULE_NAME, &domain, &key);
-
-    int err = settings_save_one(local_context.domainKeyID, local_context.IOBuffor, bytes_with_padding);
-    if (err) {
-        LOG_INF("Failed to write a record");
-        keyValueStore->busy = false;
-        HAPFatalError();
-    }
+    HAPError err = Write(IndexDomainKey(domain, key), bytes, numBytes);
 
-    if (keyValueStore->peakNumBytes > bytes_with_padding)
-        keyValueStore->peakNumBytes = bytes_with_padding;
-    int r = settings_save(); // todo: RG handle error ?
-    HAPAssert(r == 0);
-    keyValueStore->busy = false;
-    k_mutex_unlock(&local_context.settings_load_subtree_mutex);
-    return kHAPError_None;
+    HAPPlatformTapTraceEnd(kHAPPlatformTapTraceEvent_KeyValueStoreSet, TRACE_ARG(domain, key), traceStamp);
+    HAPPlatformKeyValueStoreStatsRecordOperation(kHAPPlatformKeyValueStoreStatsOperation_Set, domain, key, statsStamp);
+    return err;
 }
 
 HAP_RESULT_USE_CHECK
@@ -427,16 +2298,12 @@ HAPError HAPPlatformKeyValueStoreOverrideAndSet(
         HAPPlatformKeyValueStoreKey key,
         const void* bytes,
         size_t numBytes) {
-    int err = 0;
     HAPPrecondition(keyValueStore);
     HAPPrecondition(keyValueStore->initialized);
     HAPPrecondition(bytes);
 
-    keyValueStore->busy = true;
     // same API for update or new write
-    err = HAPPlatformKeyValueStoreSet(keyValueStore, domain, key, bytes, numBytes);
-    keyValueStore->busy = false;
-    return err;
+    return HAPPlatformKeyValueStoreSet(keyValueStore, domain, key, bytes, numBytes);
 }
 
 HAP_RESULT_USE_CHECK
@@ -446,41 +2313,120 @@ HAPError HAPPlatformKeyValueStoreRemove(
         HAPPlatformKeyValueStoreKey key) {
     HAPPrecondition(keyValueStore);
     HAPPrecondition(keyValueStore->initialized);
-    k_mutex_lock(&local_context.settings_load_subtree_mutex, K_FOREVER);
-    keyValueStore->busy = true;
+    HAPPlatformTapTraceStamp traceStamp = HAPPlatformTapTraceBegin();
+    HAPPlatformKeyValueStoreStatsStamp statsStamp = HAPPlatformKeyValueStoreStatsBegin();
 
-    domainKeyId_query(local_context.domainKeyID, sizeof(local_context.domainKeyID), MODULE_NAME, &domain, &key);
+    HAPError err = Write(IndexDomainKey(domain, key), NULL, 0);
 
-    // removing the exact matched key (not a subtree)
-    settings_delete(local_context.domainKeyID);
+    HAPPlatformTapTraceEnd(kHAPPlatformTapTraceEvent_KeyValueStoreRemove, TRACE_ARG(domain, key), traceStamp);
+    HAPPlatformKeyValueStoreStatsRecordOperation(
+            kHAPPlatformKeyValueStoreStatsOperation_Remove, domain, key, statsStamp);
+    return err;
+}
 
-    keyValueStore->busy = false;
-    k_mutex_unlock(&local_context.settings_load_subtree_mutex);
-    return kHAPError_None;
+#if !defined(CONFIG_HAP_KVS_BACKEND_NVS)
+/**
+ * Parses the "<key>" part of a settings name below the subtree of a domain.
+ */
+static bool ParseRecordKey(const char* _Nullable name, HAPPlatformKeyValueStoreKey* key) {
+    char* end;
+
+    if (!name) {
+        return false;
+    }
+    unsigned long value = strtoul(name, &end, 10);
+    if (end == name || *end != '\0' || value > UINT8_MAX) {
+        return false;
+    }
+    *key = (HAPPlatformKeyValueStoreKey) value;
+    return true;
+}
+
+/**
+ * Marks the key of a record in the key bitmap of a domain.
+ */
+static int CollectKeyLoader(
+        const char* _Nullable name,
+        size_t len HAP_UNUSED,
+        settings_read_cb read_cb HAP_UNUSED,
+        void* cb_arg HAP_UNUSED,
+        void* param) {
+    uint8_t* keys = (uint8_t*) param;
+    HAPPlatformKeyValueStoreKey key;
+
+    if (ParseRecordKey(name, &key)) {
+        keys[key / 8] |= (uint8_t)(1u << (key % 8));
+    }
+    return 0;
+}
+#endif
+
+/**
+ * Marks the stored keys of a domain in @p keys, in one pass. Without a complete index, the settings subtree of the
+ * domain is scanned.
+ */
+static void CollectStoredKeys(HAPPlatformKeyValueStoreDomain domain, uint8_t keys[_Nonnull (UINT8_MAX + 1) / 8]) {
+    HAPRawBufferZero(keys, (UINT8_MAX + 1) / 8);
+#if defined(CONFIG_HAP_KVS_BACKEND_NVS)
+    NVSCollectKeys(domain, keys);
+#else
+    if (local_context.index.isComplete && !local_context.index.isBypassed) {
+        size_t position;
+        IndexFind(IndexDomainKey(domain, 0), &position);
+        for (; position < local_context.index.numEntries &&
+               local_context.index.entries[position].domainKey >> 8 == domain;
+             position++) {
+            uint8_t key = (uint8_t)(local_context.index.entries[position].domainKey & 0xFF);
+            keys[key / 8] |= (uint8_t)(1u << (key % 8));
+        }
+        return;
+    }
+
+    char name[MAX_RECORD_LEN];
+    domainKeyId_query(name, sizeof name, MODULE_NAME, &domain, NULL);
+    int err = settings_load_subtree_direct(name, CollectKeyLoader, keys);
+    if (err) {
+        LOG_ERR("Failed to iterate through domain records: %d", err);
+        HAPFatalError();
+    }
+#endif
 }
 
-static HAPError call_enumerate_callbacks(
-        uint8_t count,
+/**
+ * Finds the first key of a domain that is not below @p cursor, from the stored keys collected by CollectStoredKeys and
+ * the pending writes.
+ */
+static bool NextKey(
         HAPPlatformKeyValueStoreDomain domain,
-        uint8_t* keys,
-        void* context,
-        HAPPlatformKeyValueStoreRef keyValueStore,
-        HAPPlatformKeyValueStoreEnumerateCallback callback) {
-    uint8_t local_keys[kMaxDomainSubtreeDepth] = { 0 };
-    memcpy(local_keys, keys, count);
-    bool shouldContinue = true;
-    int err = 0;
+        const uint8_t storedKeys[_Nonnull (UINT8_MAX + 1) / 8],
+        unsigned cursor,
+        HAPPlatformKeyValueStoreKey* key) {
+    unsigned next = UINT8_MAX + 1;
 
-    LOG_INF("keyDepthCount %d", local_context.keyDepthCount);
-    for (int i = 0; i < count && shouldContinue; i++) {
-        LOG_INF("keys[%d] =  %x", i, local_keys[i]);
-        err = callback(context, keyValueStore, domain, local_keys[i], &shouldContinue);
-        if (err != kHAPError_None) {
-            LOG_ERR("enumerate callback returned error (%d) on domain 0x%x key 0x%x", err, domain, local_keys[i]);
-            return kHAPError_Unknown;
+    for (unsigned storedKey = cursor; storedKey <= UINT8_MAX; storedKey++) {
+        if (!(storedKeys[storedKey / 8] & (1u << (storedKey % 8)))) {
+            continue;
+        }
+        const PendingEntry* pending = QueueFind(IndexDomainKey(domain, (HAPPlatformKeyValueStoreKey) storedKey));
+        if (!pending || pending->numBytes) {
+            next = storedKey;
+            break;
         }
     }
-    return kHAPError_None;
+
+    // Records that have not been persisted yet.
+    for (size_t offset = local_context.queue.head; offset < local_context.queue.tail;) {
+        const PendingEntry* entry = (const PendingEntry*) &local_context.queue.bytes[offset];
+        unsigned pendingKey = entry->domainKey & 0xFF;
+        if (!IsBatchHeader(entry) && entry->domainKey >> 8 == domain && pendingKey >= cursor && pendingKey < next &&
+            QueueFind(entry->domainKey)->numBytes) {
+            next = pendingKey;
+        }
+        offset += PendingEntrySize(entry);
+    }
+
+    *key = (HAPPlatformKeyValueStoreKey) next;
+    return next <= UINT8_MAX;
 }
 
 HAP_RESULT_USE_CHECK
@@ -492,31 +2438,36 @@ HAPError HAPPlatformKeyValueStoreEnumerate(
     HAPPrecondition(keyValueStore);
     HAPPrecondition(keyValueStore->initialized);
     HAPPrecondition(callback);
-    k_mutex_lock(&local_context.settings_load_subtree_mutex, K_FOREVER);
-    HAPPrecondition(!settings_load_args.is_enumerating);
-    HAPPrecondition(!settings_load_args.is_loading);
-
-    domainKeyId_query(local_context.domainKeyID, sizeof(local_context.domainKeyID), MODULE_NAME, &domain, NULL);
-    domainKeyId_query(
-            settings_load_args.file_record_key, sizeof(settings_load_args.file_record_key), NULL, &domain, NULL);
-    settings_load_args.is_enumerating = true;
-    settings_load_args.buf = NULL;
-    settings_load_args.record_found = false;
-
-    // reset the enumerating counter and found keys buffer
-    local_context.keyDepthCount = 0;
-    HAPRawBufferZero(local_context.keys, kMaxDomainSubtreeDepth);
-
-    int err = settings_load_subtree(local_context.domainKeyID);
-    settings_load_args.is_enumerating = false;
-    k_mutex_unlock(&local_context.settings_load_subtree_mutex);
-    if (err) {
-        LOG_ERR("Cannot load settings");
-        HAPFatalError();
-    }
 
-    return call_enumerate_callbacks(
-            local_context.keyDepthCount, domain, local_context.keys, context, keyValueStore, callback);
+    // Keys are streamed in ascending order from the stored keys, collected in one pass, and the pending writes. The
+    // callback may modify the domain, the cursor continues after its key. The stored keys are collected again only
+    // after a write was persisted.
+    uint8_t storedKeys[(UINT8_MAX + 1) / 8];
+    atomic_val_t storedGeneration = 0;
+    bool isCollected = false;
+    bool shouldContinue = true;
+    for (unsigned cursor = 0; cursor <= UINT8_MAX && shouldContinue;) {
+        HAPPlatformKeyValueStoreKey key;
+        ReadLock();
+        if (!isCollected || storedGeneration != atomic_get(&local_context.storedGeneration)) {
+            storedGeneration = atomic_get(&local_context.storedGeneration);
+            CollectStoredKeys(domain, storedKeys);
+            isCollected = true;
+        }
+        bool found = NextKey(domain, storedKeys, cursor, &key);
+        Unlock();
+        if (!found) {
+            break;
+        }
+
+        HAPError err = callback(context, keyValueStore, domain, key, &shouldContinue);
+        if (err != kHAPError_None) {
+            LOG_ERR("enumerate callback returned error (%d) on domain 0x%x key 0x%x", err, domain, key);
+            return kHAPError_Unknown;
+        }
+        cursor = key + 1u;
+    }
+    return kHAPError_None;
 }
 
 HAP_RESULT_USE_CHECK
@@ -525,64 +2476,311 @@ HAPError HAPPlatformKeyValueStorePurgeDomain(
         HAPPlatformKeyValueStoreDomain domain) {
     HAPPrecondition(keyValueStore);
     HAPPrecondition(keyValueStore->initialized);
-    k_mutex_lock(&local_context.settings_load_subtree_mutex, K_FOREVER);
-    HAPPrecondition(!settings_load_args.is_enumerating);
-    HAPPrecondition(!settings_load_args.is_loading);
 
-    keyValueStore->busy = true;
-    memset(local_context.domainKeyID, 0, sizeof(local_context.domainKeyID));
-    domainKeyId_query(local_context.domainKeyID, sizeof(local_context.domainKeyID), MODULE_NAME, &domain, NULL);
+    // Persist pending writes, and hold back new ones until the domain is purged. A domain cannot be purged in a batch.
+    k_mutex_lock(&local_context.batch_mutex, K_FOREVER);
+    HAPPrecondition(!local_context.batch.depth);
+    k_mutex_lock(&local_context.flush_mutex, K_FOREVER);
+    FlushAll();
+
+    WriteLock();
+    HAPPlatformKeyValueStoreStatsRecordPurge(domain);
+    atomic_inc(&local_context.storedGeneration);
+
+#if defined(CONFIG_HAP_KVS_BACKEND_NVS)
+    NVSPurgeDomain(domain);
+#else
+    // Collect the keys of the domain in one pass, from the index if it is complete.
+    uint8_t keys[(UINT8_MAX + 1) / 8];
+    CollectStoredKeys(domain, keys);
+
+    size_t numDeleted = 0;
+    for (unsigned key = 0; key <= UINT8_MAX; key++) {
+        if (!(keys[key / 8] & (1u << (key % 8)))) {
+            continue;
+        }
+        HAPPlatformKeyValueStoreKey recordKey = (HAPPlatformKeyValueStoreKey) key;
+        domainKeyId_query(
+                local_context.domainKeyID, sizeof(local_context.domainKeyID), MODULE_NAME, &domain, &recordKey);
+        int err = settings_delete(local_context.domainKeyID);
+        if (err) {
+            LOG_ERR("Delete %s failed with err %d", local_context.domainKeyID, err);
+            HAPFatalError();
+        }
+        HAPPlatformKeyValueStoreStatsRecordPersist(domain, recordKey, 0);
+        numDeleted++;
+    }
+    IndexRemoveDomain(domain);
+    LOG_INF("Purged %zu records of domain %02X.", numDeleted, domain);
+#endif
+#if defined(CONFIG_HAP_KVS_PROVISIONING_CACHE)
+    ProvisioningCacheInvalidate(domain);
+#endif
+
+    Unlock();
+    k_mutex_unlock(&local_context.flush_mutex);
+    k_mutex_unlock(&local_context.batch_mutex);
+    return kHAPError_None;
+}
 
-    LOG_INF("Remove subtree %s", local_context.domainKeyID);
-    settings_save();
+#if defined(CONFIG_HAP_KVS_PROVISIONING_IMPORT)
+/** Length of the header of a provisioning blob. */
+#define kProvisioningBlobHeaderSize ((size_t) 8)
 
-    // deleting the subtree, using direct loader feature
+/** Length of the header of a record in a provisioning blob. */
+#define kProvisioningBlobRecordHeaderSize ((size_t) 4)
 
-    struct direct_loader_param subtree_keys;
-    memset(&subtree_keys, 0, sizeof(struct direct_loader_param));
+/** Length of the checksum of a provisioning blob. */
+#define kProvisioningBlobChecksumSize ((size_t) 4)
 
-    int err = settings_load_subtree_direct(local_context.domainKeyID, direct_loader, (void*) &subtree_keys);
-    if (err) {
-        LOG_INF("Failed to iterate through domain records");
-        HAPFatalError();
-    } else {
-        // records deleted successfully, now delete the file itself
-        LOG_INF("subtree iterate successfull: found %d elements\n status = %d", subtree_keys.id, subtree_keys.status);
-        for (uint8_t i = 0; i < subtree_keys.id; i++) {
-            memset(local_context.domainKeyID, 0, sizeof(local_context.domainKeyID));
-            domainKeyId_query(
-                    local_context.domainKeyID,
-                    sizeof(local_context.domainKeyID),
-                    MODULE_NAME,
-                    &domain,
-                    &subtree_keys.id_repo[i]);
-            LOG_INF("Delete %s", local_context.domainKeyID);
-            err = settings_delete(local_context.domainKeyID);
+/**
+ * Walks the records of a provisioning blob.
+ *
+ * @param      keyValueStore        Key-value store, or NULL to only validate the records.
+ * @param      bytes                Records.
+ * @param      numBytes             Length of the records.
+ * @param      numRecords           Number of records.
+ *
+ * @return kHAPError_None           If the records exactly fill @p numBytes, and were written.
+ * @return kHAPError_InvalidData    If the records do not exactly fill @p numBytes.
+ * @return kHAPError_OutOfResources If a record cannot be written.
+ */
+static HAPError ImportProvisioningRecords(
+        HAPPlatformKeyValueStoreRef _Nullable keyValueStore,
+        const uint8_t* bytes,
+        size_t numBytes,
+        size_t numRecords) {
+    size_t offset = 0;
+    for (size_t i = 0; i < numRecords; i++) {
+        if (numBytes - offset < kProvisioningBlobRecordHeaderSize) {
+            return kHAPError_InvalidData;
+        }
+        const uint8_t* record = &bytes[offset];
+        size_t numValueBytes = sys_get_le16(&record[2]);
+        offset += kProvisioningBlobRecordHeaderSize;
+        if (record[1] || numBytes - offset < numValueBytes) {
+            return kHAPError_InvalidData;
+        }
+        if (keyValueStore) {
+            HAPError err = HAPPlatformKeyValueStoreSet(
+                    keyValueStore,
+                    kSDKKeyValueStoreDomain_Provisioning,
+                    record[0],
+                    &bytes[offset],
+                    numValueBytes);
             if (err) {
-                LOG_ERR("Delete %s failed with err %d", local_context.domainKeyID, err);
-                HAPFatalError();
+                HAPAssert(err == kHAPError_OutOfResources);
+                return err;
             }
         }
-        if (subtree_keys.status == NO_SPACE_FOR_ID) {
-            // some keys from the domain, were already removed, so run the same function again to remove the rest of
-            // them
-            LOG_INF("Purge buffer for subtree element is full, continue deleting keys");
-            HAPError e = HAPPlatformKeyValueStorePurgeDomain(keyValueStore, domain);
-            k_mutex_unlock(&local_context.settings_load_subtree_mutex);
-            return e;
-        }
+        offset += numValueBytes;
+    }
+    return offset == numBytes ? kHAPError_None : kHAPError_InvalidData;
+}
 
-        LOG_INF("records deleted successfully, now delete the file itself");
-        memset(local_context.domainKeyID, 0, sizeof(local_context.domainKeyID));
-        domainKeyId_query(local_context.domainKeyID, sizeof(local_context.domainKeyID), MODULE_NAME, &domain, NULL);
-        err = settings_delete(local_context.domainKeyID);
-        if (err) {
-            LOG_INF("Failed to delete records in the file");
-            HAPFatalError();
-        }
+HAP_RESULT_USE_CHECK
+HAPError HAPPlatformKeyValueStoreImportProvisioning(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        const void* bytes_,
+        size_t numBytes) {
+    HAPPrecondition(keyValueStore);
+    HAPPrecondition(keyValueStore->initialized);
+    HAPPrecondition(bytes_);
+    const uint8_t* bytes = bytes_;
+
+    if (numBytes < kProvisioningBlobHeaderSize + kProvisioningBlobChecksumSize) {
+        LOG_ERR("Provisioning blob too short: %zu bytes.", numBytes);
+        return kHAPError_InvalidData;
+    }
+    size_t numCheckedBytes = numBytes - kProvisioningBlobChecksumSize;
+    if (sys_get_le32(&bytes[0]) != kHAPPlatformKeyValueStoreProvisioningBlobMagic ||
+        bytes[4] != kHAPPlatformKeyValueStoreProvisioningBlobVersion || sys_get_le16(&bytes[6])) {
+        LOG_ERR("Provisioning blob header invalid.");
+        return kHAPError_InvalidData;
+    }
+    if (crc32_ieee(bytes, numCheckedBytes) != sys_get_le32(&bytes[numCheckedBytes])) {
+        LOG_ERR("Provisioning blob checksum mismatch.");
+        return kHAPError_InvalidData;
+    }
+    size_t numRecords = bytes[5];
+    const uint8_t* records = &bytes[kProvisioningBlobHeaderSize];
+    size_t numRecordsBytes = numCheckedBytes - kProvisioningBlobHeaderSize;
+    if (ImportProvisioningRecords(NULL, records, numRecordsBytes, numRecords)) {
+        LOG_ERR("Provisioning blob records invalid.");
+        return kHAPError_InvalidData;
     }
 
-    keyValueStore->busy = false;
-    k_mutex_unlock(&local_context.settings_load_subtree_mutex);
+    // No batch: its journal would write every record twice. Each record is persisted once, records that do not fit
+    // into the write-back queue are written through, and an import that is interrupted is simply repeated.
+    HAPError err = ImportProvisioningRecords(keyValueStore, records, numRecordsBytes, numRecords);
+    if (err) {
+        LOG_ERR("Provisioning records could not be written.");
+        return err;
+    }
+
+    // The programming station may cut power right after this returns.
+    k_mutex_lock(&local_context.flush_mutex, K_FOREVER);
+    FlushAll();
+    k_mutex_unlock(&local_context.flush_mutex);
+
+    LOG_INF("Imported %zu provisioning records.", numRecords);
     return kHAPError_None;
 }
+#endif
+
+#if defined(CONFIG_HAP_KVS_BENCHMARK)
+
+/** First domain used by the benchmark. Every domain holds up to 256 records. */
+#define kBenchmarkDomain ((HAPPlatformKeyValueStoreDomain) 0x70)
+
+/** Maximum number of benchmark records. */
+#define kBenchmarkMaxRecords 512
+
+static uint32_t BenchmarkGets(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        size_t numRecords,
+        HAPPlatformKeyValueStoreDomain domainOffset,
+        bool* found) {
+    uint8_t bytes[8];
+    size_t numBytes;
+    uint32_t start = k_cycle_get_32();
+
+    for (size_t i = 0; i < numRecords; i++) {
+        HAPError err = HAPPlatformKeyValueStoreGet(
+                keyValueStore,
+                (HAPPlatformKeyValueStoreDomain)(kBenchmarkDomain + domainOffset + i / 256),
+                (HAPPlatformKeyValueStoreKey)(i % 256),
+                bytes,
+                sizeof bytes,
+                &numBytes,
+                found);
+        HAPAssert(!err);
+    }
+    return k_cyc_to_us_floor32(k_cycle_get_32() - start) / numRecords;
+}
+
+static int CommandBenchmark(const struct shell* shell, size_t argc HAP_UNUSED, char** argv) {
+    HAPPlatformKeyValueStoreRef keyValueStore = benchmarkKeyValueStore;
+    size_t numRecords = strtoul(argv[1], NULL, 0);
+    size_t numDomains = (numRecords + 255) / 256;
+    bool found = false;
+
+    if (!keyValueStore || !numRecords || numRecords > kBenchmarkMaxRecords) {
+        shell_error(shell, "Record count must be between 1 and %u.", kBenchmarkMaxRecords);
+        return -EINVAL;
+    }
+
+    shell_print(
+            shell,
+            "Writing %zu records to domains 0x%02X..0x%02X.",
+            numRecords,
+            kBenchmarkDomain,
+            (unsigned) (kBenchmarkDomain + numDomains - 1));
+#if defined(CONFIG_SETTINGS_NVS)
+    ssize_t freeBytes = local_context.nvs ? nvs_calc_free_space(local_context.nvs) : 0;
+#endif
+    local_context.maxPersistCycles = 0;
+    uint32_t start = k_cycle_get_32();
+    for (size_t i = 0; i < numRecords; i++) {
+        uint8_t bytes[8];
+        memset(bytes, (int) i, sizeof bytes);
+        HAPError err = HAPPlatformKeyValueStoreSet(
+                keyValueStore,
+                (HAPPlatformKeyValueStoreDomain)(kBenchmarkDomain + i / 256),
+                (HAPPlatformKeyValueStoreKey)(i % 256),
+                bytes,
+                sizeof bytes);
+        HAPAssert(!err);
+    }
+    shell_print(shell, "Set %6u us", (unsigned) (k_cyc_to_us_floor32(k_cycle_get_32() - start) / numRecords));
+    start = k_cycle_get_32();
+    while (HAPPlatformKeyValueStoreIsBusy(keyValueStore)) {
+        k_sleep(K_MSEC(1));
+    }
+    shell_print(shell, "Flush %4u us", (unsigned) (k_cyc_to_us_floor32(k_cycle_get_32() - start) / numRecords));
+    // Includes garbage collections of NVS that ran inline in a write.
+    shell_print(shell, "Flush max %u us", (unsigned) k_cyc_to_us_floor32(local_context.maxPersistCycles));
+#if defined(CONFIG_SETTINGS_NVS)
+    if (local_context.nvs) {
+        // Garbage collection during the run makes this an underestimate.
+        shell_print(
+                shell,
+                "Set %6d flash bytes",
+                (int) ((freeBytes - nvs_calc_free_space(local_context.nvs)) / (ssize_t) numRecords));
+    }
+#endif
+
+    // Misses go to the domains following the benchmark records.
+    for (int bypass = 0; bypass <= 1; bypass++) {
+        local_context.index.isBypassed = bypass;
+        uint32_t hitMicroseconds = BenchmarkGets(keyValueStore, numRecords, 0, &found);
+        bool hit = found;
+        uint32_t missMicroseconds = BenchmarkGets(
+                keyValueStore, numRecords, (HAPPlatformKeyValueStoreDomain) numDomains, &found);
+        shell_print(
+                shell,
+                "%-7s Get hit %6u us%s, miss %6u us%s",
+                bypass ? "scan:" : "index:",
+                hitMicroseconds,
+                hit ? "" : " (not found!)",
+                missMicroseconds,
+                found ? " (found!)" : "");
+    }
+    local_context.index.isBypassed = false;
+
+    for (size_t i = 0; i < numRecords; i++) {
+        HAPError err = HAPPlatformKeyValueStoreRemove(
+                keyValueStore,
+                (HAPPlatformKeyValueStoreDomain)(kBenchmarkDomain + i / 256),
+                (HAPPlatformKeyValueStoreKey)(i % 256));
+        HAPAssert(!err);
+    }
+    return 0;
+}
+
+static int CommandLockStats(const struct shell* shell, size_t argc HAP_UNUSED, char** argv HAP_UNUSED) {
+    if (!benchmarkKeyValueStore) {
+        shell_error(shell, "Key-value store is not initialized.");
+        return -EINVAL;
+    }
+    HAPPlatformKeyValueStoreLockStats stats;
+    HAPPlatformKeyValueStoreGetLockStats(benchmarkKeyValueStore, &stats);
+    shell_print(
+            shell,
+            "Reads %u (concurrent %u, waited %u, peak readers %u)",
+            (unsigned) stats.numReads,
+            (unsigned) stats.numConcurrentReads,
+            (unsigned) stats.numReadWaits,
+            (unsigned) stats.peakNumReaders);
+    shell_print(shell, "Writes %u (waited %u)", (unsigned) stats.numWrites, (unsigned) stats.numWriteWaits);
+    return 0;
+}
+
+#if defined(CONFIG_HAP_KVS_IDLE_GC)
+static int CommandGC(const struct shell* shell, size_t argc HAP_UNUSED, char** argv) {
+    if (!strcmp(argv[1], "on")) {
+        local_context.gc.isDisabled = false;
+    } else if (!strcmp(argv[1], "off")) {
+        local_context.gc.isDisabled = true;
+    } else {
+        shell_error(shell, "Expected on or off.");
+        return -EINVAL;
+    }
+    return 0;
+}
+#else
+// SHELL_COND_CMD_ARG references the handler even when the command is compiled out.
+#define CommandGC NULL
+#endif
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+        keyValueStoreCommands,
+        SHELL_CMD_ARG(bench, NULL, "Measure Get latency with <records> stored records", CommandBenchmark, 2, 0),
+        SHELL_CMD(locks, NULL, "Show lock contention counters", CommandLockStats),
+        SHELL_COND_CMD_ARG(
+                CONFIG_HAP_KVS_IDLE_GC, gc, NULL, "Switch idle garbage collection <on|off>", CommandGC, 2, 0),
+        SHELL_SUBCMD_SET_END);
+
+SHELL_CMD_REGISTER(kvs, &keyValueStoreCommands, "Key-value store", NULL);
+
+#endif // CONFIG_HAP_KVS_BENCHMARK
@@ -0,0 +1,381 @@
+// Disclaimer: IMPORTANT: This Apple software is supplied to you, by Apple Inc. ("Apple"), in your
+// capacity as a current, and in good standing, Licensee in the MFi Licensing Program. Use of this
+// Apple software is governed by and subject to the terms and conditions of your MFi License,
+// including, but not limited to, the restrictions specified in the provision entitled "Public
+// Software", and is further subject to your agreement to the following additional terms, and your
+// agreement that the use, installation, modification or redistribution of this Apple software
+// constitutes acceptance of these additional terms. If you do not agree with these additional terms,
+// you may not use, install, modify or redistribute this Apple software.
+//
+// Subject to all of these terms and in consideration of your agreement to abide by them, Apple grants
+// you, for as long as you are a current and in good-standing MFi Licensee, a personal, non-exclusive
+// license, under Apple's copyrights in this Apple software (the "Apple Software"), to use,
+// reproduce, and modify the Apple Software in source form, and to use, reproduce, modify, and
+// redistribute the Apple Software, with or without modifications, in binary form, in each of the
+// foregoing cases to the extent necessary to develop and/or manufacture "Proposed Products" and
+// "Licensed Products" in accordance with the terms of your MFi License. While you may not
+// redistribute the Apple Software in source form, should you redistribute the Apple Software in binary
+// form, you must retain this notice and the following text and disclaimers in all such redistributions
+// of the Apple Software. Neither the name, trademarks, service marks, or logos of Apple Inc. may be
+// used to endorse or promote products derived from the Apple Software without specific prior written
+// permission from Apple. Except as expressly stated in this notice, no other rights or licenses,
+// express or implied, are granted by Apple herein, including but not limited to any patent rights that
+// may be infringed by your derivative works or by other works in which the Apple Software may be
+// incorporated. Apple may terminate this license to the Apple Software by removing it from the list
+// of Licensed Technology in the MFi License, or otherwise in accordance with the terms of such MFi License.
+//
+// Unless you explicitly state otherwise, if you provide any ideas, suggestions, recommendations, bug
+// fixes or enhancements to Apple in connection with this software ("Feedback"), you hereby grant to
+// Apple a non-exclusive, fully paid-up, perpetual, irrevocable, worldwide license to make, use,
+// reproduce, incorporate, modify, display, perform, sell, make or have made derivative works of,
+// distribute (directly or indirectly) and sublicense, such Feedback in connection with Apple products
+// and services. Providing this Feedback is voluntary, but if you do provide Feedback to Apple, you
+// acknowledge and agree that Apple may exercise the license granted above without the payment of
+// royalties or further consideration to Participant.
+
+// The Apple Software is provided by Apple on an "AS IS" basis. APPLE MAKES NO WARRANTIES, EXPRESS OR
+// IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY
+// AND FITNESS FOR A PARTICULAR PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR
+// IN COMBINATION WITH YOUR PRODUCTS.
+//
+// IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION
+// AND/OR DISTRIBUTION OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+// (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// Copyright (C) 2015-2021 Apple Inc. All Rights Reserved.
+
+#include "HAPPlatformKeyValueStoreStats.h"
+
+#if defined(CONFIG_HAP_KVS_STATS)
+
+#include <stdarg.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/printk.h>
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+
+struct shell;
+
+static const char* const operationNames[] = {
+    [kHAPPlatformKeyValueStoreStatsOperation_Get] = "get",
+    [kHAPPlatformKeyValueStoreStatsOperation_Set] = "set",
+    [kHAPPlatformKeyValueStoreStatsOperation_Remove] = "remove",
+};
+HAP_STATIC_ASSERT(HAPArrayCount(operationNames) == kHAPPlatformKeyValueStoreStatsOperation_Count, operationNames);
+
+static struct {
+    HAPPlatformKeyValueStoreStatsSnapshot snapshot;
+    struct k_spinlock lock;
+} stats;
+
+static size_t BucketIndex(uint32_t us) {
+    size_t index = us ? (size_t)(32 - __builtin_clz(us)) : 0;
+    return index < kHAPPlatformKeyValueStoreStatsNumBuckets ? index : kHAPPlatformKeyValueStoreStatsNumBuckets - 1;
+}
+
+/**
+ * Upper bound of a bucket in microseconds.
+ */
+static uint32_t BucketLimit(size_t index) {
+    return index ? (uint32_t) 1 << index : 1;
+}
+
+/**
+ * Finds the counters of a domain or, if @p isRecord is set, of a record. Adds them if they are missing.
+ * Must be called with the lock held.
+ *
+ * @return Counters, or the untracked counters if the table is full.
+ */
+static HAPPlatformKeyValueStoreStatsCounters*
+        GetCounters(HAPPlatformKeyValueStoreDomain domain, HAPPlatformKeyValueStoreKey key, bool isRecord) {
+    HAPPlatformKeyValueStoreStatsSnapshot* snapshot = &stats.snapshot;
+    HAPPlatformKeyValueStoreStatsCounters* table = isRecord ? snapshot->records : snapshot->domains;
+    size_t* numEntries = isRecord ? &snapshot->numRecords : &snapshot->numDomains;
+    size_t capacity = isRecord ? HAPArrayCount(snapshot->records) : HAPArrayCount(snapshot->domains);
+
+    for (size_t i = 0; i < *numEntries; i++) {
+        if (table[i].domain == domain && (!isRecord || table[i].key == key)) {
+            return &table[i];
+        }
+    }
+    if (*numEntries == capacity) {
+        return &snapshot->untracked;
+    }
+    HAPPlatformKeyValueStoreStatsCounters* counters = &table[(*numEntries)++];
+    HAPRawBufferZero(counters, sizeof *counters);
+    counters->domain = domain;
+    counters->key = isRecord ? key : 0;
+    return counters;
+}
+
+/**
+ * Gets the counters of the domain and of the record. Operations that fit into neither table are counted once in the
+ * untracked counters. Must be called with the lock held.
+ *
+ * @return Number of counters.
+ */
+static size_t GetDomainAndRecordCounters(
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreKey key,
+        HAPPlatformKeyValueStoreStatsCounters* counters[2]) {
+    counters[0] = GetCounters(domain, key, false);
+    counters[1] = GetCounters(domain, key, true);
+    return counters[1] != counters[0] ? 2 : 1;
+}
+
+HAPPlatformKeyValueStoreStatsStamp HAPPlatformKeyValueStoreStatsBegin(void) {
+    return (HAPPlatformKeyValueStoreStatsStamp) k_cycle_get_32();
+}
+
+void HAPPlatformKeyValueStoreStatsRecordOperation(
+        HAPPlatformKeyValueStoreStatsOperation operation,
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreKey key,
+        HAPPlatformKeyValueStoreStatsStamp stamp) {
+    HAPPrecondition(operation < kHAPPlatformKeyValueStoreStatsOperation_Count);
+
+    uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - stamp);
+
+    k_spinlock_key_t lockKey = k_spin_lock(&stats.lock);
+    uint32_t* bucket = &stats.snapshot.latency[operation][BucketIndex(us)];
+    if (*bucket != UINT32_MAX) {
+        (*bucket)++;
+    }
+    HAPPlatformKeyValueStoreStatsCounters* counters[2];
+    size_t numCounters = GetDomainAndRecordCounters(domain, key, counters);
+    for (size_t i = 0; i < numCounters; i++) {
+        switch (operation) {
+            case kHAPPlatformKeyValueStoreStatsOperation_Get: {
+                counters[i]->numReads++;
+                break;
+            }
+            case kHAPPlatformKeyValueStoreStatsOperation_Set: {
+                counters[i]->numWrites++;
+                break;
+            }
+            case kHAPPlatformKeyValueStoreStatsOperation_Remove: {
+                counters[i]->numRemoves++;
+                break;
+            }
+            default:
+                HAPFatalError();
+        }
+    }
+    k_spin_unlock(&stats.lock, lockKey);
+}
+
+void HAPPlatformKeyValueStoreStatsRecordPersist(
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreKey key,
+        size_t numBytes) {
+    k_spinlock_key_t lockKey = k_spin_lock(&stats.lock);
+    HAPPlatformKeyValueStoreStatsCounters* counters[2];
+    size_t numCounters = GetDomainAndRecordCounters(domain, key, counters);
+    for (size_t i = 0; i < numCounters; i++) {
+        counters[i]->numPersisted++;
+        counters[i]->numBytesWritten += (uint32_t) numBytes;
+    }
+    k_spin_unlock(&stats.lock, lockKey);
+}
+
+void HAPPlatformKeyValueStoreStatsRecordJournal(size_t numBytes) {
+    k_spinlock_key_t lockKey = k_spin_lock(&stats.lock);
+    stats.snapshot.numJournalBytesWritten += (uint32_t) numBytes;
+    k_spin_unlock(&stats.lock, lockKey);
+}
+
+void HAPPlatformKeyValueStoreStatsRecordPurge(HAPPlatformKeyValueStoreDomain domain) {
+    k_spinlock_key_t lockKey = k_spin_lock(&stats.lock);
+    GetCounters(domain, 0, false)->numPurges++;
+    k_spin_unlock(&stats.lock, lockKey);
+}
+
+void HAPPlatformKeyValueStoreStatsRecordCompression(size_t numBytesSaved, HAPPlatformKeyValueStoreStatsStamp stamp) {
+    uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - stamp);
+
+    k_spinlock_key_t lockKey = k_spin_lock(&stats.lock);
+    HAPPlatformKeyValueStoreStatsSnapshot* snapshot = &stats.snapshot;
+    snapshot->numCompressions++;
+    if (numBytesSaved) {
+        snapshot->numCompressedValues++;
+        snapshot->numBytesSaved += (uint32_t) numBytesSaved;
+    }
+    snapshot->compressionUs += us;
+    snapshot->maxCompressionUs = HAPMax(snapshot->maxCompressionUs, us);
+    k_spin_unlock(&stats.lock, lockKey);
+}
+
+void HAPPlatformKeyValueStoreStatsRecordDecompression(HAPPlatformKeyValueStoreStatsStamp stamp) {
+    uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - stamp);
+
+    k_spinlock_key_t lockKey = k_spin_lock(&stats.lock);
+    HAPPlatformKeyValueStoreStatsSnapshot* snapshot = &stats.snapshot;
+    snapshot->numDecompressions++;
+    snapshot->decompressionUs += us;
+    snapshot->maxDecompressionUs = HAPMax(snapshot->maxDecompressionUs, us);
+    k_spin_unlock(&stats.lock, lockKey);
+}
+
+void HAPPlatformKeyValueStoreStatsGetSnapshot(HAPPlatformKeyValueStoreStatsSnapshot* snapshot) {
+    HAPPrecondition(snapshot);
+
+    k_spinlock_key_t lockKey = k_spin_lock(&stats.lock);
+    *snapshot = stats.snapshot;
+    k_spin_unlock(&stats.lock, lockKey);
+}
+
+HAP_PRINTFLIKE(2, 3)
+static void Print(const struct shell* _Nullable shell, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    (void) shell;
+#if defined(CONFIG_SHELL)
+    if (shell) {
+        shell_vfprintf(shell, SHELL_NORMAL, format, args);
+        va_end(args);
+        return;
+    }
+#endif
+    vprintk(format, args);
+    va_end(args);
+}
+
+static void PrintCounters(
+        const struct shell* _Nullable shell,
+        const char* name,
+        const HAPPlatformKeyValueStoreStatsCounters* counters) {
+    Print(shell,
+          "%-9s %8u %8u %8u %9u %10u %6u\n",
+          name,
+          (unsigned) counters->numReads,
+          (unsigned) counters->numWrites,
+          (unsigned) counters->numRemoves,
+          (unsigned) counters->numPersisted,
+          (unsigned) counters->numBytesWritten,
+          (unsigned) counters->numPurges);
+}
+
+/**
+ * Estimates a percentile as the upper bound of the bucket that contains it.
+ */
+static uint32_t Percentile(const uint32_t* buckets, uint32_t percent) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < kHAPPlatformKeyValueStoreStatsNumBuckets; i++) {
+        total += buckets[i];
+    }
+    if (!total) {
+        return 0;
+    }
+
+    uint64_t rank = (total * percent + 99) / 100;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kHAPPlatformKeyValueStoreStatsNumBuckets; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return BucketLimit(i);
+        }
+    }
+    return BucketLimit(kHAPPlatformKeyValueStoreStatsNumBuckets - 1);
+}
+
+static void PrintStats(const struct shell* _Nullable shell) {
+    static HAPPlatformKeyValueStoreStatsSnapshot snapshot;
+    char name[sizeof "0xFF.0xFF"];
+
+    // Snapshot under the lock, print without it.
+    HAPPlatformKeyValueStoreStatsGetSnapshot(&snapshot);
+
+    Print(shell,
+          "%-9s %8s %8s %8s %9s %10s %6s\n",
+          "record",
+          "reads",
+          "writes",
+          "removes",
+          "persisted",
+          "bytes",
+          "purges");
+    for (size_t i = 0; i < snapshot.numDomains; i++) {
+        const HAPPlatformKeyValueStoreStatsCounters* domain = &snapshot.domains[i];
+        snprintk(name, sizeof name, "%02X", domain->domain);
+        PrintCounters(shell, name, domain);
+        for (size_t j = 0; j < snapshot.numRecords; j++) {
+            const HAPPlatformKeyValueStoreStatsCounters* record = &snapshot.records[j];
+            if (record->domain != domain->domain) {
+                continue;
+            }
+            snprintk(name, sizeof name, "  %02X.%02X", record->domain, record->key);
+            PrintCounters(shell, name, record);
+        }
+    }
+    PrintCounters(shell, "untracked", &snapshot.untracked);
+    Print(shell, "Journal bytes %u\n", (unsigned) snapshot.numJournalBytesWritten);
+    if (snapshot.numCompressions) {
+        Print(shell,
+              "Compressed %u of %u values, %u bytes saved, avg %u us, max %u us\n",
+              (unsigned) snapshot.numCompressedValues,
+              (unsigned) snapshot.numCompressions,
+              (unsigned) snapshot.numBytesSaved,
+              (unsigned) (snapshot.compressionUs / snapshot.numCompressions),
+              (unsigned) snapshot.maxCompressionUs);
+    }
+    if (snapshot.numDecompressions) {
+        Print(shell,
+              "Decompressed %u values, avg %u us, max %u us\n",
+              (unsigned) snapshot.numDecompressions,
+              (unsigned) (snapshot.decompressionUs / snapshot.numDecompressions),
+              (unsigned) snapshot.maxDecompressionUs);
+    }
+
+    Print(shell, "%-9s %8s %8s %8s %8s\n", "us", "count", "p50", "p90", "p99");
+    for (size_t i = 0; i < kHAPPlatformKeyValueStoreStatsOperation_Count; i++) {
+        uint32_t count = 0;
+        for (size_t j = 0; j < kHAPPlatformKeyValueStoreStatsNumBuckets; j++) {
+            count += snapshot.latency[i][j];
+        }
+        Print(shell,
+              "%-9s %8u %8u %8u %8u\n",
+              operationNames[i],
+              (unsigned) count,
+              (unsigned) Percentile(snapshot.latency[i], 50),
+              (unsigned) Percentile(snapshot.latency[i], 90),
+              (unsigned) Percentile(snapshot.latency[i], 99));
+    }
+}
+
+void HAPPlatformKeyValueStoreStatsDump(void) {
+    PrintStats(NULL);
+}
+
+void HAPPlatformKeyValueStoreStatsClear(void) {
+    k_spinlock_key_t lockKey = k_spin_lock(&stats.lock);
+    HAPRawBufferZero(&stats.snapshot, sizeof stats.snapshot);
+    k_spin_unlock(&stats.lock, lockKey);
+}
+
+#if defined(CONFIG_SHELL)
+
+static int CommandShow(const struct shell* shell, size_t argc HAP_UNUSED, char** argv HAP_UNUSED) {
+    PrintStats(shell);
+    return 0;
+}
+
+static int CommandClear(const struct shell* shell HAP_UNUSED, size_t argc HAP_UNUSED, char** argv HAP_UNUSED) {
+    HAPPlatformKeyValueStoreStatsClear();
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+        keyValueStoreStatsCommands,
+        SHELL_CMD(show, NULL, "Print counters per domain and record, and latency percentiles", CommandShow),
+        SHELL_CMD(clear, NULL, "Clear the counters and the histograms", CommandClear),
+        SHELL_SUBCMD_SET_END);
+
+SHELL_CMD_REGISTER(kvsstats, &keyValueStoreStatsCommands, "Key-value store statistics", NULL);
+
+#endif // CONFIG_SHELL
+
+#endif // CONFIG_HAP_KVS_STATS
@@ -0,0 +1,306 @@
+// Disclaimer: IMPORTANT: This Apple software is supplied to you, by Apple Inc. ("Apple"), in your
+// capacity as a current, and in good standing, Licensee in the MFi Licensing Program. Use of this
+// Apple software is governed by and subject to the terms and conditions of your MFi License,
+// including, but not limited to, the restrictions specified in the provision entitled "Public
+// Software", and is further subject to your agreement to the following additional terms, and your
+// agreement that the use, installation, modification or redistribution of this Apple software
+// constitutes acceptance of these additional terms. If you do not agree with these additional terms,
+// you may not use, install, modify or redistribute this Apple software.
+//
+// Subject to all of these terms and in consideration of your agreement to abide by them, Apple grants
+// you, for as long as you are a current and in good-standing MFi Licensee, a personal, non-exclusive
+// license, under Apple's copyrights in this Apple software (the "Apple Software"), to use,
+// reproduce, and modify the Apple Software in source form, and to use, reproduce, modify, and
+// redistribute the Apple Software, with or without modifications, in binary form, in each of the
+// foregoing cases to the extent necessary to develop and/or manufacture "Proposed Products" and
+// "Licensed Products" in accordance with the terms of your MFi License. While you may not
+// redistribute the Apple Software in source form, should you redistribute the Apple Software in binary
+// form, you must retain this notice and the following text and disclaimers in all such redistributions
+// of the Apple Software. Neither the name, trademarks, service marks, or logos of Apple Inc. may be
+// used to endorse or promote products derived from the Apple Software without specific prior written
+// permission from Apple. Except as expressly stated in this notice, no other rights or licenses,
+// express or implied, are granted by Apple herein, including but not limited to any patent rights that
+// may be infringed by your derivative works or by other works in which the Apple Software may be
+// incorporated. Apple may terminate this license to the Apple Software by removing it from the list
+// of Licensed Technology in the MFi License, or otherwise in accordance with the terms of such MFi License.
+//
+// Unless you explicitly state otherwise, if you provide any ideas, suggestions, recommendations, bug
+// fixes or enhancements to Apple in connection with this software ("Feedback"), you hereby grant to
+// Apple a non-exclusive, fully paid-up, perpetual, irrevocable, worldwide license to make, use,
+// reproduce, incorporate, modify, display, perform, sell, make or have made derivative works of,
+// distribute (directly or indirectly) and sublicense, such Feedback in connection with Apple products
+// and services. Providing this Feedback is voluntary, but if you do provide Feedback to Apple, you
+// acknowledge and agree that Apple may exercise the license granted above without the payment of
+// royalties or further consideration to Participant.
+
+// The Apple Software is provided by Apple on an "AS IS" basis. APPLE MAKES NO WARRANTIES, EXPRESS OR
+// IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY
+// AND FITNESS FOR A PARTICULAR PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR
+// IN COMBINATION WITH YOUR PRODUCTS.
+//
+// IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION
+// AND/OR DISTRIBUTION OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+// (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// Copyright (C) 2015-2021 Apple Inc. All Rights Reserved.
+
+#ifndef HAP_PLATFORM_KEY_VALUE_STORE_STATS_H
+#define HAP_PLATFORM_KEY_VALUE_STORE_STATS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "HAPPlatform.h"
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull begin
+#endif
+
+/**@file
+ * Key-value store instrumentation.
+ *
+ * Counts reads, writes and removals per domain and per record, together with the records and bytes that reach the
+ * backend. Bytes include the padding information and the padding of a record, so they are the bytes the backend
+ * stores, not the bytes passed to HAPPlatformKeyValueStoreSet. Writes that are superseded in the write-back queue
+ * are counted as writes but never reach the backend. Get, Set and Remove also feed log2 latency histograms.
+ * With CONFIG_HAP_KVS_COMPRESSION, the bytes saved by compression and the time spent compressing and decompressing
+ * are counted as well.
+ *
+ * The statistics are compiled in with CONFIG_HAP_KVS_STATS. Otherwise all functions are empty. With CONFIG_SHELL
+ * they are printed with the "kvsstats" shell command.
+ */
+
+/**
+ * Instrumented key-value store operation.
+ */
+HAP_ENUM_BEGIN(uint8_t, HAPPlatformKeyValueStoreStatsOperation) {
+    /** HAPPlatformKeyValueStoreGet. */
+    kHAPPlatformKeyValueStoreStatsOperation_Get,
+
+    /** HAPPlatformKeyValueStoreSet. */
+    kHAPPlatformKeyValueStoreStatsOperation_Set,
+
+    /** HAPPlatformKeyValueStoreRemove. */
+    kHAPPlatformKeyValueStoreStatsOperation_Remove,
+
+    /** Number of operations. */
+    kHAPPlatformKeyValueStoreStatsOperation_Count
+} HAP_ENUM_END(uint8_t, HAPPlatformKeyValueStoreStatsOperation);
+
+/**
+ * Number of log2 latency histogram buckets. Bucket i counts latencies up to 2^i us, the last bucket everything above.
+ */
+#define kHAPPlatformKeyValueStoreStatsNumBuckets ((size_t) 20)
+
+/**
+ * Counters of a domain or of a record.
+ */
+typedef struct {
+    /** Number of HAPPlatformKeyValueStoreGet calls. */
+    uint32_t numReads;
+
+    /** Number of HAPPlatformKeyValueStoreSet calls. */
+    uint32_t numWrites;
+
+    /** Number of HAPPlatformKeyValueStoreRemove calls. */
+    uint32_t numRemoves;
+
+    /** Number of records written to or deleted from the backend. */
+    uint32_t numPersisted;
+
+    /** Number of bytes written to the backend. */
+    uint32_t numBytesWritten;
+
+    /** Number of HAPPlatformKeyValueStorePurgeDomain calls. Domains only. */
+    uint32_t numPurges;
+
+    /** Domain. */
+    HAPPlatformKeyValueStoreDomain domain;
+
+    /** Key. Records only. */
+    HAPPlatformKeyValueStoreKey key;
+} HAPPlatformKeyValueStoreStatsCounters;
+
+/**
+ * Cycle counter value marking the beginning of an operation.
+ */
+typedef uint32_t HAPPlatformKeyValueStoreStatsStamp;
+
+#if defined(CONFIG_HAP_KVS_STATS)
+
+/**
+ * Snapshot of the statistics.
+ */
+typedef struct {
+    /** Counters of the domains, in order of first use. */
+    HAPPlatformKeyValueStoreStatsCounters domains[CONFIG_HAP_KVS_STATS_DOMAINS];
+    size_t numDomains;
+
+    /** Counters of the records, in order of first use. */
+    HAPPlatformKeyValueStoreStatsCounters records[CONFIG_HAP_KVS_STATS_RECORDS];
+    size_t numRecords;
+
+    /** Counters of all operations on domains or records that did not fit into the tables. */
+    HAPPlatformKeyValueStoreStatsCounters untracked;
+
+    /** Number of bytes written to the batch journal. */
+    uint32_t numJournalBytesWritten;
+
+    /** Number of values that were compressed, including values that did not become smaller. */
+    uint32_t numCompressions;
+
+    /** Number of values stored compressed. */
+    uint32_t numCompressedValues;
+
+    /** Number of bytes saved by compression in formatted records. */
+    uint32_t numBytesSaved;
+
+    /** Time spent compressing in us, in total and at most. */
+    uint32_t compressionUs;
+    uint32_t maxCompressionUs;
+
+    /** Number of values that were decompressed. */
+    uint32_t numDecompressions;
+
+    /** Time spent decompressing in us, in total and at most. */
+    uint32_t decompressionUs;
+    uint32_t maxDecompressionUs;
+
+    /** Latency histograms in us. */
+    uint32_t latency[kHAPPlatformKeyValueStoreStatsOperation_Count][kHAPPlatformKeyValueStoreStatsNumBuckets];
+} HAPPlatformKeyValueStoreStatsSnapshot;
+
+/**
+ * Gets the current cycle counter value.
+ *
+ * @return Stamp to pass to HAPPlatformKeyValueStoreStatsRecordOperation.
+ */
+HAPPlatformKeyValueStoreStatsStamp HAPPlatformKeyValueStoreStatsBegin(void);
+
+/**
+ * Counts an operation that started at the given stamp and ends now.
+ *
+ * @param      operation            Operation.
+ * @param      domain               Domain.
+ * @param      key                  Key.
+ * @param      stamp                Value returned by HAPPlatformKeyValueStoreStatsBegin.
+ */
+void HAPPlatformKeyValueStoreStatsRecordOperation(
+        HAPPlatformKeyValueStoreStatsOperation operation,
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreKey key,
+        HAPPlatformKeyValueStoreStatsStamp stamp);
+
+/**
+ * Counts a record written to or deleted from the backend.
+ *
+ * @param      domain               Domain.
+ * @param      key                  Key.
+ * @param      numBytes             Number of bytes written. 0 for a deletion.
+ */
+void HAPPlatformKeyValueStoreStatsRecordPersist(
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreKey key,
+        size_t numBytes);
+
+/**
+ * Counts a batch journal written to the backend.
+ *
+ * @param      numBytes             Number of bytes written.
+ */
+void HAPPlatformKeyValueStoreStatsRecordJournal(size_t numBytes);
+
+/**
+ * Counts a purge of a domain.
+ *
+ * @param      domain               Domain.
+ */
+void HAPPlatformKeyValueStoreStatsRecordPurge(HAPPlatformKeyValueStoreDomain domain);
+
+/**
+ * Counts the compression of a value that started at the given stamp and ends now.
+ *
+ * @param      numBytesSaved        Number of bytes the formatted record shrank by. 0 if it is stored uncompressed.
+ * @param      stamp                Value returned by HAPPlatformKeyValueStoreStatsBegin.
+ */
+void HAPPlatformKeyValueStoreStatsRecordCompression(size_t numBytesSaved, HAPPlatformKeyValueStoreStatsStamp stamp);
+
+/**
+ * Counts the decompression of a value that started at the given stamp and ends now.
+ *
+ * @param      stamp                Value returned by HAPPlatformKeyValueStoreStatsBegin.
+ */
+void HAPPlatformKeyValueStoreStatsRecordDecompression(HAPPlatformKeyValueStoreStatsStamp stamp);
+
+/**
+ * Gets a consistent snapshot of the statistics.
+ *
+ * @param[out] snapshot             Snapshot.
+ */
+void HAPPlatformKeyValueStoreStatsGetSnapshot(HAPPlatformKeyValueStoreStatsSnapshot* snapshot);
+
+/**
+ * Prints the statistics to the console.
+ */
+void HAPPlatformKeyValueStoreStatsDump(void);
+
+/**
+ * Clears the statistics.
+ */
+void HAPPlatformKeyValueStoreStatsClear(void);
+
+#else
+
+static inline HAPPlatformKeyValueStoreStatsStamp HAPPlatformKeyValueStoreStatsBegin(void) {
+    return 0;
+}
+
+static inline void HAPPlatformKeyValueStoreStatsRecordOperation(
+        HAPPlatformKeyValueStoreStatsOperation operation HAP_UNUSED,
+        HAPPlatformKeyValueStoreDomain domain HAP_UNUSED,
+        HAPPlatformKeyValueStoreKey key HAP_UNUSED,
+        HAPPlatformKeyValueStoreStatsStamp stamp HAP_UNUSED) {
+}
+
+static inline void HAPPlatformKeyValueStoreStatsRecordPersist(
+        HAPPlatformKeyValueStoreDomain domain HAP_UNUSED,
+        HAPPlatformKeyValueStoreKey key HAP_UNUSED,
+        size_t numBytes HAP_UNUSED) {
+}
+
+static inline void HAPPlatformKeyValueStoreStatsRecordJournal(size_t numBytes HAP_UNUSED) {
+}
+
+static inline void HAPPlatformKeyValueStoreStatsRecordPurge(HAPPlatformKeyValueStoreDomain domain HAP_UNUSED) {
+}
+
+static inline void HAPPlatformKeyValueStoreStatsRecordCompression(
+        size_t numBytesSaved HAP_UNUSED,
+        HAPPlatformKeyValueStoreStatsStamp stamp HAP_UNUSED) {
+}
+
+static inline void
+        HAPPlatformKeyValueStoreStatsRecordDecompression(HAPPlatformKeyValueStoreStatsStamp stamp HAP_UNUSED) {
+}
+
+static inline void HAPPlatformKeyValueStoreStatsDump(void) {
+}
+
+static inline void HAPPlatformKeyValueStoreStatsClear(void) {
+}
+
+#endif
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull end
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -50,6 +50,7 @@
 #include "HAPCharacteristicTypes.h"
 #include "HAPCrypto.h"
 #include "HAPPlatform.h"
+#include "HAPPlatformKeyValueStore+Init.h"
 
 #if HAP_FEATURE_ENABLED(HAP_FEATURE_NFC_ACCESS)
 
@@ -118,6 +119,20 @@ static struct {
      */
     HAPConfigurationStateChangeCallback _Nullable configurationStateChangeCallback;
 
+    /**
+     * Open key-value store batch. The configuration state is restored when the batch is aborted, and its change is
+     * reported when the outermost batch is committed.
+     */
+    struct {
+        size_t depth;
+
+        /** Configuration state when the outermost batch was begun. */
+        uint16_t configurationState;
+
+        /** The batch or a nested batch was aborted, so the outermost batch discards its writes. */
+        bool isAborted;
+    } batch;
+
     /**
      * NFC transaction detected callback function
      */
@@ -568,11 +583,64 @@ static void DecrementDeviceCredentialKeyNumEntries(uint8_t state) {
 }
 
 /**
- * Increment the configuration state value and persist to memory
+ * Begin a key-value store batch. Batches may be nested.
+ */
+static void BeginBatch(void) {
+    if (!nfcAccessPlatform.batch.depth) {
+        nfcAccessPlatform.batch.configurationState = nfcAccessPlatform.configurationState;
+        nfcAccessPlatform.batch.isAborted = false;
+    }
+    nfcAccessPlatform.batch.depth++;
+    HAPPlatformKeyValueStoreBeginBatch(nfcAccessPlatform.keyValueStore);
+}
+
+/**
+ * End the outermost batch: restore the configuration state if the batch was aborted, otherwise report its change.
+ */
+static void EndOutermostBatch(void) {
+    if (nfcAccessPlatform.batch.isAborted) {
+        nfcAccessPlatform.configurationState = nfcAccessPlatform.batch.configurationState;
+    } else if (
+            nfcAccessPlatform.configurationState != nfcAccessPlatform.batch.configurationState &&
+            nfcAccessPlatform.configurationStateChangeCallback) {
+        nfcAccessPlatform.configurationStateChangeCallback();
+    }
+}
+
+/**
+ * Commit a key-value store batch. Only the outermost batch is committed, and only if no nested batch was aborted.
+ */
+static void CommitBatch(void) {
+    HAPPrecondition(nfcAccessPlatform.batch.depth);
+
+    HAPPlatformKeyValueStoreCommitBatch(nfcAccessPlatform.keyValueStore);
+    if (!--nfcAccessPlatform.batch.depth) {
+        EndOutermostBatch();
+    }
+}
+
+/**
+ * Abort a key-value store batch. The writes of the outermost batch are discarded.
+ */
+static void AbortBatch(void) {
+    HAPPrecondition(nfcAccessPlatform.batch.depth);
+
+    HAPPlatformKeyValueStoreAbortBatch(nfcAccessPlatform.keyValueStore);
+    nfcAccessPlatform.batch.isAborted = true;
+    if (!--nfcAccessPlatform.batch.depth) {
+        EndOutermostBatch();
+    }
+}
+
+/**
+ * Increment the configuration state value and persist to memory. Must be called in a batch, which restores the value
+ * if it is aborted, and reports the change when it is committed.
  *
  * @return Error from persisting to memory
  */
 static HAPError IncrementConfigurationState(void) {
+    HAPPrecondition(nfcAccessPlatform.batch.depth);
+
     nfcAccessPlatform.configurationState++;
     HAPError err = HAPPlatformKeyValueStoreSet(
             nfcAccessPlatform.keyValueStore,
@@ -580,14 +648,41 @@ static HAPError IncrementConfigurationState(void) {
             kKeyValueStoreKeyConfigurationState,
             &nfcAccessPlatform.configurationState,
             sizeof nfcAccessPlatform.configurationState);
-    if (err) {
+    if (err && err != kHAPError_OutOfResources) {
         HAPAssert(err == kHAPError_Unknown);
         HAPFatalError();
     }
+    return err;
+}
 
-    if (nfcAccessPlatform.configurationStateChangeCallback) {
-        nfcAccessPlatform.configurationStateChangeCallback();
+/**
+ * Persist a record together with the incremented configuration state. Both are written in one key-value store batch,
+ * so the configuration state never changes without the record.
+ *
+ * @param   key         The key of the record
+ * @param   bytes       The record
+ * @param   numBytes    The length of the record
+ *
+ * @return Error from persisting to memory
+ */
+static HAPError StoreAndIncrementConfigurationState(
+        HAPPlatformKeyValueStoreKey key,
+        const void* _Nonnull bytes,
+        size_t numBytes) {
+    HAPPrecondition(bytes);
+
+    BeginBatch();
+    HAPError err = HAPPlatformKeyValueStoreSet(
+            nfcAccessPlatform.keyValueStore, nfcAccessPlatform.storeDomain, key, bytes, numBytes);
+    if (!err) {
+        err = IncrementConfigurationState();
     }
+    if (err) {
+        // Neither the record nor the configuration state is written. An enclosing batch is discarded as well.
+        AbortBatch();
+        return err;
+    }
+    CommitBatch();
     return err;
 }
 
@@ -623,9 +718,7 @@ static HAPError UpdateDeviceCredentialEntryState(NfcAccessDeviceCredentialKeyEnt
         // TODO: Handle overflow and reassign counter for all entries
     }
 
-    HAPError err = HAPPlatformKeyValueStoreSet(
-            nfcAccessPlatform.keyValueStore,
-            nfcAccessPlatform.storeDomain,
+    HAPError err = StoreAndIncrementConfigurationState(
             kKeyValueStoreKeyDeviceCredentialKeyList,
             &nfcAccessDeviceCredentialKeyList,
             GET_LIST_BYTES(
@@ -633,13 +726,7 @@ static HAPError UpdateDeviceCredentialEntryState(NfcAccessDeviceCredentialKeyEnt
                     nfcAccessDeviceCredentialKeyList,
                     NfcAccessDeviceCredentialKeyEntry));
     if (err) {
-        HAPAssert(err == kHAPError_Unknown);
-        return err;
-    }
-
-    err = IncrementConfigurationState();
-    if (err) {
-        HAPAssert(err == kHAPError_Unknown);
+        HAPAssert(err == kHAPError_Unknown || err == kHAPError_OutOfResources);
         return err;
     }
 
@@ -834,20 +921,12 @@ HAPError HAPPlatformNfcAccessIssuerKeyAdd(
 
     nfcAccessIssuerKeyList.numEntries++;
 
-    HAPError err = HAPPlatformKeyValueStoreSet(
-            nfcAccessPlatform.keyValueStore,
-            nfcAccessPlatform.storeDomain,
+    HAPError err = StoreAndIncrementConfigurationState(
             kKeyValueStoreKeyIssuerKeyList,
             &nfcAccessIssuerKeyList,
             GET_LIST_BYTES(NfcAccessIssuerKeyList, nfcAccessIssuerKeyList, NfcAccessIssuerKeyEntry));
     if (err) {
-        HAPAssert(err == kHAPError_Unknown);
-        return err;
-    }
-
-    err = IncrementConfigurationState();
-    if (err) {
-        HAPAssert(err == kHAPError_Unknown);
+        HAPAssert(err == kHAPError_Unknown || err == kHAPError_OutOfResources);
         return err;
     }
 
@@ -912,20 +991,15 @@ HAPError HAPPlatformNfcAccessIssuerKeyRemove(
         return kHAPError_None;
     }
 
-    HAPError err = HAPPlatformKeyValueStoreSet(
-            nfcAccessPlatform.keyValueStore,
-            nfcAccessPlatform.storeDomain,
+    // The issuer key list and the device credential key list are persisted in one batch
+    BeginBatch();
+    HAPError err = StoreAndIncrementConfigurationState(
             kKeyValueStoreKeyIssuerKeyList,
             &nfcAccessIssuerKeyList,
             GET_LIST_BYTES(NfcAccessIssuerKeyList, nfcAccessIssuerKeyList, NfcAccessIssuerKeyEntry));
     if (err) {
-        HAPAssert(err == kHAPError_Unknown);
-        return err;
-    }
-
-    err = IncrementConfigurationState();
-    if (err) {
-        HAPAssert(err == kHAPError_Unknown);
+        HAPAssert(err == kHAPError_Unknown || err == kHAPError_OutOfResources);
+        AbortBatch();
         return err;
     }
 
@@ -966,10 +1040,12 @@ HAPError HAPPlatformNfcAccessIssuerKeyRemove(
                         nfcAccessDeviceCredentialKeyList,
                         NfcAccessDeviceCredentialKeyEntry));
         if (err) {
-            HAPAssert(err == kHAPError_Unknown);
+            HAPAssert(err == kHAPError_Unknown || err == kHAPError_OutOfResources);
+            AbortBatch();
             return err;
         }
     }
+    CommitBatch();
 
     *statusCode = NFC_ACCESS_STATUS_CODE_SUCCESS;
     return kHAPError_None;
@@ -1117,9 +1193,7 @@ HAPError HAPPlatformNfcAccessDeviceCredentialKeyAdd(
         // TODO: Handle overflow and reassign counter for all entries
     }
 
-    HAPError err = HAPPlatformKeyValueStoreSet(
-            nfcAccessPlatform.keyValueStore,
-            nfcAccessPlatform.storeDomain,
+    HAPError err = StoreAndIncrementConfigurationState(
             kKeyValueStoreKeyDeviceCredentialKeyList,
             &nfcAccessDeviceCredentialKeyList,
             GET_LIST_BYTES(
@@ -1127,13 +1201,7 @@ HAPError HAPPlatformNfcAccessDeviceCredentialKeyAdd(
                     nfcAccessDeviceCredentialKeyList,
                     NfcAccessDeviceCredentialKeyEntry));
     if (err) {
-        HAPAssert(err == kHAPError_Unknown);
-        return err;
-    }
-
-    err = IncrementConfigurationState();
-    if (err) {
-        HAPAssert(err == kHAPError_Unknown);
+        HAPAssert(err == kHAPError_Unknown || err == kHAPError_OutOfResources);
         return err;
     }
 
@@ -1184,9 +1252,7 @@ HAPError HAPPlatformNfcAccessDeviceCredentialKeyRemove(
         return kHAPError_None;
     }
 
-    HAPError err = HAPPlatformKeyValueStoreSet(
-            nfcAccessPlatform.keyValueStore,
-            nfcAccessPlatform.storeDomain,
+    HAPError err = StoreAndIncrementConfigurationState(
             kKeyValueStoreKeyDeviceCredentialKeyList,
             &nfcAccessDeviceCredentialKeyList,
             GET_LIST_BYTES(
@@ -1194,13 +1260,7 @@ HAPError HAPPlatformNfcAccessDeviceCredentialKeyRemove(
                     nfcAccessDeviceCredentialKeyList,
                     NfcAccessDeviceCredentialKeyEntry));
     if (err) {
-        HAPAssert(err == kHAPError_Unknown);
-        return err;
-    }
-
-    err = IncrementConfigurationState();
-    if (err) {
-        HAPAssert(err == kHAPError_Unknown);
+        HAPAssert(err == kHAPError_Unknown || err == kHAPError_OutOfResources);
         return err;
     }
 
@@ -1271,20 +1331,12 @@ HAPError HAPPlatformNfcAccessReaderKeyAdd(
             nfcAccessReaderKey.readerIdentifier, readerKey->readerIdentifier, NFC_ACCESS_KEY_IDENTIFIER_BYTES);
     HAPRawBufferCopyBytes(nfcAccessReaderKey.identifier, identifier, NFC_ACCESS_KEY_IDENTIFIER_BYTES);
 
-    HAPError err = HAPPlatformKeyValueStoreSet(
-            nfcAccessPlatform.keyValueStore,
-            nfcAccessPlatform.storeDomain,
+    HAPError err = StoreAndIncrementConfigurationState(
             kKeyValueStoreKeyReaderKey,
             &nfcAccessReaderKey,
             sizeof nfcAccessReaderKey);
     if (err) {
-        HAPAssert(err == kHAPError_Unknown);
-        return err;
-    }
-
-    err = IncrementConfigurationState();
-    if (err) {
-        HAPAssert(err == kHAPError_Unknown);
+        HAPAssert(err == kHAPError_Unknown || err == kHAPError_OutOfResources);
         return err;
     }
 
@@ -1316,20 +1368,12 @@ HAPError HAPPlatformNfcAccessReaderKeyRemove(
         return kHAPError_None;
     }
 
-    HAPError err = HAPPlatformKeyValueStoreSet(
-            nfcAccessPlatform.keyValueStore,
-            nfcAccessPlatform.storeDomain,
+    HAPError err = StoreAndIncrementConfigurationState(
             kKeyValueStoreKeyReaderKey,
             &nfcAccessReaderKey,
             sizeof nfcAccessReaderKey);
     if (err) {
-        HAPAssert(err == kHAPError_Unknown);
-        return err;
-    }
-
-    err = IncrementConfigurationState();
-    if (err) {
-        HAPAssert(err == kHAPError_Unknown);
+        HAPAssert(err == kHAPError_Unknown || err == kHAPError_OutOfResources);
         return err;
     }
 
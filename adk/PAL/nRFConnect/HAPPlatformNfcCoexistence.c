@@ -0,0 +1,203 @@
+// Disclaimer: IMPORTANT: This Apple software is supplied to you, by Apple Inc. ("Apple"), in your
+// capacity as a current, and in good standing, Licensee in the MFi Licensing Program. Use of this
+// Apple software is governed by and subject to the terms and conditions of your MFi License,
+// including, but not limited to, the restrictions specified in the provision entitled "Public
+// Software", and is further subject to your agreement to the following additional terms, and your
+// agreement that the use, installation, modification or redistribution of this Apple software
+// constitutes acceptance of these additional terms. If you do not agree with these additional terms,
+// you may not use, install, modify or redistribute this Apple software.
+//
+// Subject to all of these terms and in consideration of your agreement to abide by them, Apple grants
+// you, for as long as you are a current and in good-standing MFi Licensee, a personal, non-exclusive
+// license, under Apple's copyrights in this Apple software (the "Apple Software"), to use,
+// reproduce, and modify the Apple Software in source form, and to use, reproduce, modify, and
+// redistribute the Apple Software, with or without modifications, in binary form, in each of the
+// foregoing cases to the extent necessary to develop and/or manufacture "Proposed Products" and
+// "Licensed Products" in accordance with the terms of your MFi License. While you may not
+// redistribute the Apple Software in source form, should you redistribute the Apple Software in binary
+// form, you must retain this notice and the following text and disclaimers in all such redistributions
+// of the Apple Software. Neither the name, trademarks, service marks, or logos of Apple Inc. may be
+// used to endorse or promote products derived from the Apple Software without specific prior written
+// permission from Apple. Except as expressly stated in this notice, no other rights or licenses,
+// express or implied, are granted by Apple herein, including but not limited to any patent rights that
+// may be infringed by your derivative works or by other works in which the Apple Software may be
+// incorporated. Apple may terminate this license to the Apple Software by removing it from the list
+// of Licensed Technology in the MFi License, or otherwise in accordance with the terms of such MFi License.
+//
+// Unless you explicitly state otherwise, if you provide any ideas, suggestions, recommendations, bug
+// fixes or enhancements to Apple in connection with this software ("Feedback"), you hereby grant to
+// Apple a non-exclusive, fully paid-up, perpetual, irrevocable, worldwide license to make, use,
+// reproduce, incorporate, modify, display, perform, sell, make or have made derivative works of,
+// distribute (directly or indirectly) and sublicense, such Feedback in connection with Apple products
+// and services. Providing this Feedback is voluntary, but if you do provide Feedback to Apple, you
+// acknowledge and agree that Apple may exercise the license granted above without the payment of
+// royalties or further consideration to Participant.
+
+// The Apple Software is provided by Apple on an "AS IS" basis. APPLE MAKES NO WARRANTIES, EXPRESS OR
+// IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY
+// AND FITNESS FOR A PARTICULAR PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR
+// IN COMBINATION WITH YOUR PRODUCTS.
+//
+// IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION
+// AND/OR DISTRIBUTION OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+// (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// Copyright (C) 2015-2021 Apple Inc. All Rights Reserved.
+
+#include <zephyr/kernel.h>
+
+#include "HAPPlatform.h"
+#include "HAPPlatformNfcCoexistence.h"
+
+#ifndef CONFIG_HAP_NFC_COEXISTENCE_MAX_DEFERRAL_MS
+#define CONFIG_HAP_NFC_COEXISTENCE_MAX_DEFERRAL_MS 500
+#endif
+
+/**
+ * Longest time a reader poll is deferred to an external field.
+ */
+#define kMaxDeferralMs ((HAPTime) CONFIG_HAP_NFC_COEXISTENCE_MAX_DEFERRAL_MS)
+
+/**
+ * Time after the reader switched its field off until a field still seen by the emulated tag is external.
+ */
+#define kFieldSettleMs ((HAPTime) 20)
+
+HAP_ENUM_BEGIN(uint8_t, FieldState) {
+    kFieldState_None,     /**< No external field. */
+    kFieldState_Settling, /**< Field seen during the last reader slot, origin not known yet. */
+    kFieldState_External  /**< External field. */
+} HAP_ENUM_END(uint8_t, FieldState);
+
+static struct {
+    struct k_spinlock lock;
+    bool readerActive;
+    HAPTime readerReleaseTime;
+    bool fieldOn;
+    bool fieldOnDuringReader;
+    bool readPending;
+    HAPTime fieldOnTime;
+    HAPPlatformNfcCoexistenceStats stats;
+} coexistence;
+
+static K_SEM_DEFINE(fieldOffSemaphore, 0, 1);
+
+static void ConfirmExternalField(void) {
+    coexistence.fieldOnDuringReader = false;
+    coexistence.readPending = true;
+    coexistence.stats.emulationFields++;
+    coexistence.stats.emulationContended++;
+}
+
+/**
+ * Classifies the field seen by the emulated tag. Must be called with the lock held.
+ */
+static FieldState GetFieldState(HAPTime now, HAPTime* settleEnd) {
+    if (!coexistence.fieldOn) {
+        return kFieldState_None;
+    }
+    if (coexistence.fieldOnDuringReader) {
+        *settleEnd = coexistence.readerReleaseTime + kFieldSettleMs;
+        if (now < *settleEnd) {
+            return kFieldState_Settling;
+        }
+        // The field outlived the reader field, a phone arrived during the reader slot.
+        ConfirmExternalField();
+    }
+    return kFieldState_External;
+}
+
+HAPTime HAPPlatformNfcCoexistenceReaderAcquire(void) {
+    HAPTime start = HAPPlatformClockGetCurrent();
+    HAPTime deadline = start + kMaxDeferralMs;
+    bool deferred = false;
+
+    for (;;) {
+        k_spinlock_key_t key = k_spin_lock(&coexistence.lock);
+        HAPTime now = HAPPlatformClockGetCurrent();
+        HAPTime wakeup = deadline;
+        FieldState state = GetFieldState(now, &wakeup);
+
+        if (state == kFieldState_None || now >= deadline) {
+            HAPTime waitMs = now - start;
+            coexistence.readerActive = true;
+            coexistence.stats.readerGrants++;
+            if (deferred) {
+                coexistence.stats.readerDeferrals++;
+            }
+            if (state != kFieldState_None) {
+                coexistence.stats.readerForcedGrants++;
+            }
+            coexistence.stats.readerTotalWaitMs += (uint32_t) waitMs;
+            coexistence.stats.readerMaxWaitMs = HAPMax(coexistence.stats.readerMaxWaitMs, (uint32_t) waitMs);
+            k_spin_unlock(&coexistence.lock, key);
+            return waitMs;
+        }
+
+        if (state == kFieldState_External) {
+            deferred = true;
+        }
+
+        // Reset under the lock, so a field off between unlocking and waiting is not lost.
+        k_sem_reset(&fieldOffSemaphore);
+        k_spin_unlock(&coexistence.lock, key);
+
+        (void) k_sem_take(&fieldOffSemaphore, K_MSEC(HAPMin(wakeup, deadline) - now));
+    }
+}
+
+void HAPPlatformNfcCoexistenceReaderRelease(void) {
+    k_spinlock_key_t key = k_spin_lock(&coexistence.lock);
+    coexistence.readerActive = false;
+    coexistence.readerReleaseTime = HAPPlatformClockGetCurrent();
+    k_spin_unlock(&coexistence.lock, key);
+}
+
+void HAPPlatformNfcCoexistenceEmulationFieldOn(void) {
+    k_spinlock_key_t key = k_spin_lock(&coexistence.lock);
+    coexistence.fieldOn = true;
+    coexistence.fieldOnTime = HAPPlatformClockGetCurrent();
+    coexistence.fieldOnDuringReader = coexistence.readerActive;
+    coexistence.readPending = !coexistence.readerActive;
+    if (!coexistence.readerActive) {
+        coexistence.stats.emulationFields++;
+    }
+    k_spin_unlock(&coexistence.lock, key);
+}
+
+void HAPPlatformNfcCoexistenceEmulationFieldOff(void) {
+    k_spinlock_key_t key = k_spin_lock(&coexistence.lock);
+    coexistence.fieldOn = false;
+    coexistence.fieldOnDuringReader = false;
+    coexistence.readPending = false;
+    k_spin_unlock(&coexistence.lock, key);
+
+    k_sem_give(&fieldOffSemaphore);
+}
+
+void HAPPlatformNfcCoexistenceEmulationDataRead(void) {
+    k_spinlock_key_t key = k_spin_lock(&coexistence.lock);
+    // Only a phone reads the setup tag once the reader field is off.
+    if (coexistence.fieldOnDuringReader && !coexistence.readerActive) {
+        ConfirmExternalField();
+    }
+    if (coexistence.readPending) {
+        uint32_t latencyMs = (uint32_t)(HAPPlatformClockGetCurrent() - coexistence.fieldOnTime);
+        coexistence.stats.emulationReads++;
+        coexistence.stats.emulationTotalReadLatencyMs += latencyMs;
+        coexistence.stats.emulationMaxReadLatencyMs = HAPMax(coexistence.stats.emulationMaxReadLatencyMs, latencyMs);
+        coexistence.readPending = false;
+    }
+    k_spin_unlock(&coexistence.lock, key);
+}
+
+void HAPPlatformNfcCoexistenceGetStats(HAPPlatformNfcCoexistenceStats* stats) {
+    HAPPrecondition(stats);
+
+    k_spinlock_key_t key = k_spin_lock(&coexistence.lock);
+    *stats = coexistence.stats;
+    k_spin_unlock(&coexistence.lock, key);
+}
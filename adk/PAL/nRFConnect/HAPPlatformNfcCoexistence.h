@@ -0,0 +1,156 @@
+// Disclaimer: IMPORTANT: This Apple software is supplied to you, by Apple Inc. ("Apple"), in your
+// capacity as a current, and in good standing, Licensee in the MFi Licensing Program. Use of this
+// Apple software is governed by and subject to the terms and conditions of your MFi License,
+// including, but not limited to, the restrictions specified in the provision entitled "Public
+// Software", and is further subject to your agreement to the following additional terms, and your
+// agreement that the use, installation, modification or redistribution of this Apple software
+// constitutes acceptance of these additional terms. If you do not agree with these additional terms,
+// you may not use, install, modify or redistribute this Apple software.
+//
+// Subject to all of these terms and in consideration of your agreement to abide by them, Apple grants
+// you, for as long as you are a current and in good-standing MFi Licensee, a personal, non-exclusive
+// license, under Apple's copyrights in this Apple software (the "Apple Software"), to use,
+// reproduce, and modify the Apple Software in source form, and to use, reproduce, modify, and
+// redistribute the Apple Software, with or without modifications, in binary form, in each of the
+// foregoing cases to the extent necessary to develop and/or manufacture "Proposed Products" and
+// "Licensed Products" in accordance with the terms of your MFi License. While you may not
+// redistribute the Apple Software in source form, should you redistribute the Apple Software in binary
+// form, you must retain this notice and the following text and disclaimers in all such redistributions
+// of the Apple Software. Neither the name, trademarks, service marks, or logos of Apple Inc. may be
+// used to endorse or promote products derived from the Apple Software without specific prior written
+// permission from Apple. Except as expressly stated in this notice, no other rights or licenses,
+// express or implied, are granted by Apple herein, including but not limited to any patent rights that
+// may be infringed by your derivative works or by other works in which the Apple Software may be
+// incorporated. Apple may terminate this license to the Apple Software by removing it from the list
+// of Licensed Technology in the MFi License, or otherwise in accordance with the terms of such MFi License.
+//
+// Unless you explicitly state otherwise, if you provide any ideas, suggestions, recommendations, bug
+// fixes or enhancements to Apple in connection with this software ("Feedback"), you hereby grant to
+// Apple a non-exclusive, fully paid-up, perpetual, irrevocable, worldwide license to make, use,
+// reproduce, incorporate, modify, display, perform, sell, make or have made derivative works of,
+// distribute (directly or indirectly) and sublicense, such Feedback in connection with Apple products
+// and services. Providing this Feedback is voluntary, but if you do provide Feedback to Apple, you
+// acknowledge and agree that Apple may exercise the license granted above without the payment of
+// royalties or further consideration to Participant.
+
+// The Apple Software is provided by Apple on an "AS IS" basis. APPLE MAKES NO WARRANTIES, EXPRESS OR
+// IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY
+// AND FITNESS FOR A PARTICULAR PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR
+// IN COMBINATION WITH YOUR PRODUCTS.
+//
+// IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION
+// AND/OR DISTRIBUTION OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+// (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// Copyright (C) 2015-2021 Apple Inc. All Rights Reserved.
+
+#ifndef HAP_PLATFORM_NFC_COEXISTENCE_H
+#define HAP_PLATFORM_NFC_COEXISTENCE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "HAPPlatform.h"
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull begin
+#endif
+
+/**@file
+ * Coexistence of the setup NFC tag emulation and the NFC access reader.
+ *
+ * The NFCT peripheral emulates the setup tag and the reader generates its own field in the same enclosure. While the
+ * reader field is on, the emulated tag sees it as well and a phone cannot read the setup tag. While a phone reads the
+ * setup tag, its field disturbs reader polls.
+ *
+ * The reader acquires the air before switching its field on and releases it after switching the field off. Field
+ * events of the emulated tag that occur while the reader holds the air are attributed to the reader. Any other field
+ * is an external reader, for example a phone reading the setup payload, and the reader defers its polls until that
+ * field is gone. The deferral is bounded, so a phone left on the setup tag never stalls access taps, and reader slots
+ * are short, so a phone reading the setup tag gets the air within one poll.
+ */
+
+/**
+ * Coexistence statistics.
+ */
+typedef struct {
+    /** Reader slots granted. */
+    uint32_t readerGrants;
+
+    /** Reader slots granted only after deferring to an external field. */
+    uint32_t readerDeferrals;
+
+    /** Reader slots forced after reaching the maximum deferral. */
+    uint32_t readerForcedGrants;
+
+    /** Longest wait for a reader slot in milliseconds. */
+    uint32_t readerMaxWaitMs;
+
+    /** Total wait for reader slots in milliseconds. */
+    uint32_t readerTotalWaitMs;
+
+    /** External fields detected by the emulated tag. */
+    uint32_t emulationFields;
+
+    /** External fields that arrived while the reader held the air. */
+    uint32_t emulationContended;
+
+    /** External fields in which the setup tag was read. */
+    uint32_t emulationReads;
+
+    /** Longest time from an external field to the first read of the setup tag in milliseconds. */
+    uint32_t emulationMaxReadLatencyMs;
+
+    /** Total time from external fields to the first read of the setup tag in milliseconds. */
+    uint32_t emulationTotalReadLatencyMs;
+} HAPPlatformNfcCoexistenceStats;
+
+/**
+ * Acquires the air for a reader poll. Blocks while an external field is present, at most for the maximum deferral.
+ *
+ * Must not be called from the run loop or from an interrupt.
+ *
+ * @return Time waited for the slot in milliseconds.
+ */
+HAPTime HAPPlatformNfcCoexistenceReaderAcquire(void);
+
+/**
+ * Releases the air after the reader field was switched off.
+ */
+void HAPPlatformNfcCoexistenceReaderRelease(void);
+
+/**
+ * Informs that the emulated tag detected a field. May be called from an interrupt.
+ */
+void HAPPlatformNfcCoexistenceEmulationFieldOn(void);
+
+/**
+ * Informs that the field detected by the emulated tag is gone. May be called from an interrupt.
+ */
+void HAPPlatformNfcCoexistenceEmulationFieldOff(void);
+
+/**
+ * Informs that the emulated tag was read. May be called from an interrupt.
+ */
+void HAPPlatformNfcCoexistenceEmulationDataRead(void);
+
+/**
+ * Gets the coexistence statistics.
+ *
+ * @param[out] stats                Statistics.
+ */
+void HAPPlatformNfcCoexistenceGetStats(HAPPlatformNfcCoexistenceStats* stats);
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull end
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
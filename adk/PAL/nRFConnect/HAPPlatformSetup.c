@@ -50,6 +50,10 @@
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(pal_platform_setup, CONFIG_PAL_PLATFORM_SETUP_LOG_LEVEL);
 
+#ifndef CONFIG_HAP_KVS_BUFFER_SIZE
+#define CONFIG_HAP_KVS_BUFFER_SIZE 4096
+#endif
+
 #include "HAP.h"
 #include "HAP+API.h"
 #include "HAPBase.h"
@@ -140,7 +144,7 @@ void HAPPlatformSetupDeinitBLE(void) {
 void HAPPlatformSetupInitKeyValueStore(HAPPlatformKeyValueStoreRef keyValueStoreRef) {
     // Create key-value store with platform specific options
     HAP_ALIGNAS(4)
-    static uint8_t keyValueStoreBytes[2048];
+    static uint8_t keyValueStoreBytes[CONFIG_HAP_KVS_BUFFER_SIZE];
 
     HAPPlatformKeyValueStoreCreate(
             keyValueStoreRef,
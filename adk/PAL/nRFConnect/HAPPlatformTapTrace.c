@@ -0,0 +1,358 @@
+// Disclaimer: IMPORTANT: This Apple software is supplied to you, by Apple Inc. ("Apple"), in your
+// capacity as a current, and in good standing, Licensee in the MFi Licensing Program. Use of this
+// Apple software is governed by and subject to the terms and conditions of your MFi License,
+// including, but not limited to, the restrictions specified in the provision entitled "Public
+// Software", and is further subject to your agreement to the following additional terms, and your
+// agreement that the use, installation, modification or redistribution of this Apple software
+// constitutes acceptance of these additional terms. If you do not agree with these additional terms,
+// you may not use, install, modify or redistribute this Apple software.
+//
+// Subject to all of these terms and in consideration of your agreement to abide by them, Apple grants
+// you, for as long as you are a current and in good-standing MFi Licensee, a personal, non-exclusive
+// license, under Apple's copyrights in this Apple software (the "Apple Software"), to use,
+// reproduce, and modify the Apple Software in source form, and to use, reproduce, modify, and
+// redistribute the Apple Software, with or without modifications, in binary form, in each of the
+// foregoing cases to the extent necessary to develop and/or manufacture "Proposed Products" and
+// "Licensed Products" in accordance with the terms of your MFi License. While you may not
+// redistribute the Apple Software in source form, should you redistribute the Apple Software in binary
+// form, you must retain this notice and the following text and disclaimers in all such redistributions
+// of the Apple Software. Neither the name, trademarks, service marks, or logos of Apple Inc. may be
+// used to endorse or promote products derived from the Apple Software without specific prior written
+// permission from Apple. Except as expressly stated in this notice, no other rights or licenses,
+// express or implied, are granted by Apple herein, including but not limited to any patent rights that
+// may be infringed by your derivative works or by other works in which the Apple Software may be
+// incorporated. Apple may terminate this license to the Apple Software by removing it from the list
+// of Licensed Technology in the MFi License, or otherwise in accordance with the terms of such MFi License.
+//
+// Unless you explicitly state otherwise, if you provide any ideas, suggestions, recommendations, bug
+// fixes or enhancements to Apple in connection with this software ("Feedback"), you hereby grant to
+// Apple a non-exclusive, fully paid-up, perpetual, irrevocable, worldwide license to make, use,
+// reproduce, incorporate, modify, display, perform, sell, make or have made derivative works of,
+// distribute (directly or indirectly) and sublicense, such Feedback in connection with Apple products
+// and services. Providing this Feedback is voluntary, but if you do provide Feedback to Apple, you
+// acknowledge and agree that Apple may exercise the license granted above without the payment of
+// royalties or further consideration to Participant.
+
+// The Apple Software is provided by Apple on an "AS IS" basis. APPLE MAKES NO WARRANTIES, EXPRESS OR
+// IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY
+// AND FITNESS FOR A PARTICULAR PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR
+// IN COMBINATION WITH YOUR PRODUCTS.
+//
+// IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION
+// AND/OR DISTRIBUTION OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+// (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// Copyright (C) 2015-2021 Apple Inc. All Rights Reserved.
+
+#include "HAPPlatformTapTrace.h"
+
+#if defined(CONFIG_HAP_TAP_TRACE)
+
+#include <stdarg.h>
+#include <zephyr/init.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/timing/timing.h>
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+
+struct shell;
+
+/**
+ * Number of log2 histogram buckets. The last bucket collects everything above 2^22 us.
+ */
+#define kNumBuckets ((size_t) 24)
+
+/**
+ * Events later than this after the field on of a tap are not attributed to the tap.
+ */
+#define kTapWindowUs ((uint32_t) 10 * 1000 * 1000)
+
+typedef struct {
+    uint32_t timestamp;
+    uint32_t duration;
+    uint16_t arg;
+    uint8_t event;
+    uint8_t tap;
+} TraceEntry;
+HAP_STATIC_ASSERT(sizeof(TraceEntry) == 12, TraceEntry);
+
+typedef struct {
+    uint32_t count;
+    uint16_t offset[kNumBuckets];
+    uint16_t duration[kNumBuckets];
+} EventHistogram;
+
+static const char* const eventNames[] = {
+    [kHAPPlatformTapTraceEvent_FieldOn] = "field-on",
+    [kHAPPlatformTapTraceEvent_CardSelect] = "card-select",
+    [kHAPPlatformTapTraceEvent_Apdu] = "apdu",
+    [kHAPPlatformTapTraceEvent_CryptoVerify] = "crypto-verify",
+    [kHAPPlatformTapTraceEvent_KeyValueStoreGet] = "kvs-get",
+    [kHAPPlatformTapTraceEvent_KeyValueStoreSet] = "kvs-set",
+    [kHAPPlatformTapTraceEvent_KeyValueStoreRemove] = "kvs-remove",
+    [kHAPPlatformTapTraceEvent_LockStateChangeByNfc] = "lock-state-change-by-nfc",
+    [kHAPPlatformTapTraceEvent_LockTargetState] = "lock-target-state",
+    [kHAPPlatformTapTraceEvent_LockCurrentState] = "lock-current-state",
+};
+HAP_STATIC_ASSERT(HAPArrayCount(eventNames) == kHAPPlatformTapTraceEvent_Count, eventNames);
+
+static struct {
+    TraceEntry entries[CONFIG_HAP_TAP_TRACE_ENTRIES];
+    size_t head;
+    size_t numEntries;
+    EventHistogram histograms[kHAPPlatformTapTraceEvent_Count];
+    uint32_t tapStart;
+    uint8_t tap;
+    bool tapOpen;
+    struct k_spinlock lock;
+} trace;
+
+static uint32_t CyclesToMicroseconds(uint32_t cycles) {
+    return (uint32_t)(timing_cycles_to_ns(cycles) / 1000);
+}
+
+static size_t BucketIndex(uint32_t us) {
+    size_t index = us ? (size_t)(32 - __builtin_clz(us)) : 0;
+    return index < kNumBuckets ? index : kNumBuckets - 1;
+}
+
+/**
+ * Upper bound of a bucket in microseconds.
+ */
+static uint32_t BucketLimit(size_t index) {
+    return index ? (uint32_t) 1 << index : 1;
+}
+
+static void BucketAdd(uint16_t* buckets, uint32_t us) {
+    size_t index = BucketIndex(us);
+    if (buckets[index] != UINT16_MAX) {
+        buckets[index]++;
+    }
+}
+
+/**
+ * Appends an entry and updates the histograms. Must be called with the lock held.
+ */
+static void Append(HAPPlatformTapTraceEvent event, uint16_t arg, uint32_t timestamp, uint32_t duration) {
+    TraceEntry* entry = &trace.entries[trace.head];
+    entry->timestamp = timestamp;
+    entry->duration = duration;
+    entry->arg = arg;
+    entry->event = event;
+    entry->tap = trace.tap;
+
+    trace.head = (trace.head + 1) % HAPArrayCount(trace.entries);
+    if (trace.numEntries < HAPArrayCount(trace.entries)) {
+        trace.numEntries++;
+    }
+
+    EventHistogram* histogram = &trace.histograms[event];
+    histogram->count++;
+    if (duration) {
+        BucketAdd(histogram->duration, CyclesToMicroseconds(duration));
+    }
+    if (trace.tapOpen) {
+        uint32_t offset = CyclesToMicroseconds(timestamp + duration - trace.tapStart);
+        if (offset <= kTapWindowUs) {
+            BucketAdd(histogram->offset, offset);
+        } else {
+            trace.tapOpen = false;
+        }
+    }
+}
+
+HAPPlatformTapTraceStamp HAPPlatformTapTraceBegin(void) {
+    return (HAPPlatformTapTraceStamp) timing_counter_get();
+}
+
+void HAPPlatformTapTraceStart(HAPPlatformTapTraceStamp stamp) {
+    k_spinlock_key_t key = k_spin_lock(&trace.lock);
+    trace.tap++;
+    trace.tapStart = stamp;
+    trace.tapOpen = true;
+    Append(kHAPPlatformTapTraceEvent_FieldOn, 0, stamp, 0);
+    k_spin_unlock(&trace.lock, key);
+}
+
+void HAPPlatformTapTraceRecord(HAPPlatformTapTraceEvent event, uint16_t arg) {
+    HAPPrecondition(event < kHAPPlatformTapTraceEvent_Count);
+
+    uint32_t now = (uint32_t) timing_counter_get();
+
+    k_spinlock_key_t key = k_spin_lock(&trace.lock);
+    Append(event, arg, now, 0);
+    k_spin_unlock(&trace.lock, key);
+}
+
+void HAPPlatformTapTraceEnd(HAPPlatformTapTraceEvent event, uint16_t arg, HAPPlatformTapTraceStamp stamp) {
+    HAPPrecondition(event < kHAPPlatformTapTraceEvent_Count);
+
+    uint32_t now = (uint32_t) timing_counter_get();
+
+    k_spinlock_key_t key = k_spin_lock(&trace.lock);
+    // Zero duration marks point events, a span is at least one cycle.
+    Append(event, arg, stamp, HAPMax(now - stamp, 1u));
+    k_spin_unlock(&trace.lock, key);
+}
+
+HAP_PRINTFLIKE(2, 3)
+static void Print(const struct shell* _Nullable shell, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    (void) shell;
+#if defined(CONFIG_SHELL)
+    if (shell) {
+        shell_vfprintf(shell, SHELL_NORMAL, format, args);
+        va_end(args);
+        return;
+    }
+#endif
+    vprintk(format, args);
+    va_end(args);
+}
+
+static void DumpEntries(const struct shell* _Nullable shell) {
+    static TraceEntry entries[CONFIG_HAP_TAP_TRACE_ENTRIES];
+
+    // Snapshot under the lock, print without it.
+    k_spinlock_key_t key = k_spin_lock(&trace.lock);
+    size_t numEntries = trace.numEntries;
+    size_t first = (trace.head + HAPArrayCount(trace.entries) - numEntries) % HAPArrayCount(trace.entries);
+    for (size_t i = 0; i < numEntries; i++) {
+        entries[i] = trace.entries[(first + i) % HAPArrayCount(trace.entries)];
+    }
+    k_spin_unlock(&trace.lock, key);
+
+    Print(shell, "%4s %10s %10s  %-26s %s\n", "tap", "+us", "span us", "event", "arg");
+
+    uint32_t tapStart = 0;
+    bool tapKnown = false;
+    for (size_t i = 0; i < numEntries; i++) {
+        const TraceEntry* entry = &entries[i];
+        if (entry->event == kHAPPlatformTapTraceEvent_FieldOn) {
+            tapStart = entry->timestamp;
+            tapKnown = true;
+        }
+        Print(shell,
+              "%4u %10u %10u  %-26s 0x%04x\n",
+              entry->tap,
+              tapKnown ? CyclesToMicroseconds(entry->timestamp - tapStart) : 0,
+              entry->duration ? CyclesToMicroseconds(entry->duration) : 0,
+              eventNames[entry->event],
+              entry->arg);
+    }
+}
+
+/**
+ * Estimates a percentile as the upper bound of the bucket that contains it.
+ */
+static uint32_t Percentile(const uint16_t* buckets, uint32_t percent) {
+    uint32_t total = 0;
+    for (size_t i = 0; i < kNumBuckets; i++) {
+        total += buckets[i];
+    }
+    if (!total) {
+        return 0;
+    }
+
+    uint32_t rank = (total * percent + 99) / 100;
+    uint32_t seen = 0;
+    for (size_t i = 0; i < kNumBuckets; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return BucketLimit(i);
+        }
+    }
+    return BucketLimit(kNumBuckets - 1);
+}
+
+static void PrintSummary(const struct shell* _Nullable shell) {
+    static EventHistogram histograms[kHAPPlatformTapTraceEvent_Count];
+
+    k_spinlock_key_t key = k_spin_lock(&trace.lock);
+    HAPRawBufferCopyBytes(histograms, trace.histograms, sizeof histograms);
+    k_spin_unlock(&trace.lock, key);
+
+    Print(shell,
+          "%-26s %6s | %-27s | %-27s\n",
+          "event (us, <= bucket)",
+          "count",
+          "offset from field on p50/p90/p99",
+          "span p50/p90/p99");
+    for (size_t i = 0; i < HAPArrayCount(histograms); i++) {
+        const EventHistogram* histogram = &histograms[i];
+        if (!histogram->count) {
+            continue;
+        }
+        Print(shell,
+              "%-26s %6u | %8u %8u %8u | %8u %8u %8u\n",
+              eventNames[i],
+              histogram->count,
+              Percentile(histogram->offset, 50),
+              Percentile(histogram->offset, 90),
+              Percentile(histogram->offset, 99),
+              Percentile(histogram->duration, 50),
+              Percentile(histogram->duration, 90),
+              Percentile(histogram->duration, 99));
+    }
+}
+
+void HAPPlatformTapTraceDump(void) {
+    DumpEntries(NULL);
+}
+
+void HAPPlatformTapTraceSummary(void) {
+    PrintSummary(NULL);
+}
+
+void HAPPlatformTapTraceClear(void) {
+    k_spinlock_key_t key = k_spin_lock(&trace.lock);
+    trace.head = 0;
+    trace.numEntries = 0;
+    trace.tapOpen = false;
+    HAPRawBufferZero(trace.histograms, sizeof trace.histograms);
+    k_spin_unlock(&trace.lock, key);
+}
+
+static int TapTraceInit(void) {
+    timing_init();
+    timing_start();
+    return 0;
+}
+
+SYS_INIT(TapTraceInit, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
+
+#if defined(CONFIG_SHELL)
+
+static int CommandDump(const struct shell* shell, size_t argc HAP_UNUSED, char** argv HAP_UNUSED) {
+    DumpEntries(shell);
+    return 0;
+}
+
+static int CommandSummary(const struct shell* shell, size_t argc HAP_UNUSED, char** argv HAP_UNUSED) {
+    PrintSummary(shell);
+    return 0;
+}
+
+static int CommandClear(const struct shell* shell HAP_UNUSED, size_t argc HAP_UNUSED, char** argv HAP_UNUSED) {
+    HAPPlatformTapTraceClear();
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+        tapTraceCommands,
+        SHELL_CMD(dump, NULL, "Print the trace ring", CommandDump),
+        SHELL_CMD(summary, NULL, "Print percentiles of all events", CommandSummary),
+        SHELL_CMD(clear, NULL, "Clear the trace ring and the histograms", CommandClear),
+        SHELL_SUBCMD_SET_END);
+
+SHELL_CMD_REGISTER(taptrace, &tapTraceCommands, "NFC tap latency trace", NULL);
+
+#endif // CONFIG_SHELL
+
+#endif // CONFIG_HAP_TAP_TRACE
@@ -0,0 +1,213 @@
+// Disclaimer: IMPORTANT: This Apple software is supplied to you, by Apple Inc. ("Apple"), in your
+// capacity as a current, and in good standing, Licensee in the MFi Licensing Program. Use of this
+// Apple software is governed by and subject to the terms and conditions of your MFi License,
+// including, but not limited to, the restrictions specified in the provision entitled "Public
+// Software", and is further subject to your agreement to the following additional terms, and your
+// agreement that the use, installation, modification or redistribution of this Apple software
+// constitutes acceptance of these additional terms. If you do not agree with these additional terms,
+// you may not use, install, modify or redistribute this Apple software.
+//
+// Subject to all of these terms and in consideration of your agreement to abide by them, Apple grants
+// you, for as long as you are a current and in good-standing MFi Licensee, a personal, non-exclusive
+// license, under Apple's copyrights in this Apple software (the "Apple Software"), to use,
+// reproduce, and modify the Apple Software in source form, and to use, reproduce, modify, and
+// redistribute the Apple Software, with or without modifications, in binary form, in each of the
+// foregoing cases to the extent necessary to develop and/or manufacture "Proposed Products" and
+// "Licensed Products" in accordance with the terms of your MFi License. While you may not
+// redistribute the Apple Software in source form, should you redistribute the Apple Software in binary
+// form, you must retain this notice and the following text and disclaimers in all such redistributions
+// of the Apple Software. Neither the name, trademarks, service marks, or logos of Apple Inc. may be
+// used to endorse or promote products derived from the Apple Software without specific prior written
+// permission from Apple. Except as expressly stated in this notice, no other rights or licenses,
+// express or implied, are granted by Apple herein, including but not limited to any patent rights that
+// may be infringed by your derivative works or by other works in which the Apple Software may be
+// incorporated. Apple may terminate this license to the Apple Software by removing it from the list
+// of Licensed Technology in the MFi License, or otherwise in accordance with the terms of such MFi License.
+//
+// Unless you explicitly state otherwise, if you provide any ideas, suggestions, recommendations, bug
+// fixes or enhancements to Apple in connection with this software ("Feedback"), you hereby grant to
+// Apple a non-exclusive, fully paid-up, perpetual, irrevocable, worldwide license to make, use,
+// reproduce, incorporate, modify, display, perform, sell, make or have made derivative works of,
+// distribute (directly or indirectly) and sublicense, such Feedback in connection with Apple products
+// and services. Providing this Feedback is voluntary, but if you do provide Feedback to Apple, you
+// acknowledge and agree that Apple may exercise the license granted above without the payment of
+// royalties or further consideration to Participant.
+
+// The Apple Software is provided by Apple on an "AS IS" basis. APPLE MAKES NO WARRANTIES, EXPRESS OR
+// IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY
+// AND FITNESS FOR A PARTICULAR PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR
+// IN COMBINATION WITH YOUR PRODUCTS.
+//
+// IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION
+// AND/OR DISTRIBUTION OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+// (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// Copyright (C) 2015-2021 Apple Inc. All Rights Reserved.
+
+#ifndef HAP_PLATFORM_TAP_TRACE_H
+#define HAP_PLATFORM_TAP_TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "HAPPlatform.h"
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull begin
+#endif
+
+/**@file
+ * NFC tap latency trace.
+ *
+ * A fixed-size ring of timestamped events recorded along the path of an NFC tap, from switching the reader field
+ * on to the lock mechanism moving. Timestamps are taken from the hardware cycle counter. Every event also feeds
+ * a log2 histogram of its offset from the start of the tap, and span events a histogram of their duration, so the
+ * trace can be summarized as percentiles after many taps.
+ *
+ * The trace is compiled in with CONFIG_HAP_TAP_TRACE. Otherwise all functions are empty. With CONFIG_SHELL the
+ * trace is dumped with the "taptrace" shell command.
+ *
+ * **Example**
+
+   @code{.c}
+
+   HAPPlatformTapTraceStamp stamp = HAPPlatformTapTraceBegin();
+   err = KeyValueStoreGet(...);
+   HAPPlatformTapTraceEnd(kHAPPlatformTapTraceEvent_KeyValueStoreGet, (uint16_t)(domain << 8 | key), stamp);
+
+   @endcode
+*/
+
+/**
+ * Traced event.
+ */
+HAP_ENUM_BEGIN(uint8_t, HAPPlatformTapTraceEvent) {
+    /** The reader field was switched on for the poll that found the card. Opens a tap. */
+    kHAPPlatformTapTraceEvent_FieldOn,
+
+    /** Card selected. Span from field on, argument is SAK. */
+    kHAPPlatformTapTraceEvent_CardSelect,
+
+    /** APDU exchange. Span, argument is CLA and INS. */
+    kHAPPlatformTapTraceEvent_Apdu,
+
+    /** Cryptographic verification of the credential. Span. */
+    kHAPPlatformTapTraceEvent_CryptoVerify,
+
+    /** Key-value store read. Span, argument is domain and key. */
+    kHAPPlatformTapTraceEvent_KeyValueStoreGet,
+
+    /** Key-value store write. Span, argument is domain and key. */
+    kHAPPlatformTapTraceEvent_KeyValueStoreSet,
+
+    /** Key-value store removal. Span, argument is domain and key. */
+    kHAPPlatformTapTraceEvent_KeyValueStoreRemove,
+
+    /** HandleLockStateChangeByNfc entered, argument is the requested lock state. */
+    kHAPPlatformTapTraceEvent_LockStateChangeByNfc,
+
+    /** Lock mechanism moved by SetLockTargetState. Span, argument is the target state. */
+    kHAPPlatformTapTraceEvent_LockTargetState,
+
+    /** The current lock state was applied, argument is the current state. */
+    kHAPPlatformTapTraceEvent_LockCurrentState,
+
+    /** Number of events. */
+    kHAPPlatformTapTraceEvent_Count
+} HAP_ENUM_END(uint8_t, HAPPlatformTapTraceEvent);
+
+/**
+ * Cycle counter value marking the beginning of a span.
+ */
+typedef uint32_t HAPPlatformTapTraceStamp;
+
+#if defined(CONFIG_HAP_TAP_TRACE)
+
+/**
+ * Gets the current cycle counter value.
+ *
+ * @return Stamp to pass to HAPPlatformTapTraceEnd or HAPPlatformTapTraceStart.
+ */
+HAPPlatformTapTraceStamp HAPPlatformTapTraceBegin(void);
+
+/**
+ * Opens a new tap. Records kHAPPlatformTapTraceEvent_FieldOn at the given stamp.
+ *
+ * @param      stamp                Cycle counter value when the field was switched on.
+ */
+void HAPPlatformTapTraceStart(HAPPlatformTapTraceStamp stamp);
+
+/**
+ * Records a point event.
+ *
+ * @param      event                Event.
+ * @param      arg                  Event argument.
+ */
+void HAPPlatformTapTraceRecord(HAPPlatformTapTraceEvent event, uint16_t arg);
+
+/**
+ * Records a span event that started at the given stamp and ends now.
+ *
+ * @param      event                Event.
+ * @param      arg                  Event argument.
+ * @param      stamp                Value returned by HAPPlatformTapTraceBegin.
+ */
+void HAPPlatformTapTraceEnd(HAPPlatformTapTraceEvent event, uint16_t arg, HAPPlatformTapTraceStamp stamp);
+
+/**
+ * Prints the trace ring to the console.
+ */
+void HAPPlatformTapTraceDump(void);
+
+/**
+ * Prints the percentile summary of all events to the console.
+ */
+void HAPPlatformTapTraceSummary(void);
+
+/**
+ * Clears the trace ring and the histograms.
+ */
+void HAPPlatformTapTraceClear(void);
+
+#else
+
+static inline HAPPlatformTapTraceStamp HAPPlatformTapTraceBegin(void) {
+    return 0;
+}
+
+static inline void HAPPlatformTapTraceStart(HAPPlatformTapTraceStamp stamp HAP_UNUSED) {
+}
+
+static inline void HAPPlatformTapTraceRecord(HAPPlatformTapTraceEvent event HAP_UNUSED, uint16_t arg HAP_UNUSED) {
+}
+
+static inline void HAPPlatformTapTraceEnd(
+        HAPPlatformTapTraceEvent event HAP_UNUSED,
+        uint16_t arg HAP_UNUSED,
+        HAPPlatformTapTraceStamp stamp HAP_UNUSED) {
+}
+
+static inline void HAPPlatformTapTraceDump(void) {
+}
+
+static inline void HAPPlatformTapTraceSummary(void) {
+}
+
+static inline void HAPPlatformTapTraceClear(void) {
+}
+
+#endif
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull end
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
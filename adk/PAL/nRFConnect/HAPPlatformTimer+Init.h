@@ -0,0 +1,142 @@
+// Disclaimer: IMPORTANT: This Apple software is supplied to you, by Apple Inc. ("Apple"), in your
+// capacity as a current, and in good standing, Licensee in the MFi Licensing Program. Use of this
+// Apple software is governed by and subject to the terms and conditions of your MFi License,
+// including, but not limited to, the restrictions specified in the provision entitled "Public
+// Software", and is further subject to your agreement to the following additional terms, and your
+// agreement that the use, installation, modification or redistribution of this Apple software
+// constitutes acceptance of these additional terms. If you do not agree with these additional terms,
+// you may not use, install, modify or redistribute this Apple software.
+//
+// Subject to all of these terms and in consideration of your agreement to abide by them, Apple grants
+// you, for as long as you are a current and in good-standing MFi Licensee, a personal, non-exclusive
+// license, under Apple's copyrights in this Apple software (the "Apple Software"), to use,
+// reproduce, and modify the Apple Software in source form, and to use, reproduce, modify, and
+// redistribute the Apple Software, with or without modifications, in binary form, in each of the
+// foregoing cases to the extent necessary to develop and/or manufacture "Proposed Products" and
+// "Licensed Products" in accordance with the terms of your MFi License. While you may not
+// redistribute the Apple Software in source form, should you redistribute the Apple Software in binary
+// form, you must retain this notice and the following text and disclaimers in all such redistributions
+// of the Apple Software. Neither the name, trademarks, service marks, or logos of Apple Inc. may be
+// used to endorse or promote products derived from the Apple Software without specific prior written
+// permission from Apple. Except as expressly stated in this notice, no other rights or licenses,
+// express or implied, are granted by Apple herein, including but not limited to any patent rights that
+// may be infringed by your derivative works or by other works in which the Apple Software may be
+// incorporated. Apple may terminate this license to the Apple Software by removing it from the list
+// of Licensed Technology in the MFi License, or otherwise in accordance with the terms of such MFi License.
+//
+// Unless you explicitly state otherwise, if you provide any ideas, suggestions, recommendations, bug
+// fixes or enhancements to Apple in connection with this software ("Feedback"), you hereby grant to
+// Apple a non-exclusive, fully paid-up, perpetual, irrevocable, worldwide license to make, use,
+// reproduce, incorporate, modify, display, perform, sell, make or have made derivative works of,
+// distribute (directly or indirectly) and sublicense, such Feedback in connection with Apple products
+// and services. Providing this Feedback is voluntary, but if you do provide Feedback to Apple, you
+// acknowledge and agree that Apple may exercise the license granted above without the payment of
+// royalties or further consideration to Participant.
+
+// The Apple Software is provided by Apple on an "AS IS" basis. APPLE MAKES NO WARRANTIES, EXPRESS OR
+// IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY
+// AND FITNESS FOR A PARTICULAR PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR
+// IN COMBINATION WITH YOUR PRODUCTS.
+//
+// IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION
+// AND/OR DISTRIBUTION OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+// (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// Copyright (C) 2015-2021 Apple Inc. All Rights Reserved.
+
+#ifndef HAP_PLATFORM_TIMER_INIT_H
+#define HAP_PLATFORM_TIMER_INIT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "HAPPlatform.h"
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull begin
+#endif
+
+/**
+ * Usage of the platform timers.
+ */
+typedef struct {
+    /** Number of statically allocated timers, CONFIG_HAP_PLATFORM_TIMER_COUNT. */
+    uint32_t capacity;
+
+    /** Number of timers allocated from the heap after the static ones ran out. 0 until then. */
+    uint32_t overflowCapacity;
+
+    /** Number of registered timers. */
+    uint32_t numUsed;
+
+    /** Largest number of timers registered at the same time. */
+    uint32_t maxNumUsed;
+
+    /** Number of registrations that failed with kHAPError_OutOfResources. */
+    uint32_t numFailed;
+
+    /**
+     * Number of expirations of the kernel timer that runs the platform timers. Immediate timers do not start it.
+     * This bounds the SoC wakeups caused by platform timers, but is not a count of SoC wakeups: the SoC may already be
+     * awake when the kernel timer expires, and wakes up for other reasons as well.
+     */
+    uint32_t numKernelTimerExpirations;
+
+    /** Number of timer callbacks run. */
+    uint32_t numExpired;
+
+    /** Time numKernelTimerExpirations and numExpired were counted over, since start up or the last reset. */
+    HAPTime countingDuration;
+} HAPPlatformTimerStats;
+
+/**
+ * Registers a timer that may expire up to @p slack after its deadline.
+ *
+ * Timers due within the slack of each other expire together on one kernel timer expiration, as late as the slack of
+ * all of them allows. A timer never expires before its deadline. `HAPPlatformTimerRegister` uses a slack of
+ * CONFIG_HAP_PLATFORM_TIMER_SLACK_MS, which is 0 by default, as it also applies to the protocol timeouts of HAP.
+ * Timers of the application that tolerate a late expiry should be registered with their own slack instead.
+ *
+ * @param[out] timer                Non-zero Timer object, if successful.
+ * @param      deadline             Deadline after which the timer expires.
+ * @param      slack                Time the expiry may be delayed by. Rounded down to milliseconds.
+ * @param      callback             Function to call when the timer expires.
+ * @param      context              Context that is passed to the callback.
+ *
+ * @return kHAPError_None           If successful.
+ * @return kHAPError_OutOfResources If no more timers can be allocated.
+ */
+HAP_RESULT_USE_CHECK
+HAPError HAPPlatformTimerRegisterWithSlack(
+        HAPPlatformTimerRef* timer,
+        HAPTime deadline,
+        HAPTime slack,
+        HAPPlatformTimerCallback callback,
+        void* _Nullable context);
+
+/**
+ * Gets the usage of the platform timers.
+ *
+ * @param[out] stats                Usage.
+ */
+void HAPPlatformTimerGetStats(HAPPlatformTimerStats* stats);
+
+/**
+ * Restarts counting kernel timer expirations and expired timers, for example once commissioning is done, so that a
+ * measurement only covers the steady state.
+ */
+void HAPPlatformTimerResetExpirationStats(void);
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull end
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
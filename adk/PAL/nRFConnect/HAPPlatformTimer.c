@@ -51,13 +51,45 @@
 #include <stdint.h>
 #include <string.h>
 #include "HAPPlatform.h"
+#include "HAPPlatformTimer+Init.h"
 #include <zephyr/logging/log.h>
-#include <zephyr/sys/slist.h>
+
+#if defined(CONFIG_HAP_PLATFORM_TIMER_WORKQ)
+#include <zephyr/init.h>
+#endif
+
+#if defined(CONFIG_SHELL)
+#include <stdlib.h>
+#include <zephyr/shell/shell.h>
+#endif
 
 LOG_MODULE_REGISTER(pal_timer, CONFIG_PAL_TIMER_LOG_LEVEL);
 
-#define kTimerStorage_MaxTimers ((size_t) 32)
+#ifndef CONFIG_HAP_PLATFORM_TIMER_COUNT
+#define CONFIG_HAP_PLATFORM_TIMER_COUNT 32
+#endif
+
+#ifndef CONFIG_HAP_PLATFORM_TIMER_OVERFLOW_COUNT
+#define CONFIG_HAP_PLATFORM_TIMER_OVERFLOW_COUNT 0
+#endif
+
+#ifndef CONFIG_HAP_PLATFORM_TIMER_SLACK_MS
+#define CONFIG_HAP_PLATFORM_TIMER_SLACK_MS 0
+#endif
+
+#ifndef CONFIG_HAP_PLATFORM_TIMER_WORKQ_STACK_SIZE
+#define CONFIG_HAP_PLATFORM_TIMER_WORKQ_STACK_SIZE 4096
+#endif
+
+#ifndef CONFIG_HAP_PLATFORM_TIMER_WORKQ_PRIORITY
+#define CONFIG_HAP_PLATFORM_TIMER_WORKQ_PRIORITY -1
+#endif
+
+#define kTimerStorage_NumStaticTimers   ((size_t) CONFIG_HAP_PLATFORM_TIMER_COUNT)
+#define kTimerStorage_NumOverflowTimers ((size_t) CONFIG_HAP_PLATFORM_TIMER_OVERFLOW_COUNT)
+#define kTimerStorage_MaxTimers         (kTimerStorage_NumStaticTimers + kTimerStorage_NumOverflowTimers)
 #define TIMER_NOT_USED          0x0
+#define TIMER_EXPIRED           SIZE_MAX // heap_index of a timer taken from the heap by WorkHandler, not yet run.
 
 // TODO This is needed for Nordic DFU, so enable it when DFU is needed.
 //      When new uses will be found, move to KConfig
@@ -76,33 +108,78 @@ typedef struct {
 } HAPPlatformTimer;
 
 struct PAL_timer {
-    sys_snode_t node;
     HAPPlatformTimerRef timer_id; // if not used TIMER_NOT_USED is set.
+    struct PAL_timer* _Nullable next_free; // next timer of the free list while not used.
     HAPPlatformTimer HAPTimer;
     HAPTime deadline;
+    uint32_t sequence;   // registration order, breaks ties between equal deadlines.
+    size_t heap_index;   // position in timer_heap while registered.
+    uint32_t slack;      // milliseconds the timer may run after its deadline, to share a wakeup with other timers.
 };
 
 static void Initialize(void);
 static void ClearTimer(struct PAL_timer* tim);
+static void SlabReset(void);
+static void SlabFree(struct PAL_timer* tim);
 static void RescheduleTimer(void);
-static struct PAL_timer* PlaceInRepo(HAPPlatformTimerCallback callback, void* _Nullable context, HAPTime deadline);
+static struct PAL_timer* PlaceInRepo(
+        HAPPlatformTimerCallback callback,
+        void* _Nullable context,
+        HAPTime deadline,
+        HAPTime slack);
 static bool GetNextTimerDeadline(HAPTime* next_deadline);
+static HAPTime LatestDeadline(const struct PAL_timer* tim);
+static void CoalesceWakeup(size_t index, HAPTime* wakeup);
+static void HeapInsert(struct PAL_timer* tim);
+static void HeapRemove(struct PAL_timer* tim);
+static bool HeapContains(const struct PAL_timer* tim);
+static bool IsExpired(const struct PAL_timer* tim);
 
 static void WorkHandler(struct k_work* work);
+static void SubmitWork(void);
 static void TimerHandlerISR(struct k_timer* dummy);
 
 K_TIMER_DEFINE(kernel_isr_timer, TimerHandlerISR, NULL);
 K_MUTEX_DEFINE(timer_repo_mutex);
 static struct k_work work;
 
-static sys_slist_t submitted_timers;
-static struct PAL_timer timer_repo[kTimerStorage_MaxTimers]; // 24B * 32 = 768B
+#if defined(CONFIG_HAP_PLATFORM_TIMER_WORKQ)
+/**
+ * Work queue of the timer callbacks, so that they do not wait behind Bluetooth host and DFU work on the system work
+ * queue.
+ */
+K_THREAD_STACK_DEFINE(timer_workq_stack, CONFIG_HAP_PLATFORM_TIMER_WORKQ_STACK_SIZE);
+static struct k_work_q timer_workq;
+#endif
 
-#if CONFIG_LOG
-static void PrintStats();
-#else
-inline static void PrintStats() { /*NOOP*/ };
+/**
+ * Timer slab. Unused timers are linked in a free list, so a timer is allocated and freed in O(1). When all timers of
+ * the static slab are in use, an overflow slab of CONFIG_HAP_PLATFORM_TIMER_OVERFLOW_COUNT timers is allocated from the
+ * heap once, and kept.
+ */
+static struct PAL_timer timer_repo[kTimerStorage_NumStaticTimers]; // 40B per timer
+#if CONFIG_HAP_PLATFORM_TIMER_OVERFLOW_COUNT > 0
+static struct PAL_timer* _Nullable overflow_repo;
 #endif
+static struct PAL_timer* _Nullable free_timers;
+static HAPPlatformTimerStats timer_stats = { .capacity = kTimerStorage_NumStaticTimers };
+
+/**
+ * Registered timers as a binary min-heap ordered by deadline, then by registration order. The earliest timer is at the
+ * root, so the next deadline is read in O(1), and a timer is inserted or removed in O(log n).
+ */
+static struct PAL_timer* timer_heap[kTimerStorage_MaxTimers];
+static size_t timer_heap_size;
+static uint32_t timer_sequence;
+
+/** Number of expirations of kernel_isr_timer, counted in the ISR. */
+static atomic_t kernel_timer_expirations;
+
+/** Time the expiration counters were last reset. */
+static HAPTime expiration_stats_reset_time;
+
+/** Expired timers collected by one WorkHandler pass, in deadline order. */
+static struct PAL_timer* expired_timers[kTimerStorage_MaxTimers];
 
 #if TIMER_BLACKLIST
 /**
@@ -133,11 +210,22 @@ HAPError HAPPlatformTimerRegister(
         HAPTime deadline,
         HAPPlatformTimerCallback callback,
         void* _Nullable context) {
+    return HAPPlatformTimerRegisterWithSlack(
+            timer, deadline, CONFIG_HAP_PLATFORM_TIMER_SLACK_MS * HAPMillisecond, callback, context);
+}
+
+HAP_RESULT_USE_CHECK
+HAPError HAPPlatformTimerRegisterWithSlack(
+        HAPPlatformTimerRef* timer,
+        HAPTime deadline,
+        HAPTime slack,
+        HAPPlatformTimerCallback callback,
+        void* _Nullable context) {
     HAPPrecondition(timer);
     HAPPrecondition(callback);
     Initialize();
     k_mutex_lock(&timer_repo_mutex, K_FOREVER);
-    struct PAL_timer* timer_or_null = PlaceInRepo(callback, context, deadline);
+    struct PAL_timer* timer_or_null = PlaceInRepo(callback, context, deadline, slack);
 
 #if TIMER_BLACKLIST
     if (NordicUpdate_timer_should_be_blocked(timer))
@@ -151,7 +239,7 @@ HAPError HAPPlatformTimerRegister(
     }
 
     *timer = (HAPPlatformTimerRef) timer_or_null;
-    sys_slist_append(&submitted_timers, &timer_or_null->node);
+    HeapInsert(timer_or_null);
 
     LOG_DBG("timer = 0x%lx callback = %p, expires at timestamp %02llu:%02llu:%02llu.%03llu",
             (long unsigned int) *timer,
@@ -167,12 +255,11 @@ HAPError HAPPlatformTimerRegister(
         k_timer_stop(&kernel_isr_timer); // work handler will reshcedule after executing the callback, prevent running
                                          // twice if other timer expires in near future
         k_mutex_unlock(&timer_repo_mutex);
-        k_work_submit(&work);
+        SubmitWork();
         return kHAPError_None;
     }
 
     RescheduleTimer();
-    PrintStats();
     k_mutex_unlock(&timer_repo_mutex);
     return kHAPError_None;
 }
@@ -185,9 +272,13 @@ void HAPPlatformTimerDeregister(HAPPlatformTimerRef timer) {
     LOG_DBG("timer = 0x%lx", (long unsigned int) timer);
 
     struct PAL_timer* timer_handle = (struct PAL_timer*) timer;
-    bool removed = sys_slist_find_and_remove(&submitted_timers, &timer_handle->node);
+    bool removed = HeapContains(timer_handle) || IsExpired(timer_handle);
     if (removed) {
-        ClearTimer(timer_handle);
+        if (!IsExpired(timer_handle)) {
+            HeapRemove(timer_handle);
+        }
+        // An expired timer that did not run yet is skipped by WorkHandler once freed.
+        SlabFree(timer_handle);
     } else {
         LOG_ERR("Can not find timer in execution queue");
     }
@@ -209,10 +300,8 @@ static void Initialize(void) {
     k_mutex_lock(&timer_repo_mutex, K_FOREVER);
     if (!initialized) {
         initialized = true;
-        for (size_t i = 0; i < kTimerStorage_MaxTimers; ++i) {
-            ClearTimer(&timer_repo[i]);
-        }
-        sys_slist_init(&submitted_timers);
+        SlabReset();
+        timer_heap_size = 0;
         k_work_init(&work, WorkHandler);
     }
     k_mutex_unlock(&timer_repo_mutex);
@@ -221,10 +310,8 @@ static void Initialize(void) {
 void HAPPlatformDeregisterAllADKTimers(void) {
     k_mutex_lock(&timer_repo_mutex, K_FOREVER);
     initialized = false;
-    for (size_t i = 0; i < kTimerStorage_MaxTimers; ++i) {
-        ClearTimer(&timer_repo[i]);
-    }
-    sys_slist_init(&submitted_timers); // clear list of timers
+    SlabReset();
+    timer_heap_size = 0; // clear heap of timers
     k_work_init(&work, WorkHandler);
 
     k_mutex_unlock(&timer_repo_mutex);
@@ -241,6 +328,86 @@ static void ClearTimer(struct PAL_timer* tim) {
     tim->deadline = TIMER_NOT_USED;
 }
 
+/**
+ * @brief Clear timer and put it on the free list.
+ *
+ * @param tim timer to push.
+ */
+static void SlabPush(struct PAL_timer* tim) {
+    ClearTimer(tim);
+    tim->next_free = free_timers;
+    free_timers = tim;
+}
+
+/**
+ * @brief Free all timers of the slabs. Must be called with timer_repo_mutex held.
+ *
+ */
+static void SlabReset(void) {
+    free_timers = NULL;
+    // pushed in reverse, so the timers are allocated in the order of the repo.
+#if CONFIG_HAP_PLATFORM_TIMER_OVERFLOW_COUNT > 0
+    if (overflow_repo) {
+        for (size_t i = kTimerStorage_NumOverflowTimers; i-- > 0;) {
+            SlabPush(&overflow_repo[i]);
+        }
+    }
+#endif
+    for (size_t i = kTimerStorage_NumStaticTimers; i-- > 0;) {
+        SlabPush(&timer_repo[i]);
+    }
+    timer_stats.numUsed = 0;
+}
+
+/**
+ * @brief Take a timer from the free list. Must be called with timer_repo_mutex held.
+ *
+ * @return struct PAL_timer* timer, or NULL if all timers are in use.
+ */
+static struct PAL_timer* _Nullable SlabAlloc(void) {
+#if CONFIG_HAP_PLATFORM_TIMER_OVERFLOW_COUNT > 0
+    if (free_timers == NULL && overflow_repo == NULL) {
+        overflow_repo = k_malloc(kTimerStorage_NumOverflowTimers * sizeof(struct PAL_timer));
+        if (overflow_repo) {
+            LOG_WRN("%u timers in use, adding %u timers from the heap.",
+                    (unsigned int) kTimerStorage_NumStaticTimers,
+                    (unsigned int) kTimerStorage_NumOverflowTimers);
+            for (size_t i = kTimerStorage_NumOverflowTimers; i-- > 0;) {
+                SlabPush(&overflow_repo[i]);
+            }
+            timer_stats.overflowCapacity = kTimerStorage_NumOverflowTimers;
+        }
+    }
+#endif
+    struct PAL_timer* tim = free_timers;
+    if (tim == NULL) {
+        timer_stats.numFailed++;
+        return NULL;
+    }
+    free_timers = tim->next_free;
+    tim->next_free = NULL;
+
+    timer_stats.numUsed++;
+    if (timer_stats.numUsed > timer_stats.maxNumUsed) {
+        timer_stats.maxNumUsed = timer_stats.numUsed;
+        LOG_DBG("timers: %u / %u timers used, new max usage",
+                (unsigned int) timer_stats.numUsed,
+                (unsigned int) (timer_stats.capacity + timer_stats.overflowCapacity));
+    }
+    return tim;
+}
+
+/**
+ * @brief Return a timer to the free list. Must be called with timer_repo_mutex held.
+ *
+ * @param tim timer to free.
+ */
+static void SlabFree(struct PAL_timer* tim) {
+    HAPAssert(timer_stats.numUsed > 0);
+    SlabPush(tim);
+    timer_stats.numUsed--;
+}
+
 /**
  * @brief calculate when next timer in list should expire, and adjust kernel timer.
  *
@@ -250,6 +417,9 @@ static void RescheduleTimer(void) {
     HAPTime next_deadline = UINT64_MAX;
     const HAPTime now = HAPPlatformClockGetCurrent();
     if (GetNextTimerDeadline(&next_deadline)) {
+        // wake up as late as the slack of the timers due by then allows, so that they expire in one pass.
+        next_deadline = LatestDeadline(timer_heap[0]);
+        CoalesceWakeup(0, &next_deadline);
         const k_timeout_t delay = next_deadline >= now ? K_MSEC(next_deadline - now) : K_USEC(1);
         k_timer_start(&kernel_isr_timer, delay, K_NO_WAIT);
     } else {
@@ -257,32 +427,161 @@ static void RescheduleTimer(void) {
     }
 }
 
+/**
+ * @brief Latest time a timer may run, its deadline plus its slack.
+ */
+static HAPTime LatestDeadline(const struct PAL_timer* tim) {
+    return tim->deadline > UINT64_MAX - tim->slack ? UINT64_MAX : tim->deadline + tim->slack;
+}
+
+/**
+ * @brief Lower @p wakeup to the latest time of every timer due by then, so that no timer runs later than its slack.
+ *
+ * Visits only the timers due by @p wakeup, whose subtrees are pruned otherwise. The recursion is as deep as the heap.
+ *
+ * @param index heap position to start at.
+ * @param wakeup[in,out] time of the wakeup.
+ */
+static void CoalesceWakeup(size_t index, HAPTime* wakeup) {
+    if (index >= timer_heap_size || timer_heap[index]->deadline > *wakeup) {
+        return;
+    }
+    *wakeup = HAPMin(*wakeup, LatestDeadline(timer_heap[index]));
+    CoalesceWakeup(2 * index + 1, wakeup);
+    CoalesceWakeup(2 * index + 2, wakeup);
+}
+
 /*
- *  @brief This function is loops through registered timers, and finds the next timer to execute.
+ *  @brief This function finds the deadline of the next timer to execute, at the root of the heap.
  *
  *  @param next_deadline[out] write the deadline of the closest timer.
- *  @return true on success, false when the list of timers is empty
+ *  @return true on success, false when the heap of timers is empty
  */
 static bool GetNextTimerDeadline(HAPTime* next_deadline) {
-    const HAPTime now = HAPPlatformClockGetCurrent();
-    HAPTime next = UINT64_MAX;
-    struct PAL_timer* element = NULL;
-    if (sys_slist_peek_head(&submitted_timers) == NULL) {
-        return false; // empty list
-    }
-    SYS_SLIST_FOR_EACH_CONTAINER(&submitted_timers, element, node) {
-        if (element->deadline < next) {
-            next = element->deadline;
+    if (timer_heap_size == 0) {
+        return false; // empty heap
+    }
+    *next_deadline = timer_heap[0]->deadline;
+    return true;
+}
+
+/**
+ * @brief Whether timer @p a expires before timer @p b.
+ */
+static bool HeapBefore(const struct PAL_timer* a, const struct PAL_timer* b) {
+    if (a->deadline != b->deadline) {
+        return a->deadline < b->deadline;
+    }
+    return (int32_t)(a->sequence - b->sequence) < 0;
+}
+
+static void HeapSet(size_t index, struct PAL_timer* tim) {
+    timer_heap[index] = tim;
+    tim->heap_index = index;
+}
+
+static void HeapSiftUp(size_t index) {
+    struct PAL_timer* tim = timer_heap[index];
+    while (index > 0) {
+        size_t parent = (index - 1) / 2;
+        if (!HeapBefore(tim, timer_heap[parent])) {
+            break;
         }
-        if (next <= now) {
-            // found timer that should already be executed, break, and run it.
+        HeapSet(index, timer_heap[parent]);
+        index = parent;
+    }
+    HeapSet(index, tim);
+}
+
+static void HeapSiftDown(size_t index) {
+    struct PAL_timer* tim = timer_heap[index];
+    for (;;) {
+        size_t child = 2 * index + 1;
+        if (child >= timer_heap_size) {
             break;
         }
+        if (child + 1 < timer_heap_size && HeapBefore(timer_heap[child + 1], timer_heap[child])) {
+            child++;
+        }
+        if (!HeapBefore(timer_heap[child], tim)) {
+            break;
+        }
+        HeapSet(index, timer_heap[child]);
+        index = child;
     }
-    *next_deadline = next;
-    return true;
+    HeapSet(index, tim);
 }
 
+/**
+ * @brief Insert a timer into the heap. Must be called with timer_repo_mutex held.
+ *
+ * @param tim timer to insert.
+ */
+static void HeapInsert(struct PAL_timer* tim) {
+    HAPAssert(timer_heap_size < kTimerStorage_MaxTimers);
+    HeapSet(timer_heap_size, tim);
+    timer_heap_size++;
+    HeapSiftUp(tim->heap_index);
+}
+
+/**
+ * @brief Remove a timer from the heap. Must be called with timer_repo_mutex held.
+ *
+ * @param tim timer to remove, must be in the heap.
+ */
+static void HeapRemove(struct PAL_timer* tim) {
+    size_t index = tim->heap_index;
+    timer_heap_size--;
+    if (index == timer_heap_size) {
+        return;
+    }
+    // Move the last timer into the gap, then restore the heap order in whichever direction it is violated.
+    HeapSet(index, timer_heap[timer_heap_size]);
+    if (index > 0 && HeapBefore(timer_heap[index], timer_heap[(index - 1) / 2])) {
+        HeapSiftUp(index);
+    } else {
+        HeapSiftDown(index);
+    }
+}
+
+static bool HeapContains(const struct PAL_timer* tim) {
+    return tim->timer_id != TIMER_NOT_USED && tim->heap_index < timer_heap_size && timer_heap[tim->heap_index] == tim;
+}
+
+/**
+ * @brief Whether a timer was taken from the heap by WorkHandler and did not run yet.
+ */
+static bool IsExpired(const struct PAL_timer* tim) {
+    return tim->timer_id != TIMER_NOT_USED && tim->heap_index == TIMER_EXPIRED;
+}
+
+/**
+ * @brief Submit WorkHandler to the timer work queue, or to sysworkq without CONFIG_HAP_PLATFORM_TIMER_WORKQ.
+ *
+ */
+static void SubmitWork(void) {
+#if defined(CONFIG_HAP_PLATFORM_TIMER_WORKQ)
+    k_work_submit_to_queue(&timer_workq, &work);
+#else
+    k_work_submit(&work);
+#endif
+}
+
+#if defined(CONFIG_HAP_PLATFORM_TIMER_WORKQ)
+static int TimerWorkQueueInit(void) {
+    const struct k_work_queue_config config = { .name = "hap_timer" };
+    k_work_queue_start(
+            &timer_workq,
+            timer_workq_stack,
+            K_THREAD_STACK_SIZEOF(timer_workq_stack),
+            CONFIG_HAP_PLATFORM_TIMER_WORKQ_PRIORITY,
+            &config);
+    return 0;
+}
+
+SYS_INIT(TimerWorkQueueInit, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
+#endif
+
 /**
  * @brief ISR callback for kernel timer
  *
@@ -290,11 +589,15 @@ static bool GetNextTimerDeadline(HAPTime* next_deadline) {
  */
 static void TimerHandlerISR(struct k_timer* dummy) {
     (void) dummy;
-    k_work_submit(&work); // call WorkHandler in sysworkq
+    atomic_inc(&kernel_timer_expirations);
+    SubmitWork(); // call WorkHandler in the timer work queue
 }
 
 /**
- * @brief callback for sysworkq, running expired timers.
+ * @brief callback for the timer work queue, running expired timers.
+ *
+ * All timers expired at the start of the pass are taken from the heap under one lock and run in deadline order. Timers
+ * that expire while they run, including immediate timers registered by the callbacks, are left to the next pass.
  *
  * @param dummy  not used
  */
@@ -302,97 +605,107 @@ static void WorkHandler(struct k_work* dummy) {
     (void) dummy;
     k_mutex_lock(&timer_repo_mutex, K_FOREVER);
     const HAPTime now = HAPPlatformClockGetCurrent();
-    struct PAL_timer* timer_to_run = NULL;
-    struct PAL_timer* element = NULL;
-    SYS_SLIST_FOR_EACH_CONTAINER(&submitted_timers, element, node) {
-        if (element->deadline <= now) {
-            timer_to_run = element;
-            break;
-        }
+    size_t num_expired = 0;
+    while (timer_heap_size > 0 && timer_heap[0]->deadline <= now && num_expired < kTimerStorage_MaxTimers) {
+        struct PAL_timer* tim = timer_heap[0];
+        HeapRemove(tim);
+        tim->heap_index = TIMER_EXPIRED;
+        expired_timers[num_expired++] = tim;
     }
+    k_mutex_unlock(&timer_repo_mutex);
 
-    if (timer_to_run == NULL) {
-        RescheduleTimer();
-        k_mutex_unlock(&timer_repo_mutex);
-        return;
-    }
+    for (size_t i = 0; i < num_expired; i++) {
+        struct PAL_timer* timer_to_run = expired_timers[i];
 
-    // clear callback from list and call it
-    sys_slist_find_and_remove(&submitted_timers, &timer_to_run->node);
-    const HAPPlatformTimerCallback callback = timer_to_run->HAPTimer.callback;
-    void* context = timer_to_run->HAPTimer.context;
-    const HAPPlatformTimerRef id = timer_to_run->timer_id;
-    ClearTimer(timer_to_run);
+        // clear callback, unless the timer was deregistered by an earlier callback of this pass, and call it
+        k_mutex_lock(&timer_repo_mutex, K_FOREVER);
+        if (!IsExpired(timer_to_run)) {
+            k_mutex_unlock(&timer_repo_mutex);
+            continue;
+        }
+        const HAPPlatformTimerCallback callback = timer_to_run->HAPTimer.callback;
+        void* context = timer_to_run->HAPTimer.context;
+        const HAPPlatformTimerRef id = timer_to_run->timer_id;
+        SlabFree(timer_to_run);
+        timer_stats.numExpired++;
+        k_mutex_unlock(&timer_repo_mutex);
 
-    k_mutex_unlock(&timer_repo_mutex);
 #if TIMER_BLACKLIST
-    for (int i = 0; i < BLACK_LIST_MAX_ELEMENT; ++i) {
-        if (black_list[i].callback == callback && black_list[i].condition()) {
-            LOG_DBG("ignore call timer 0x%lx callback = %p", (long unsigned int) id, callback);
-            k_work_submit(&work);
-            return;
+        bool blocked = false;
+        for (int j = 0; j < BLACK_LIST_MAX_ELEMENT; ++j) {
+            if (black_list[j].callback == callback && black_list[j].condition()) {
+                LOG_DBG("ignore call timer 0x%lx callback = %p", (long unsigned int) id, callback);
+                blocked = true;
+                break;
+            }
+        }
+        if (blocked) {
+            continue;
         }
-    }
 #endif
-    LOG_DBG("start call timer 0x%lx callback = %p", (long unsigned int) id, callback);
-    callback(id, context);
-    LOG_DBG("end call timer 0x%lx callback = %p", (long unsigned int) id, callback);
-    // call WorkHandler in sysworkq to check if other timer need execution (callback can register immediate timer, or
-    // few immediate timers may be already in queue) - can not call WorkHandler directly, because it will lock sysworkq
-    // (like adding immediate timer in the callback can cause infinite loop)
-    k_work_submit(&work);
+        LOG_DBG("start call timer 0x%lx callback = %p", (long unsigned int) id, callback);
+        callback(id, context);
+        LOG_DBG("end call timer 0x%lx callback = %p", (long unsigned int) id, callback);
+    }
+
+    k_mutex_lock(&timer_repo_mutex, K_FOREVER);
+    HAPTime next_deadline;
+    if (GetNextTimerDeadline(&next_deadline) && next_deadline <= HAPPlatformClockGetCurrent()) {
+        // run the timers that expired meanwhile in another pass - can not loop here, because it will lock the work
+        // queue (like adding immediate timer in the callback can cause infinite loop)
+        k_timer_stop(&kernel_isr_timer);
+        SubmitWork();
+    } else {
+        RescheduleTimer();
+    }
+    k_mutex_unlock(&timer_repo_mutex);
 }
 
 /**
- * @brief fill element of timer repo, in preperation for inserting to list.
+ * @brief allocate and fill a timer of the slab, in preperation for inserting to heap.
  *
  * @param callback timer callback
  * @param context context of the timer
  * @param deadline time of execution
+ * @param slack time the execution may be delayed by
  * @return struct PAL_timer* timer object from repo
  */
-static struct PAL_timer* PlaceInRepo(HAPPlatformTimerCallback callback, void* _Nullable context, HAPTime deadline) {
-    size_t index = 0xffff;
-    for (uint8_t i = 0; i < kTimerStorage_MaxTimers; ++i) {
-        if (timer_repo[i].timer_id == TIMER_NOT_USED) {
-            index = i;
-            break;
-        }
-    }
-
-    if (index < kTimerStorage_MaxTimers && timer_repo[index].timer_id == TIMER_NOT_USED) {
-        timer_repo[index].timer_id = (HAPPlatformTimerRef) &timer_repo[index];
-        timer_repo[index].HAPTimer = (HAPPlatformTimer) { .callback = callback, .context = context };
-        timer_repo[index].deadline = deadline;
-        return (struct PAL_timer*) timer_repo[index].timer_id;
-    } else {
+static struct PAL_timer* PlaceInRepo(
+        HAPPlatformTimerCallback callback,
+        void* _Nullable context,
+        HAPTime deadline,
+        HAPTime slack) {
+    struct PAL_timer* tim = SlabAlloc();
+    if (tim == NULL) {
         return NULL;
     }
+    tim->timer_id = (HAPPlatformTimerRef) tim;
+    tim->HAPTimer = (HAPPlatformTimer) { .callback = callback, .context = context };
+    tim->deadline = deadline;
+    tim->sequence = timer_sequence++;
+    tim->slack = (uint32_t) HAPMin(slack / HAPMillisecond, UINT32_MAX);
+    return tim;
 }
 
-#if CONFIG_LOG
-/**
- * @brief Print usage of the timer repo.
- *
- */
-static void PrintStats() {
-    static size_t max_usage = 0;
-    size_t used = 0;
-    for (uint8_t i = 0; i < kTimerStorage_MaxTimers; ++i) {
-        if (timer_repo[i].timer_id != TIMER_NOT_USED) {
-            used++;
-        }
-    }
-    if (used > max_usage) {
-        max_usage = used;
-    }
+void HAPPlatformTimerGetStats(HAPPlatformTimerStats* stats) {
+    HAPPrecondition(stats);
+
+    Initialize();
+    k_mutex_lock(&timer_repo_mutex, K_FOREVER);
+    *stats = timer_stats;
+    stats->countingDuration = HAPPlatformClockGetCurrent() - expiration_stats_reset_time;
+    k_mutex_unlock(&timer_repo_mutex);
+    stats->numKernelTimerExpirations = (uint32_t) atomic_get(&kernel_timer_expirations);
+}
 
-    LOG_DBG("timers: %u / %u timers used, max usage %d",
-            (unsigned int) used,
-            (unsigned int) kTimerStorage_MaxTimers,
-            (unsigned int) max_usage);
+void HAPPlatformTimerResetExpirationStats(void) {
+    Initialize();
+    k_mutex_lock(&timer_repo_mutex, K_FOREVER);
+    timer_stats.numExpired = 0;
+    expiration_stats_reset_time = HAPPlatformClockGetCurrent();
+    atomic_clear(&kernel_timer_expirations);
+    k_mutex_unlock(&timer_repo_mutex);
 }
-#endif
 
 #if TIMER_BLACKLIST
 void AddTimerToBlackList(HAPPlatformTimerCallback callback, bool (*condition)()) {
@@ -418,3 +731,149 @@ void AddTimerToBlackList(HAPPlatformTimerCallback callback, bool (*condition)())
     LOG_ERR("No more space in black list!");
 }
 #endif
+
+#if defined(CONFIG_HAP_PLATFORM_TIMER_BENCHMARK)
+/** Number of calls to GetNextTimerDeadline measured by the benchmark. */
+#define kBenchmarkNumLookups 1000
+
+static atomic_t benchmark_fired;
+static HAPTime benchmark_last_fired;
+
+static void BenchmarkCallback(HAPPlatformTimerRef timer, void* _Nullable context) {
+    (void) timer;
+    (void) context;
+    benchmark_last_fired = HAPPlatformClockGetCurrent();
+    atomic_inc(&benchmark_fired);
+}
+
+/**
+ * @brief Index of the i-th benchmark timer in a scattered order, so that deadlines are not registered sorted.
+ *        7919 is prime, so this is a permutation for every count below it.
+ */
+static size_t BenchmarkOrder(size_t i, size_t num_timers) {
+    return (i * 7919) % num_timers;
+}
+
+static int CommandBenchmark(const struct shell* shell, size_t argc, char** argv) {
+    (void) argc;
+    static HAPPlatformTimerRef timers[kTimerStorage_MaxTimers];
+    size_t num_timers = strtoul(argv[1], NULL, 0);
+
+    if (!num_timers || num_timers > kTimerStorage_MaxTimers) {
+        shell_error(shell, "Timer count must be between 1 and %u.", (unsigned int) kTimerStorage_MaxTimers);
+        return -EINVAL;
+    }
+
+    // Far deadlines, to measure registration with the timers piling up.
+    const HAPTime base = HAPPlatformClockGetCurrent() + HAPHour;
+    size_t num_registered = 0;
+    uint32_t start = k_cycle_get_32();
+    for (size_t i = 0; i < num_timers; i++) {
+        HAPError err = HAPPlatformTimerRegister(
+                &timers[i], base + BenchmarkOrder(i, num_timers), BenchmarkCallback, NULL);
+        if (err) {
+            break;
+        }
+        num_registered++;
+    }
+    uint32_t cycles = k_cycle_get_32() - start;
+    if (num_registered < num_timers) {
+        shell_warn(shell, "Only %zu timers registered, the others are in use.", num_registered);
+    }
+    if (num_registered) {
+        shell_print(shell, "Register   %6u us", (unsigned int) (k_cyc_to_us_floor32(cycles) / num_registered));
+    }
+
+    HAPTime next_deadline = 0;
+    k_mutex_lock(&timer_repo_mutex, K_FOREVER);
+    start = k_cycle_get_32();
+    for (size_t i = 0; i < kBenchmarkNumLookups; i++) {
+        (void) GetNextTimerDeadline(&next_deadline);
+    }
+    cycles = k_cycle_get_32() - start;
+    k_mutex_unlock(&timer_repo_mutex);
+    shell_print(shell, "Next       %6u ns", (unsigned int) (k_cyc_to_ns_floor64(cycles) / kBenchmarkNumLookups));
+
+    start = k_cycle_get_32();
+    for (size_t i = 0; i < num_registered; i++) {
+        HAPPlatformTimerDeregister(timers[BenchmarkOrder(i, num_registered)]);
+    }
+    cycles = k_cycle_get_32() - start;
+    if (num_registered) {
+        shell_print(shell, "Deregister %6u us", (unsigned int) (k_cyc_to_us_floor32(cycles) / num_registered));
+    }
+
+    // All timers due at the same time, measured from the deadline to the last callback.
+    atomic_clear(&benchmark_fired);
+    const HAPTime deadline = HAPPlatformClockGetCurrent() + 10 * HAPMillisecond;
+    num_registered = 0;
+    for (size_t i = 0; i < num_timers; i++) {
+        if (HAPPlatformTimerRegister(&timers[i], deadline, BenchmarkCallback, NULL)) {
+            break;
+        }
+        num_registered++;
+    }
+    while ((size_t) atomic_get(&benchmark_fired) < num_registered) {
+        k_sleep(K_MSEC(1));
+    }
+    if (num_registered) {
+        shell_print(shell, "Expire all %6u ms late", (unsigned int) (benchmark_last_fired - deadline));
+    }
+    return 0;
+}
+
+#else
+// SHELL_COND_CMD_ARG references the handler even when the command is compiled out.
+#define CommandBenchmark NULL
+#endif
+
+#if defined(CONFIG_SHELL)
+static int CommandStats(const struct shell* shell, size_t argc, char** argv) {
+    (void) argc;
+    (void) argv;
+    HAPPlatformTimerStats stats;
+    HAPPlatformTimerGetStats(&stats);
+    shell_print(shell, "Capacity  %u + %u overflow", (unsigned int) stats.capacity, (unsigned int) stats.overflowCapacity);
+    shell_print(shell, "Used      %u", (unsigned int) stats.numUsed);
+    shell_print(shell, "Max used  %u", (unsigned int) stats.maxNumUsed);
+    shell_print(shell, "Failed    %u", (unsigned int) stats.numFailed);
+
+    const uint64_t seconds = HAPMax(stats.countingDuration / HAPSecond, 1);
+    shell_print(shell, "Counted over %u s", (unsigned int) seconds);
+    shell_print(
+            shell,
+            "Kernel timer expirations %u, %u per hour",
+            (unsigned int) stats.numKernelTimerExpirations,
+            (unsigned int) ((uint64_t) stats.numKernelTimerExpirations * 3600 / seconds));
+    shell_print(
+            shell,
+            "Expired   %u, %u per hour",
+            (unsigned int) stats.numExpired,
+            (unsigned int) ((uint64_t) stats.numExpired * 3600 / seconds));
+    return 0;
+}
+
+static int CommandReset(const struct shell* shell, size_t argc, char** argv) {
+    (void) argc;
+    (void) argv;
+    HAPPlatformTimerResetExpirationStats();
+    shell_print(shell, "Expiration counters reset");
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+        timerCommands,
+        SHELL_CMD(stats, NULL, "Show timer usage", CommandStats),
+        SHELL_CMD(reset, NULL, "Restart counting kernel timer expirations and expired timers", CommandReset),
+        SHELL_COND_CMD_ARG(
+                CONFIG_HAP_PLATFORM_TIMER_BENCHMARK,
+                bench,
+                NULL,
+                "Measure timer operations with <timers> registered timers",
+                CommandBenchmark,
+                2,
+                0),
+        SHELL_SUBCMD_SET_END);
+
+SHELL_CMD_REGISTER(hap_timer, &timerCommands, "HAP platform timers", NULL);
+#endif
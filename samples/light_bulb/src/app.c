@@ -85,6 +85,7 @@
 #include "HAP.h"
 
 #include "HAPPlatform+Init.h"
+#include "HAPPlatformTimer+Init.h"
 
 #include "AccessoryInformationServiceDB.h"
 #include "App.h"
@@ -129,6 +130,11 @@
  */
 #define kAppKeyValueStoreKey_Configuration_State ((HAPPlatformKeyValueStoreKey) 0x00)
 
+/**
+ * Time the identify timer may expire late, to share a wakeup with other timers.
+ */
+#define kAppIdentifyTimerSlack ((HAPTime)(100 * HAPMillisecond))
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 typedef struct {
     AppLEDIdentifier lightBulbPin;
@@ -386,9 +392,10 @@ static void DeviceIdentify(void) {
         HAPPlatformTimerDeregister(accessoryConfiguration.identifyTimer);
         accessoryConfiguration.identifyTimer = 0;
     }
-    err = HAPPlatformTimerRegister(
+    err = HAPPlatformTimerRegisterWithSlack(
             &accessoryConfiguration.identifyTimer,
             HAPPlatformClockGetCurrent() + 3 * HAPSecond,
+            kAppIdentifyTimerSlack,
             IdentifyTimerExpired,
             NULL);
     if (err) {
@@ -110,6 +110,8 @@
 #endif
 
 #include "PowerManagment.h"
+#include "HAPPlatformTapTrace.h"
+#include "HAPPlatformTimer+Init.h"
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 /**
@@ -119,6 +121,16 @@
  */
 #define kAppKeyValueStoreKey_Configuration_State ((HAPPlatformKeyValueStoreKey) 0x00)
 
+/**
+ * Time the identify timer may expire late, to share a wakeup with other timers.
+ */
+#define kAppIdentifyTimerSlack ((HAPTime)(100 * HAPMillisecond))
+
+/**
+ * Time the keypad disable timer may expire late, to share a wakeup with other timers.
+ */
+#define kAppKeypadTimerSlack ((HAPTime) HAPSecond)
+
 #if (HAVE_ACCESS_CODE == 1)
 /**
  * Key store domain dedicated to access code list
@@ -437,6 +449,7 @@ static void DeviceDisableLED(AppLEDIdentifier pin) {
 void SetLockTargetState(HAPCharacteristicValue_LockTargetState targetState) {
     HAPLogInfo(&kHAPLog_Default, "%s", __func__);
     HAPCharacteristicValue_LockCurrentState newCurrentState = 0;
+    HAPPlatformTapTraceStamp traceStamp = HAPPlatformTapTraceBegin();
 
     switch (targetState) {
         case kHAPCharacteristicValue_LockTargetState_Secured:
@@ -449,6 +462,7 @@ void SetLockTargetState(HAPCharacteristicValue_LockTargetState targetState) {
             DeviceDisableLED(accessoryConfiguration.device.lockStateLedPin);
             break;
     }
+    HAPPlatformTapTraceEnd(kHAPPlatformTapTraceEvent_LockTargetState, targetState, traceStamp);
 
     if (accessoryConfiguration.state.targetState != targetState ||
         accessoryConfiguration.state.currentState != newCurrentState) {
@@ -480,6 +494,7 @@ void SetLockTargetState(HAPCharacteristicValue_LockTargetState targetState) {
         }
         if (accessoryConfiguration.state.currentState != newCurrentState) {
             accessoryConfiguration.state.currentState = newCurrentState;
+            HAPPlatformTapTraceRecord(kHAPPlatformTapTraceEvent_LockCurrentState, newCurrentState);
 
             HAPAccessoryServerRaiseEvent(
                     accessoryConfiguration.server,
@@ -495,6 +510,7 @@ void SetLockTargetState(HAPCharacteristicValue_LockTargetState targetState) {
 #if (HAP_TESTING == 1)
 void SetLockCurrentState(HAPCharacteristicValue_LockCurrentState newCurrentState) {
     HAPLogInfo(&kHAPLog_Default, "%s", __func__);
+    HAPPlatformTapTraceRecord(kHAPPlatformTapTraceEvent_LockCurrentState, newCurrentState);
 
     if (accessoryConfiguration.state.currentState != newCurrentState) {
         accessoryConfiguration.state.currentState = newCurrentState;
@@ -800,9 +816,10 @@ static void DeviceIdentify(void) {
         HAPPlatformTimerDeregister(accessoryConfiguration.identifyTimer);
         accessoryConfiguration.identifyTimer = 0;
     }
-    err = HAPPlatformTimerRegister(
+    err = HAPPlatformTimerRegisterWithSlack(
             &accessoryConfiguration.identifyTimer,
             HAPPlatformClockGetCurrent() + 3 * HAPSecond,
+            kAppIdentifyTimerSlack,
             IdentifyTimerExpired,
             NULL);
     if (err) {
@@ -1112,9 +1129,10 @@ static void EnableKeypadDisableTimer(HAPTime keypadDisableTime) {
         return;
     }
 
-    HAPError err = HAPPlatformTimerRegister(
+    HAPError err = HAPPlatformTimerRegisterWithSlack(
             &accessoryConfiguration.keypadTimer,
             HAPPlatformClockGetCurrent() + keypadDisableTime,
+            kAppKeypadTimerSlack,
             HandleKeypadDisableTimerCallback,
             accessoryConfiguration.server);
     if (err) {
@@ -1583,6 +1601,7 @@ static void HandleConfigurationStateChangeByNfc(void) {
  * Handle lock state changes by NFC
  */
 static void HandleLockStateChangeByNfc(NfcLockStateChangeInfo lockStateChangeInfo) {
+    HAPPlatformTapTraceRecord(kHAPPlatformTapTraceEvent_LockStateChangeByNfc, lockStateChangeInfo.locked);
     HAPLogInfo(&kHAPLog_Default, "%s: locked = %s", __func__, lockStateChangeInfo.locked ? "true" : "false");
 #if (HAVE_LOCK_ENC == 1)
     accessoryConfiguration.state.contextData.source = STATE_CHANGE_SOURCE_NFC;
@@ -0,0 +1,399 @@
+/*
+ * Copyright (c) 2023 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/util.h>
+
+#include "nfca_poller.h"
+
+LOG_MODULE_REGISTER(nfca_poller);
+
+#define CMD_REQA 0x26
+#define CMD_WUPA 0x52
+#define CMD_HLTA 0x50
+
+/* SEL codes of the cascade levels. */
+static const uint8_t sel_codes[] = { 0x93, 0x95, 0x97 };
+
+/* NVB of a SELECT command: SEL, NVB, four UID CLn bytes and BCC. */
+#define NVB_SELECT 0x70
+
+/* Cascade tag that opens UID CLn when the UID continues on the next level. */
+#define CASCADE_TAG 0x88
+
+/* SAK bit: UID not complete. */
+#define SAK_CASCADE 0x04
+
+/* UID CLn and BCC. */
+#define UID_CL_LEN  5
+#define UID_CL_BITS (UID_CL_LEN * 8)
+
+/* Single size random UIDs, for example of phones, start with this byte. */
+#define UID_RANDOM 0x08
+
+/* SEL and NVB. */
+#define ANTICOLL_HDR_BITS 16
+
+struct card_cache {
+	struct nfca_card card;
+	bool valid;
+};
+
+static const struct nfca_transport *transport;
+static struct card_cache cache;
+static struct nfca_poller_stats stats;
+
+static uint8_t bcc_calc(const uint8_t *uid_cl)
+{
+	return uid_cl[0] ^ uid_cl[1] ^ uid_cl[2] ^ uid_cl[3];
+}
+
+static uint8_t cascade_levels(uint8_t uid_len)
+{
+	return (uid_len == 4) ? 1 : ((uid_len == 7) ? 2 : 3);
+}
+
+/* Fill UID CLn and BCC of the given cascade level from a complete UID. */
+static void uid_cl_from_uid(const struct nfca_card *card, uint8_t level, uint8_t *uid_cl)
+{
+	bool last = (level == cascade_levels(card->uid_len) - 1);
+	const uint8_t *uid = &card->uid[level * 3];
+
+	if (last) {
+		memcpy(uid_cl, uid, 4);
+	} else {
+		uid_cl[0] = CASCADE_TAG;
+		memcpy(&uid_cl[1], uid, 3);
+	}
+	uid_cl[4] = bcc_calc(uid_cl);
+}
+
+static int select_level(uint8_t level, const uint8_t *uid_cl, uint8_t *sak)
+{
+	uint8_t cmd[2 + UID_CL_LEN];
+	size_t rx_len;
+	int err;
+
+	cmd[0] = sel_codes[level];
+	cmd[1] = NVB_SELECT;
+	memcpy(&cmd[2], uid_cl, UID_CL_LEN);
+
+	err = transport->transceive(cmd, sizeof(cmd), sak, 1, &rx_len);
+	if (err) {
+		return err;
+	}
+
+	return (rx_len == 1) ? 0 : -EPROTO;
+}
+
+/* Resolve UID CLn of one cascade level with the bit-oriented anticollision loop. */
+static int anticollision_level(uint8_t level, uint8_t *uid_cl, bool *collided)
+{
+	uint8_t frame[2 + UID_CL_LEN];
+	uint8_t rx[UID_CL_LEN];
+	size_t known = 0;
+	int err;
+
+	memset(uid_cl, 0, UID_CL_LEN);
+
+	while (known < UID_CL_BITS) {
+		size_t known_bytes = DIV_ROUND_UP(known, 8);
+		size_t rx_bits;
+		bool collision;
+
+		frame[0] = sel_codes[level];
+		frame[1] = ((2 + known / 8) << 4) | (known % 8);
+		memcpy(&frame[2], uid_cl, known_bytes);
+
+		err = transport->anticollision(frame, ANTICOLL_HDR_BITS + known, rx, sizeof(rx),
+					       &rx_bits, &collision);
+		if (err) {
+			return err;
+		}
+
+		if (!collision && (known + rx_bits != UID_CL_BITS)) {
+			return -EPROTO;
+		}
+
+		/* The first received byte completes the split byte of the frame. */
+		for (size_t i = 0; i < MIN(DIV_ROUND_UP((known % 8) + rx_bits, 8),
+					  UID_CL_LEN - known / 8); i++) {
+			uid_cl[(known / 8) + i] |= rx[i];
+		}
+
+		if (!collision) {
+			break;
+		}
+
+		/* Clear the bits from the collision on and continue with the "1" branch. */
+		known += rx_bits;
+		if (known >= UID_CL_BITS) {
+			return -EPROTO;
+		}
+
+		uid_cl[known / 8] &= BIT_MASK(known % 8);
+		uid_cl[known / 8] |= BIT(known % 8);
+		memset(&uid_cl[known / 8 + 1], 0, UID_CL_LEN - known / 8 - 1);
+		known++;
+		*collided = true;
+	}
+
+	return (uid_cl[4] == bcc_calc(uid_cl)) ? 0 : -EBADMSG;
+}
+
+/* Resolve and select one card in the READY state. */
+static int anticollision(struct nfca_card *card, bool *collided)
+{
+	uint8_t uid_cl[UID_CL_LEN];
+	int err;
+
+	card->uid_len = 0;
+
+	for (uint8_t level = 0; level < ARRAY_SIZE(sel_codes); level++) {
+		err = anticollision_level(level, uid_cl, collided);
+		if (err) {
+			return err;
+		}
+
+		err = select_level(level, uid_cl, &card->sak);
+		if (err) {
+			return err;
+		}
+
+		if (!(card->sak & SAK_CASCADE)) {
+			memcpy(&card->uid[card->uid_len], uid_cl, 4);
+			card->uid_len += 4;
+			return 0;
+		}
+
+		if (uid_cl[0] != CASCADE_TAG) {
+			return -EPROTO;
+		}
+
+		memcpy(&card->uid[card->uid_len], &uid_cl[1], 3);
+		card->uid_len += 3;
+	}
+
+	return -EPROTO;
+}
+
+/* Select a known card in the READY state without the anticollision loop. */
+static int select_uid(const struct nfca_card *card, uint8_t *sak)
+{
+	uint8_t levels = cascade_levels(card->uid_len);
+	uint8_t uid_cl[UID_CL_LEN];
+	int err;
+
+	for (uint8_t level = 0; level < levels; level++) {
+		uid_cl_from_uid(card, level, uid_cl);
+
+		err = select_level(level, uid_cl, sak);
+		if (err) {
+			return err;
+		}
+
+		if (!!(*sak & SAK_CASCADE) != (level != levels - 1)) {
+			return -EPROTO;
+		}
+	}
+
+	return 0;
+}
+
+static void halt(void)
+{
+	static const uint8_t cmd[] = { CMD_HLTA, 0x00 };
+
+	/* The card does not answer HLTA. */
+	(void)transport->transceive(cmd, sizeof(cmd), NULL, 0, NULL);
+}
+
+static bool cacheable(const struct nfca_card *card)
+{
+	return !((card->uid_len == 4) && (card->uid[0] == UID_RANDOM));
+}
+
+static void stats_update(struct nfca_select_stats *s, uint32_t us)
+{
+	s->min_us = s->count ? MIN(s->min_us, us) : us;
+	s->max_us = MAX(s->max_us, us);
+	s->sum_us += us;
+	s->count++;
+}
+
+/* Wake the cached card and select it by its UID. */
+static int reselect(struct nfca_card *card, bool *woken)
+{
+	uint8_t atqa[2];
+	uint8_t sak;
+	int err;
+
+	err = transport->short_frame(CMD_WUPA, atqa);
+	if (err) {
+		return err;
+	}
+
+	*woken = true;
+
+	/* Another card or several cards answered. */
+	if (memcmp(atqa, cache.card.atqa, sizeof(atqa))) {
+		return -ENOENT;
+	}
+
+	err = select_uid(&cache.card, &sak);
+	if (err) {
+		return err;
+	}
+
+	if (sak != cache.card.sak) {
+		return -EPROTO;
+	}
+
+	*card = cache.card;
+
+	return 0;
+}
+
+/* Resolve all cards in the field, then select the preferred one. */
+static int activate(struct nfca_card *card)
+{
+	struct nfca_card cards[NFCA_MAX_CARDS];
+	size_t cnt = 0;
+	size_t pick = 0;
+	bool collided = false;
+	uint8_t atqa[2];
+	uint8_t sak;
+	int err;
+
+	/* WUPA first so that a card halted by an earlier poll is found again. */
+	while (cnt < ARRAY_SIZE(cards)) {
+		err = transport->short_frame(cnt ? CMD_REQA : CMD_WUPA, atqa);
+		if (err == -ETIMEDOUT) {
+			break;
+		}
+		if (err) {
+			return err;
+		}
+
+		err = anticollision(&cards[cnt], &collided);
+		if (err) {
+			LOG_DBG("Anticollision failed, err: %d", err);
+			break;
+		}
+
+		memcpy(cards[cnt].atqa, atqa, sizeof(atqa));
+		cnt++;
+
+		/* A lone card is resolved without a collision and is already selected. */
+		if (!collided) {
+			*card = cards[0];
+			return 0;
+		}
+
+		halt();
+	}
+
+	if (!cnt) {
+		return -ENOENT;
+	}
+
+	if (cnt > 1) {
+		stats.multi_card++;
+		LOG_INF("%zu cards in the field", cnt);
+	}
+
+	for (size_t i = 0; i < cnt; i++) {
+		if (cards[i].sak & NFCA_SAK_ISO_DEP) {
+			pick = i;
+			break;
+		}
+	}
+
+	/* All resolved cards are halted, wake them and address the chosen one. */
+	err = transport->short_frame(CMD_WUPA, atqa);
+	if (err) {
+		return err;
+	}
+
+	err = select_uid(&cards[pick], &sak);
+	if (err) {
+		return err;
+	}
+
+	*card = cards[pick];
+	card->sak = sak;
+
+	return 0;
+}
+
+int nfca_poller_select(struct nfca_card *card, uint32_t *elapsed_us)
+{
+	uint32_t start = k_cycle_get_32();
+	bool repeat = false;
+	int err = -ENOENT;
+
+	if (!transport) {
+		return -EACCES;
+	}
+
+	if (cache.valid) {
+		bool woken = false;
+
+		err = reselect(card, &woken);
+		if (!woken) {
+			/* Nothing answered the wake-up, the field is empty. */
+			return (err == -ETIMEDOUT) ? -ENOENT : err;
+		}
+
+		repeat = (err == 0);
+		if (!repeat) {
+			/* Another card, possibly with the same ATQA. Return the woken cards to IDLE or
+			 * HALT and resolve them in full, timed as a first tap.
+			 */
+			LOG_DBG("Reselect failed, err: %d", err);
+			cache.valid = false;
+			halt();
+			start = k_cycle_get_32();
+		}
+	}
+
+	if (!repeat) {
+		err = activate(card);
+		if (err) {
+			return err;
+		}
+
+		cache.valid = cacheable(card);
+		if (cache.valid) {
+			cache.card = *card;
+		}
+	}
+
+	*elapsed_us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+	stats_update(repeat ? &stats.repeat : &stats.first, *elapsed_us);
+
+	return 0;
+}
+
+void nfca_poller_cache_clear(void)
+{
+	cache.valid = false;
+}
+
+void nfca_poller_stats_get(struct nfca_poller_stats *out)
+{
+	*out = stats;
+}
+
+void nfca_poller_init(const struct nfca_transport *nfca_transport)
+{
+	transport = nfca_transport;
+	cache.valid = false;
+	memset(&stats, 0, sizeof(stats));
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2023 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef NFCA_POLLER_H_
+#define NFCA_POLLER_H_
+
+/**
+ * @file
+ * @brief NFC-A (ISO/IEC 14443-3A) card activation.
+ *
+ * Resolves every card in the field with the bit-oriented anticollision
+ * procedure and selects the preferred one. The UID and protocol parameters
+ * of the last successfully selected card are cached, so a repeat tap of the
+ * same card is selected directly by its UID without the SDD loop.
+ */
+
+#include <zephyr/types.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Maximum UID length (triple size UID). */
+#define NFCA_UID_MAX_LEN 10
+
+/** Maximum number of cards resolved in one poll. */
+#define NFCA_MAX_CARDS 4
+
+/** SAK bit: card is compliant with ISO/IEC 14443-4. */
+#define NFCA_SAK_ISO_DEP 0x20
+
+/** @brief Selected NFC-A card. */
+struct nfca_card {
+	uint8_t uid[NFCA_UID_MAX_LEN];
+	uint8_t uid_len;
+	uint8_t atqa[2];
+	uint8_t sak;
+};
+
+/** @brief Frame transport provided by the reader driver.
+ *
+ *  All functions return 0 on success, -ETIMEDOUT if the card did not answer
+ *  and another negative error code on transmission errors.
+ */
+struct nfca_transport {
+	/** Send REQA or WUPA as a 7-bit short frame and receive ATQA.
+	 *  A bit collision in ATQA is not an error.
+	 */
+	int (*short_frame)(uint8_t cmd, uint8_t atqa[2]);
+
+	/** Send a bit-oriented anticollision frame of @p tx_bits bits and
+	 *  receive the remaining bits of the UID CLn. Received bits of a split
+	 *  byte are placed at their original bit positions. On a collision
+	 *  @p rx_bits holds the number of valid bits before the collision.
+	 */
+	int (*anticollision)(const uint8_t *tx, size_t tx_bits, uint8_t *rx, size_t rx_max,
+			     size_t *rx_bits, bool *collision);
+
+	/** Send a standard frame with CRC_A and receive a frame with CRC_A.
+	 *  @p rx_len excludes the CRC. Passing @p rx as NULL sends a frame
+	 *  that expects no answer.
+	 */
+	int (*transceive)(const uint8_t *tx, size_t tx_len, uint8_t *rx, size_t rx_max,
+			  size_t *rx_len);
+};
+
+/** @brief Time-to-select statistics of one activation path. */
+struct nfca_select_stats {
+	uint32_t count;
+	uint32_t min_us;
+	uint32_t max_us;
+	uint64_t sum_us;
+};
+
+/** @brief Poller statistics. */
+struct nfca_poller_stats {
+	/** Full activation with anticollision. */
+	struct nfca_select_stats first;
+
+	/** Direct reselect of the cached card. */
+	struct nfca_select_stats repeat;
+
+	/** Polls that found more than one card in the field. */
+	uint32_t multi_card;
+};
+
+/** @brief Initialize the poller.
+ *
+ *  @param[in] transport Frame transport of the reader.
+ */
+void nfca_poller_init(const struct nfca_transport *transport);
+
+/** @brief Detect and select a card.
+ *
+ *  The RF field must be on. The cached card is tried first. If another card
+ *  answers, the cache is dropped and all cards in the field are resolved and
+ *  halted, and the first ISO-DEP capable card, or the first card if none is,
+ *  is selected.
+ *
+ *  @param[out] card Selected card.
+ *  @param[out] elapsed_us Time from the first command to the selection,
+ *                         excluding a failed reselect of the cached card.
+ *
+ *  @retval 0 If a card was selected.
+ *  @retval -ENOENT If no card is in the field.
+ *            Otherwise, a (negative) error code is returned.
+ */
+int nfca_poller_select(struct nfca_card *card, uint32_t *elapsed_us);
+
+/** @brief Forget the cached card. */
+void nfca_poller_cache_clear(void);
+
+/** @brief Get the time-to-select statistics.
+ *
+ *  @param[out] stats Statistics.
+ */
+void nfca_poller_stats_get(struct nfca_poller_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* NFCA_POLLER_H_ */
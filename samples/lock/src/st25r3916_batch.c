@@ -0,0 +1,421 @@
+/*
+ * Copyright (c) 2023 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/drivers/spi.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/util.h>
+
+#include "st25r3916_batch.h"
+
+LOG_MODULE_REGISTER(st25r3916_batch);
+
+#define ST25R3916_NODE DT_COMPAT_GET_ANY_STATUS_OKAY(st_st25r3911b)
+
+/* ST25R3916 uses SPI mode 1: CPOL = 0, CPHA = 1. */
+#define ST25R3916_SPI_OP (SPI_OP_MODE_MASTER | SPI_TRANSFER_MSB | SPI_WORD_SET(8) | SPI_MODE_CPHA)
+
+/* SPI mode byte patterns. */
+#define MODE_REG_WRITE 0x00
+#define MODE_REG_READ  0x40
+#define MODE_FIFO_LOAD 0x80
+#define MODE_FIFO_READ 0x9F
+#define MODE_CMD       0xC0
+#define SPACE_B_PREFIX 0xFB
+
+#define REG_ADDR_MASK 0x3F
+#define REG_COUNT     (REG_ADDR_MASK + 1)
+
+/* Interrupt registers are cleared on read and must never be read as a gap filler. */
+#define REG_IRQ_FIRST 0x1A
+#define REG_IRQ_LAST  0x1D
+
+/* Largest register gap bridged by reading and discarding registers. */
+#define MAX_READ_GAP 2
+
+enum frame_kind {
+	FRAME_OTHER,
+	FRAME_READ,
+	FRAME_WRITE,
+	FRAME_READ_B,
+	FRAME_WRITE_B,
+};
+
+static const struct spi_dt_spec bus = SPI_DT_SPEC_GET(ST25R3916_NODE, ST25R3916_SPI_OP, 0);
+
+/* Kept static: the driver identifies the lock owner by the configuration pointer. */
+static struct spi_config locked_cfg;
+
+/*
+ * Serializes batches. All callers share locked_cfg, and the driver lets the owner of the bus
+ * lock in without waiting, so the bus lock alone does not keep the IRQ thread out of a batch
+ * of the tag reader thread.
+ */
+static K_MUTEX_DEFINE(exec_lock);
+
+static atomic_t stat_batches;
+static atomic_t stat_ops;
+static atomic_t stat_frames;
+static atomic_t stat_bytes;
+
+static bool is_space_b(uint8_t reg)
+{
+	return (reg & ST25R3916_SPACE_B) != 0;
+}
+
+static uint8_t reg_kind(uint8_t reg, bool write)
+{
+	if (write) {
+		return is_space_b(reg) ? FRAME_WRITE_B : FRAME_WRITE;
+	}
+
+	return is_space_b(reg) ? FRAME_READ_B : FRAME_READ;
+}
+
+static struct st25r3916_batch_frame *last_frame(struct st25r3916_batch *batch)
+{
+	return batch->frame_cnt ? &batch->frames[batch->frame_cnt - 1] : NULL;
+}
+
+static struct st25r3916_batch_frame *frame_open(struct st25r3916_batch *batch, uint8_t kind)
+{
+	if (batch->frame_cnt >= ST25R3916_BATCH_MAX_FRAMES) {
+		batch->err = -ENOMEM;
+		return NULL;
+	}
+
+	struct st25r3916_batch_frame *frame = &batch->frames[batch->frame_cnt++];
+
+	frame->tx_first = batch->tx_cnt;
+	frame->tx_cnt = 0;
+	frame->rx_first = batch->rx_cnt;
+	frame->rx_cnt = 0;
+	frame->mode = kind;
+
+	return frame;
+}
+
+static uint8_t *scratch_alloc(struct st25r3916_batch *batch, size_t len)
+{
+	if (batch->scratch_len + len > sizeof(batch->scratch)) {
+		batch->err = -ENOMEM;
+		return NULL;
+	}
+
+	uint8_t *p = &batch->scratch[batch->scratch_len];
+
+	batch->scratch_len += len;
+
+	return p;
+}
+
+/* Append a buffer to the current frame, extending the previous buffer when contiguous. */
+static void buf_push(struct st25r3916_batch *batch, struct spi_buf *bufs, uint8_t *cnt,
+		     uint8_t *frame_bufs, void *buf, size_t len)
+{
+	if (*frame_bufs) {
+		struct spi_buf *prev = &bufs[*cnt - 1];
+
+		if ((!prev->buf && !buf) ||
+		    (prev->buf && buf && (uint8_t *)prev->buf + prev->len == (uint8_t *)buf)) {
+			prev->len += len;
+			return;
+		}
+	}
+
+	if (*cnt >= ST25R3916_BATCH_MAX_BUFS) {
+		batch->err = -ENOMEM;
+		return;
+	}
+
+	bufs[*cnt].buf = buf;
+	bufs[*cnt].len = len;
+	(*cnt)++;
+	(*frame_bufs)++;
+}
+
+static void tx_push(struct st25r3916_batch *batch, const void *buf, size_t len)
+{
+	struct st25r3916_batch_frame *frame = last_frame(batch);
+
+	buf_push(batch, batch->tx, &batch->tx_cnt, &frame->tx_cnt, (void *)buf, len);
+}
+
+static void rx_push(struct st25r3916_batch *batch, void *buf, size_t len)
+{
+	struct st25r3916_batch_frame *frame = last_frame(batch);
+
+	buf_push(batch, batch->rx, &batch->rx_cnt, &frame->rx_cnt, buf, len);
+}
+
+/* Open a new frame and queue its mode byte, preceded by the space B prefix if needed. */
+static bool frame_start(struct st25r3916_batch *batch, uint8_t kind, uint8_t mode, uint8_t reg,
+			bool rx)
+{
+	size_t hdr_len = is_space_b(reg) ? 2 : 1;
+	uint8_t *hdr;
+
+	if (!frame_open(batch, kind)) {
+		return false;
+	}
+
+	hdr = scratch_alloc(batch, hdr_len);
+	if (!hdr) {
+		return false;
+	}
+
+	if (hdr_len == 2) {
+		hdr[0] = SPACE_B_PREFIX;
+	}
+	hdr[hdr_len - 1] = mode;
+
+	tx_push(batch, hdr, hdr_len);
+	if (rx) {
+		rx_push(batch, NULL, hdr_len);
+	}
+
+	return batch->err == 0;
+}
+
+static bool gap_is_readable(uint8_t reg, uint8_t next)
+{
+	if (is_space_b(reg)) {
+		return true;
+	}
+
+	uint8_t first = next & REG_ADDR_MASK;
+	uint8_t last = (reg & REG_ADDR_MASK) - 1;
+
+	return (last < REG_IRQ_FIRST) || (first > REG_IRQ_LAST);
+}
+
+void st25r3916_batch_init(struct st25r3916_batch *batch)
+{
+	batch->scratch_len = 0;
+	batch->tx_cnt = 0;
+	batch->rx_cnt = 0;
+	batch->frame_cnt = 0;
+	batch->ops = 0;
+	batch->next_reg = 0;
+	batch->err = 0;
+}
+
+void st25r3916_batch_regs_read(struct st25r3916_batch *batch, uint8_t reg, uint8_t *buf,
+			       size_t len)
+{
+	struct st25r3916_batch_frame *frame = last_frame(batch);
+	uint8_t addr = reg & REG_ADDR_MASK;
+
+	if (batch->err) {
+		return;
+	}
+	if (!len || (addr + len > REG_COUNT)) {
+		batch->err = -EINVAL;
+		return;
+	}
+
+	batch->ops++;
+
+	if (frame && (frame->mode == reg_kind(reg, false)) && (reg >= batch->next_reg) &&
+	    (reg - batch->next_reg <= MAX_READ_GAP)) {
+		uint8_t gap = reg - batch->next_reg;
+
+		if (!gap || gap_is_readable(reg, batch->next_reg)) {
+			if (gap) {
+				rx_push(batch, NULL, gap);
+			}
+			rx_push(batch, buf, len);
+			batch->next_reg = reg + len;
+			return;
+		}
+	}
+
+	if (!frame_start(batch, reg_kind(reg, false), MODE_REG_READ | addr, reg, true)) {
+		return;
+	}
+
+	rx_push(batch, buf, len);
+	batch->next_reg = reg + len;
+}
+
+void st25r3916_batch_reg_read(struct st25r3916_batch *batch, uint8_t reg, uint8_t *val)
+{
+	st25r3916_batch_regs_read(batch, reg, val, 1);
+}
+
+void st25r3916_batch_reg_write(struct st25r3916_batch *batch, uint8_t reg, uint8_t val)
+{
+	struct st25r3916_batch_frame *frame = last_frame(batch);
+	uint8_t addr = reg & REG_ADDR_MASK;
+	uint8_t *p;
+
+	if (batch->err) {
+		return;
+	}
+
+	batch->ops++;
+
+	if (!frame || (frame->mode != reg_kind(reg, true)) || (reg != batch->next_reg)) {
+		if (!frame_start(batch, reg_kind(reg, true), MODE_REG_WRITE | addr, reg, false)) {
+			return;
+		}
+	}
+
+	/* The value directly follows the previous byte of this frame in scratch. */
+	p = scratch_alloc(batch, 1);
+	if (!p) {
+		return;
+	}
+
+	*p = val;
+	tx_push(batch, p, 1);
+	batch->next_reg = reg + 1;
+}
+
+void st25r3916_batch_fifo_load(struct st25r3916_batch *batch, const uint8_t *data, size_t len)
+{
+	if (batch->err) {
+		return;
+	}
+
+	batch->ops++;
+
+	if (!frame_start(batch, FRAME_OTHER, MODE_FIFO_LOAD, 0, false)) {
+		return;
+	}
+
+	tx_push(batch, data, len);
+}
+
+void st25r3916_batch_fifo_read(struct st25r3916_batch *batch, uint8_t *buf, size_t len)
+{
+	if (batch->err) {
+		return;
+	}
+
+	batch->ops++;
+
+	if (!frame_start(batch, FRAME_OTHER, MODE_FIFO_READ, 0, true)) {
+		return;
+	}
+
+	rx_push(batch, buf, len);
+}
+
+void st25r3916_batch_cmd(struct st25r3916_batch *batch, uint8_t cmd)
+{
+	if (batch->err) {
+		return;
+	}
+	if (cmd < MODE_CMD) {
+		batch->err = -EINVAL;
+		return;
+	}
+
+	batch->ops++;
+
+	frame_start(batch, FRAME_OTHER, cmd, 0, false);
+}
+
+static size_t bufs_len(const struct spi_buf *bufs, uint8_t cnt)
+{
+	size_t len = 0;
+
+	for (uint8_t i = 0; i < cnt; i++) {
+		len += bufs[i].len;
+	}
+
+	return len;
+}
+
+int st25r3916_batch_exec(struct st25r3916_batch *batch)
+{
+	size_t bytes = 0;
+	uint8_t i;
+	int err = 0;
+
+	if (batch->err) {
+		return batch->err;
+	}
+	if (!batch->frame_cnt) {
+		return 0;
+	}
+
+	k_mutex_lock(&exec_lock, K_FOREVER);
+
+	for (i = 0; i < batch->frame_cnt; i++) {
+		const struct st25r3916_batch_frame *frame = &batch->frames[i];
+		const struct spi_buf_set tx = {
+			.buffers = &batch->tx[frame->tx_first],
+			.count = frame->tx_cnt,
+		};
+		const struct spi_buf_set rx = {
+			.buffers = &batch->rx[frame->rx_first],
+			.count = frame->rx_cnt,
+		};
+
+		err = spi_transceive(bus.bus, &locked_cfg, &tx, frame->rx_cnt ? &rx : NULL);
+		if (err) {
+			LOG_ERR("SPI frame %u of %u failed: %d", i, batch->frame_cnt, err);
+			break;
+		}
+
+		bytes += MAX(bufs_len(tx.buffers, tx.count), bufs_len(rx.buffers, rx.count));
+	}
+
+	spi_release(bus.bus, &locked_cfg);
+	k_mutex_unlock(&exec_lock);
+
+	atomic_inc(&stat_batches);
+	atomic_add(&stat_ops, batch->ops);
+	atomic_add(&stat_frames, i);
+	atomic_add(&stat_bytes, bytes);
+
+	return err;
+}
+
+int st25r3916_regs_read(uint8_t reg, uint8_t *buf, size_t len)
+{
+	struct st25r3916_batch batch;
+
+	st25r3916_batch_init(&batch);
+	st25r3916_batch_regs_read(&batch, reg, buf, len);
+
+	return st25r3916_batch_exec(&batch);
+}
+
+void st25r3916_batch_stats_get(struct st25r3916_batch_stats *stats)
+{
+	stats->batches = atomic_get(&stat_batches);
+	stats->ops = atomic_get(&stat_ops);
+	stats->frames = atomic_get(&stat_frames);
+	stats->bytes = atomic_get(&stat_bytes);
+}
+
+void st25r3916_batch_stats_reset(void)
+{
+	atomic_clear(&stat_batches);
+	atomic_clear(&stat_ops);
+	atomic_clear(&stat_frames);
+	atomic_clear(&stat_bytes);
+}
+
+int st25r3916_batch_setup(void)
+{
+	if (!spi_is_ready_dt(&bus)) {
+		LOG_ERR("SPI bus %s is not ready", bus.bus->name);
+		return -ENODEV;
+	}
+
+	locked_cfg = bus.config;
+	locked_cfg.operation |= SPI_LOCK_ON;
+
+	return 0;
+}
@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2023 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef ST25R3916_BATCH_H_
+#define ST25R3916_BATCH_H_
+
+/**
+ * @file
+ * @brief Batched register and FIFO access for the ST25R3916 reader.
+ *
+ * Every ST25R3916 SPI access is framed by chip select and starts with a mode
+ * byte. Issuing one transaction per register pays the chip select and driver
+ * overhead on every access. A batch collects register reads, register writes,
+ * FIFO transfers and direct commands and executes them with the bus locked
+ * once. Consecutive accesses to adjacent registers are merged into a single
+ * auto-increment frame, and every frame is a single EasyDMA transfer.
+ *
+ * Destination buffers of read operations are only valid after
+ * @ref st25r3916_batch_exec returns successfully.
+ */
+
+#include <zephyr/types.h>
+#include <stddef.h>
+#include <zephyr/drivers/spi.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Flag marking a register located in register space B. */
+#define ST25R3916_SPACE_B 0x40
+
+/** Maximum number of chip select frames in a batch. */
+#define ST25R3916_BATCH_MAX_FRAMES 8
+
+/** Maximum number of SPI buffers per direction in a batch. */
+#define ST25R3916_BATCH_MAX_BUFS 16
+
+/** Size of the scratch area holding mode bytes and register values. */
+#define ST25R3916_BATCH_SCRATCH_SIZE 48
+
+/** @brief Chip select frame of a batch. */
+struct st25r3916_batch_frame {
+	uint8_t tx_first;
+	uint8_t tx_cnt;
+	uint8_t rx_first;
+	uint8_t rx_cnt;
+	uint8_t mode;
+};
+
+/** @brief Register access batch.
+ *
+ *  Allocate on the stack and initialize with @ref st25r3916_batch_init.
+ */
+struct st25r3916_batch {
+	uint8_t scratch[ST25R3916_BATCH_SCRATCH_SIZE];
+	struct spi_buf tx[ST25R3916_BATCH_MAX_BUFS];
+	struct spi_buf rx[ST25R3916_BATCH_MAX_BUFS];
+	struct st25r3916_batch_frame frames[ST25R3916_BATCH_MAX_FRAMES];
+	uint8_t scratch_len;
+	uint8_t tx_cnt;
+	uint8_t rx_cnt;
+	uint8_t frame_cnt;
+	uint8_t ops;
+	uint8_t next_reg;
+	int err;
+};
+
+/** @brief SPI access statistics. */
+struct st25r3916_batch_stats {
+	/** Number of executed batches. */
+	uint32_t batches;
+
+	/** Number of requested register, FIFO and command operations. */
+	uint32_t ops;
+
+	/** Number of chip select frames issued on the bus. */
+	uint32_t frames;
+
+	/** Number of bytes clocked on the bus. */
+	uint32_t bytes;
+};
+
+/** @brief Initialize the batched access layer.
+ *
+ *  @retval 0 If the operation was successful.
+ *            Otherwise, a (negative) error code is returned.
+ */
+int st25r3916_batch_setup(void);
+
+/** @brief Prepare an empty batch.
+ *
+ *  @param[out] batch Batch to initialize.
+ */
+void st25r3916_batch_init(struct st25r3916_batch *batch);
+
+/** @brief Queue a single register read.
+ *
+ *  @param[in,out] batch Batch.
+ *  @param[in] reg Register address, optionally ORed with @ref ST25R3916_SPACE_B.
+ *  @param[out] val Destination of the register value.
+ */
+void st25r3916_batch_reg_read(struct st25r3916_batch *batch, uint8_t reg, uint8_t *val);
+
+/** @brief Queue an auto-increment read of consecutive registers.
+ *
+ *  @param[in,out] batch Batch.
+ *  @param[in] reg First register address.
+ *  @param[out] buf Destination buffer.
+ *  @param[in] len Number of registers to read.
+ */
+void st25r3916_batch_regs_read(struct st25r3916_batch *batch, uint8_t reg, uint8_t *buf,
+			       size_t len);
+
+/** @brief Queue a single register write.
+ *
+ *  @param[in,out] batch Batch.
+ *  @param[in] reg Register address, optionally ORed with @ref ST25R3916_SPACE_B.
+ *  @param[in] val Value to write.
+ */
+void st25r3916_batch_reg_write(struct st25r3916_batch *batch, uint8_t reg, uint8_t val);
+
+/** @brief Queue a bulk FIFO load.
+ *
+ *  The data is transferred straight from @p data, it must stay valid until
+ *  the batch is executed.
+ *
+ *  @param[in,out] batch Batch.
+ *  @param[in] data Data to load.
+ *  @param[in] len Number of bytes to load.
+ */
+void st25r3916_batch_fifo_load(struct st25r3916_batch *batch, const uint8_t *data, size_t len);
+
+/** @brief Queue a bulk FIFO read.
+ *
+ *  @param[in,out] batch Batch.
+ *  @param[out] buf Destination buffer.
+ *  @param[in] len Number of bytes to read.
+ */
+void st25r3916_batch_fifo_read(struct st25r3916_batch *batch, uint8_t *buf, size_t len);
+
+/** @brief Queue a direct command.
+ *
+ *  @param[in,out] batch Batch.
+ *  @param[in] cmd Direct command code (0xC0 - 0xFF).
+ */
+void st25r3916_batch_cmd(struct st25r3916_batch *batch, uint8_t cmd);
+
+/** @brief Execute all queued operations.
+ *
+ *  The bus is locked for the whole batch, so no other user can interleave
+ *  transfers between the frames of the batch. Batches of different threads
+ *  are executed one after the other; the call blocks while another batch
+ *  is executed.
+ *
+ *  @param[in] batch Batch to execute.
+ *
+ *  @retval 0 If the operation was successful.
+ *            Otherwise, a (negative) error code is returned.
+ */
+int st25r3916_batch_exec(struct st25r3916_batch *batch);
+
+/** @brief Read consecutive registers in one frame.
+ *
+ *  @param[in] reg First register address.
+ *  @param[out] buf Destination buffer.
+ *  @param[in] len Number of registers to read.
+ *
+ *  @retval 0 If the operation was successful.
+ *            Otherwise, a (negative) error code is returned.
+ */
+int st25r3916_regs_read(uint8_t reg, uint8_t *buf, size_t len);
+
+/** @brief Get the SPI access statistics.
+ *
+ *  @param[out] stats Statistics accumulated since the last reset.
+ */
+void st25r3916_batch_stats_get(struct st25r3916_batch_stats *stats);
+
+/** @brief Reset the SPI access statistics, for example at the start of a tap. */
+void st25r3916_batch_stats_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ST25R3916_BATCH_H_ */
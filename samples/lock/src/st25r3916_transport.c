@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2023 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/util.h>
+
+#include "st25r3916_batch.h"
+#include "st25r3916_transport.h"
+
+LOG_MODULE_REGISTER(st25r3916_transport);
+
+/* Registers. */
+#define REG_OP_CONTROL        0x02
+#define REG_MODE              0x03
+#define REG_BIT_RATE          0x04
+#define REG_ISO14443A_NFC     0x05
+#define REG_AUX               0x0A
+#define REG_NRT1              0x10
+#define REG_NRT2              0x11
+#define REG_IRQ_MASK_MAIN     0x16
+#define REG_FIFO_STATUS1      0x1E
+#define REG_FIFO_STATUS2      0x1F
+#define REG_COLLISION_STATUS  0x20
+#define REG_NUM_TX_BYTES1     0x22
+#define REG_NUM_TX_BYTES2     0x23
+
+#define OP_CONTROL_TX_EN      BIT(3)
+#define MODE_ISO14443A        0x08
+#define ISO14443A_ANTCL       BIT(0)
+#define AUX_NO_CRC_RX         BIT(7)
+
+#define FIFO_STATUS2_B_MASK   0xC0
+#define FIFO_STATUS2_OVR      BIT(4)
+#define FIFO_STATUS2_UNF      BIT(5)
+#define FIFO_STATUS2_LB(x)    (((x) >> 1) & 0x07)
+#define COLL_BYTE(x)          ((x) >> 4)
+#define COLL_BIT(x)           (((x) >> 1) & 0x07)
+
+/* Direct commands. */
+#define CMD_TRANSMIT_WITH_CRC    0xC4
+#define CMD_TRANSMIT_WITHOUT_CRC 0xC5
+#define CMD_TRANSMIT_REQA        0xC6
+#define CMD_TRANSMIT_WUPA        0xC7
+#define CMD_CLEAR_FIFO           0xDB
+
+/* Interrupts, main register in the least significant byte. */
+#define IRQ_COL  BIT(2)
+#define IRQ_TXE  BIT(3)
+#define IRQ_RXE  BIT(4)
+#define IRQ_NRE  BIT(14)
+#define IRQ_ERR1 BIT(20)
+#define IRQ_ERR2 BIT(21)
+#define IRQ_PAR  BIT(22)
+#define IRQ_CRC  BIT(23)
+
+#define IRQ_DONE   (IRQ_RXE | IRQ_NRE)
+#define IRQ_ERRORS (IRQ_ERR1 | IRQ_ERR2 | IRQ_PAR | IRQ_CRC)
+#define IRQ_USED   (IRQ_COL | IRQ_TXE | IRQ_DONE | IRQ_ERRORS)
+
+#define CRC_LEN 2
+
+/* No response timer of 1 ms in 64/fc steps, above the frame delay time of any command used. */
+#define NRT_STEPS 212
+
+/* Software guard on top of the no response timer. */
+#define XFER_TIMEOUT_MS 5
+
+/* Time between switching the field on and the first command. */
+#define FIELD_GUARD_TIME K_MSEC(5)
+
+#define CMD_SHORT_FRAME_REQA 0x26
+
+struct xfer {
+	const uint8_t *tx;
+	size_t tx_bits;
+	uint8_t start_cmd;
+	bool antcl;
+	bool crc_rx;
+	uint8_t *rx;
+	size_t rx_max;
+	size_t rx_bits;
+	bool collision;
+};
+
+static K_SEM_DEFINE(irq_evt, 0, 1);
+static atomic_t irq_status;
+
+/* Shadows of the registers partly modified per frame. */
+static uint8_t op_control;
+static uint8_t iso14443a;
+static uint8_t aux;
+
+void st25r3916_transport_irq_notify(uint32_t irq)
+{
+	atomic_or(&irq_status, irq);
+	k_sem_give(&irq_evt);
+}
+
+static int irq_wait(uint32_t *irq)
+{
+	int64_t deadline = k_uptime_get() + XFER_TIMEOUT_MS;
+
+	for (;;) {
+		*irq = atomic_get(&irq_status);
+		if (*irq & IRQ_DONE) {
+			return 0;
+		}
+
+		int64_t left = deadline - k_uptime_get();
+
+		if ((left <= 0) || k_sem_take(&irq_evt, K_MSEC(left))) {
+			return -ETIMEDOUT;
+		}
+	}
+}
+
+static int xfer_run(struct xfer *x)
+{
+	struct st25r3916_batch batch;
+	uint16_t tx_bytes = x->tx_bits / 8;
+	uint8_t status[3];
+	uint16_t fifo_bytes;
+	uint32_t irq;
+	int err;
+
+	atomic_clear(&irq_status);
+	k_sem_reset(&irq_evt);
+
+	/* Frame setup and start in one batch. */
+	st25r3916_batch_init(&batch);
+	st25r3916_batch_cmd(&batch, CMD_CLEAR_FIFO);
+	st25r3916_batch_reg_write(&batch, REG_ISO14443A_NFC,
+				  x->antcl ? (iso14443a | ISO14443A_ANTCL) : iso14443a);
+	st25r3916_batch_reg_write(&batch, REG_AUX, x->crc_rx ? aux : (aux | AUX_NO_CRC_RX));
+	st25r3916_batch_reg_write(&batch, REG_NRT1, NRT_STEPS >> 8);
+	st25r3916_batch_reg_write(&batch, REG_NRT2, NRT_STEPS & 0xFF);
+	if (x->tx) {
+		st25r3916_batch_reg_write(&batch, REG_NUM_TX_BYTES1, tx_bytes >> 5);
+		st25r3916_batch_reg_write(&batch, REG_NUM_TX_BYTES2,
+					  ((tx_bytes & 0x1F) << 3) | (x->tx_bits % 8));
+		st25r3916_batch_fifo_load(&batch, x->tx, DIV_ROUND_UP(x->tx_bits, 8));
+	}
+	st25r3916_batch_cmd(&batch, x->start_cmd);
+
+	err = st25r3916_batch_exec(&batch);
+	if (err) {
+		return err;
+	}
+
+	err = irq_wait(&irq);
+	if (err) {
+		return err;
+	}
+	if (!(irq & IRQ_RXE)) {
+		return -ETIMEDOUT;
+	}
+
+	x->collision = (irq & IRQ_COL) != 0;
+
+	/* Collisions are expected in ATQA and in the anticollision loop only. */
+	if ((x->collision && x->tx && !x->antcl) || ((irq & IRQ_ERRORS) && !x->collision)) {
+		LOG_DBG("Reception error, irq: 0x%08x", irq);
+		return -EIO;
+	}
+
+	/* FIFO and collision status in one auto-increment read. */
+	err = st25r3916_regs_read(REG_FIFO_STATUS1, status, sizeof(status));
+	if (err) {
+		return err;
+	}
+	if (status[1] & (FIFO_STATUS2_OVR | FIFO_STATUS2_UNF)) {
+		return -EIO;
+	}
+
+	fifo_bytes = ((status[1] & FIFO_STATUS2_B_MASK) << 2) | status[0];
+	if (!fifo_bytes) {
+		return -EPROTO;
+	}
+
+	if (x->collision) {
+		/* The position counts the whole frame, including the bits sent by the reader. */
+		size_t pos = COLL_BYTE(status[2]) * 8 + COLL_BIT(status[2]);
+
+		x->rx_bits = (pos > x->tx_bits) ? (pos - x->tx_bits) : 0;
+	} else {
+		uint8_t lb = FIFO_STATUS2_LB(status[1]);
+
+		x->rx_bits = fifo_bytes * 8 - (lb ? (8 - lb) : 0) - (x->antcl ? x->tx_bits % 8 : 0);
+	}
+
+	st25r3916_batch_init(&batch);
+	st25r3916_batch_fifo_read(&batch, x->rx, MIN(fifo_bytes, x->rx_max));
+
+	return st25r3916_batch_exec(&batch);
+}
+
+static int short_frame(uint8_t cmd, uint8_t atqa[2])
+{
+	struct xfer x = {
+		.start_cmd = (cmd == CMD_SHORT_FRAME_REQA) ? CMD_TRANSMIT_REQA : CMD_TRANSMIT_WUPA,
+		.rx = atqa,
+		.rx_max = 2,
+	};
+	int err;
+
+	err = xfer_run(&x);
+	if (err) {
+		return err;
+	}
+
+	/* Several cards answering with different ATQA collide, they are still there. */
+	return (x.collision || (x.rx_bits == 16)) ? 0 : -EPROTO;
+}
+
+static int anticollision(const uint8_t *tx, size_t tx_bits, uint8_t *rx, size_t rx_max,
+			 size_t *rx_bits, bool *collision)
+{
+	struct xfer x = {
+		.tx = tx,
+		.tx_bits = tx_bits,
+		.start_cmd = CMD_TRANSMIT_WITHOUT_CRC,
+		.antcl = true,
+		.rx = rx,
+		.rx_max = rx_max,
+	};
+	int err;
+
+	err = xfer_run(&x);
+	if (err) {
+		return err;
+	}
+
+	*rx_bits = x.rx_bits;
+	*collision = x.collision;
+
+	return 0;
+}
+
+static int transceive(const uint8_t *tx, size_t tx_len, uint8_t *rx, size_t rx_max,
+		      size_t *rx_len)
+{
+	uint8_t crc[CRC_LEN];
+	struct xfer x = {
+		.tx = tx,
+		.tx_bits = tx_len * 8,
+		.start_cmd = CMD_TRANSMIT_WITH_CRC,
+		.crc_rx = true,
+		.rx = rx,
+		.rx_max = rx_max,
+	};
+	int err;
+
+	if (!rx) {
+		/* Nothing to receive, only wait for the no response timer. */
+		x.rx = crc;
+		x.rx_max = sizeof(crc);
+		err = xfer_run(&x);
+
+		return (err == -ETIMEDOUT) ? 0 : err;
+	}
+
+	err = xfer_run(&x);
+	if (err) {
+		return err;
+	}
+
+	/* The CRC is checked by the reader but kept in the FIFO. */
+	if (x.rx_bits < (CRC_LEN + 1) * 8) {
+		return -EPROTO;
+	}
+
+	*rx_len = MIN(x.rx_bits / 8 - CRC_LEN, rx_max);
+
+	return 0;
+}
+
+const struct nfca_transport st25r3916_nfca_transport = {
+	.short_frame = short_frame,
+	.anticollision = anticollision,
+	.transceive = transceive,
+};
+
+static int op_control_write(uint8_t val)
+{
+	struct st25r3916_batch batch;
+
+	st25r3916_batch_init(&batch);
+	st25r3916_batch_reg_write(&batch, REG_OP_CONTROL, val);
+
+	return st25r3916_batch_exec(&batch);
+}
+
+int st25r3916_field_on(void)
+{
+	int err;
+
+	err = op_control_write(op_control | OP_CONTROL_TX_EN);
+	if (err) {
+		return err;
+	}
+
+	k_sleep(FIELD_GUARD_TIME);
+
+	return 0;
+}
+
+int st25r3916_field_off(void)
+{
+	return op_control_write(op_control & ~OP_CONTROL_TX_EN);
+}
+
+int st25r3916_transport_init(void)
+{
+	struct st25r3916_batch batch;
+	uint32_t mask = (uint32_t)~IRQ_USED;
+	int err;
+
+	st25r3916_batch_init(&batch);
+	st25r3916_batch_reg_read(&batch, REG_OP_CONTROL, &op_control);
+	st25r3916_batch_reg_read(&batch, REG_ISO14443A_NFC, &iso14443a);
+	st25r3916_batch_reg_read(&batch, REG_AUX, &aux);
+
+	err = st25r3916_batch_exec(&batch);
+	if (err) {
+		return err;
+	}
+
+	op_control &= ~OP_CONTROL_TX_EN;
+	iso14443a &= ~ISO14443A_ANTCL;
+	aux &= ~AUX_NO_CRC_RX;
+
+	/* ISO14443A initiator at 106 kbit/s, and the interrupts used by the transport. */
+	st25r3916_batch_init(&batch);
+	st25r3916_batch_reg_write(&batch, REG_MODE, MODE_ISO14443A);
+	st25r3916_batch_reg_write(&batch, REG_BIT_RATE, 0x00);
+	for (uint8_t i = 0; i < sizeof(mask); i++) {
+		st25r3916_batch_reg_write(&batch, REG_IRQ_MASK_MAIN + i, mask >> (8 * i));
+	}
+
+	return st25r3916_batch_exec(&batch);
+}
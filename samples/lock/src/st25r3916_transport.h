@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2023 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef ST25R3916_TRANSPORT_H_
+#define ST25R3916_TRANSPORT_H_
+
+/**
+ * @file
+ * @brief NFC-A frame transport on the ST25R3916 reader.
+ *
+ * Every frame is set up and started with a single SPI batch, and the
+ * reception status is fetched with one auto-increment read of the FIFO and
+ * collision status registers.
+ */
+
+#include <zephyr/types.h>
+
+#include "nfca_poller.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** NFC-A transport of the ST25R3916 reader. */
+extern const struct nfca_transport st25r3916_nfca_transport;
+
+/** @brief Configure the reader for NFC-A polling.
+ *
+ *  The batched access layer must be set up first.
+ *
+ *  @retval 0 If the operation was successful.
+ *            Otherwise, a (negative) error code is returned.
+ */
+int st25r3916_transport_init(void);
+
+/** @brief Pass interrupt status read by the interrupt thread.
+ *
+ *  @param[in] irq Content of the four interrupt registers, main register
+ *                 in the least significant byte.
+ */
+void st25r3916_transport_irq_notify(uint32_t irq);
+
+/** @brief Switch the RF field on and wait for the guard time.
+ *
+ *  @retval 0 If the operation was successful.
+ *            Otherwise, a (negative) error code is returned.
+ */
+int st25r3916_field_on(void);
+
+/** @brief Switch the RF field off.
+ *
+ *  @retval 0 If the operation was successful.
+ *            Otherwise, a (negative) error code is returned.
+ */
+int st25r3916_field_off(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ST25R3916_TRANSPORT_H_ */
@@ -10,6 +10,7 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
 #include <zephyr/kernel.h>
 #include <zephyr/sys/printk.h>
 #include <st25r3911b_nfca.h>
@@ -23,6 +24,17 @@
 #include <zephyr/sys/byteorder.h>
 #include <st25r3916_nfca.h>
 #include "st25r3916_irq.h"
+#include "st25r3916_batch.h"
+#include "st25r3916_transport.h"
+#include "nfca_poller.h"
+#include "HAPPlatformTapTrace.h"
+#include "HAPPlatformNfcCoexistence.h"
+
+#define ST25R3916_REG_IRQ_MAIN 0x1A
+#define ST25R3916_IRQ_REG_CNT  4
+
+#define POLL_INTERVAL K_MSEC(200)
+
 #if 1
 #define MY_STACK_SIZE 1024
 #define MY_PRIORITY -2
@@ -30,21 +42,69 @@ static K_SEM_DEFINE(irq_sem, 0, 1);
 int is=0;
 void my_entry_point(int unused1, int unused2, int unused3)
 {
+	uint8_t irq[ST25R3916_IRQ_REG_CNT];
 	int err;
-	while(1){
-/*		err = k_sem_take(&irq_sem, K_FOREVER);
+
+	while (1) {
+		err = k_sem_take(&irq_sem, K_FOREVER);
 		if (err) {
 			return;
 		}
-		st25r3916Isr();*/
-		printk("my_entry_point\n");
-k_sleep(K_SECONDS(1));
+
+		/* All four interrupt registers in one auto-increment frame. */
+		err = st25r3916_regs_read(ST25R3916_REG_IRQ_MAIN, irq, sizeof(irq));
+		if (err) {
+			printk("IRQ status read failed, err: %d.\n", err);
+			continue;
+		}
+
+		st25r3916_transport_irq_notify(sys_get_le32(irq));
 	}
 
 }
 
 K_THREAD_STACK_DEFINE(my_stack_area, MY_STACK_SIZE);
 #endif
+
+static void tap_report(const struct nfca_card *card, uint32_t elapsed_us, uint32_t wait_ms)
+{
+	HAPPlatformNfcCoexistenceStats coex;
+	struct st25r3916_batch_stats spi;
+	struct nfca_poller_stats stats;
+
+	st25r3916_batch_stats_get(&spi);
+	nfca_poller_stats_get(&stats);
+	HAPPlatformNfcCoexistenceGetStats(&coex);
+
+	printk("Card selected in %u us after %u ms wait for the air, UID:", elapsed_us, wait_ms);
+	for (uint8_t i = 0; i < card->uid_len; i++) {
+		printk(" %02x", card->uid[i]);
+	}
+	printk(", SAK: 0x%02x\n", card->sak);
+
+	printk("SPI: %u batches, %u ops, %u frames, %u bytes\n",
+	       spi.batches, spi.ops, spi.frames, spi.bytes);
+
+	if (stats.first.count) {
+		printk("First tap: %u, avg %u us, min %u us, max %u us\n", stats.first.count,
+		       (uint32_t)(stats.first.sum_us / stats.first.count),
+		       stats.first.min_us, stats.first.max_us);
+	}
+	if (stats.repeat.count) {
+		printk("Repeat tap: %u, avg %u us, min %u us, max %u us\n", stats.repeat.count,
+		       (uint32_t)(stats.repeat.sum_us / stats.repeat.count),
+		       stats.repeat.min_us, stats.repeat.max_us);
+	}
+
+	printk("Reader: %u slots, %u deferred, %u forced, wait avg %u ms, max %u ms\n",
+	       coex.readerGrants, coex.readerDeferrals, coex.readerForcedGrants,
+	       coex.readerGrants ? coex.readerTotalWaitMs / coex.readerGrants : 0,
+	       coex.readerMaxWaitMs);
+	printk("Setup tag: %u fields, %u contended, %u read, read latency avg %u ms, max %u ms\n",
+	       coex.emulationFields, coex.emulationContended, coex.emulationReads,
+	       coex.emulationReads ? coex.emulationTotalReadLatencyMs / coex.emulationReads : 0,
+	       coex.emulationMaxReadLatencyMs);
+}
 void tag_reader(int unused1, int unused2, int unused3)
 {
 	int err;
@@ -84,6 +144,18 @@ void tag_reader(int unused1, int unused2, int unused3)
 		}
 	}*/
 #endif
+	err = st25r3916_nfca_init();
+	if (err) {
+		printk("NFCA initialization failed err: %d.\n", err);
+		return;
+	}
+
+	err = st25r3916_batch_setup();
+	if (err) {
+		printk("SPI batch setup failed err: %d.\n", err);
+		return;
+	}
+
 #if 1
 st25r3916InitInterrupts(&irq_sem);
 struct k_thread my_thread_data;
@@ -94,14 +166,50 @@ struct k_thread my_thread_data;
 									 NULL, NULL, NULL,
 									 MY_PRIORITY, 0, K_NO_WAIT);
 #endif
-	err = st25r3916_nfca_init();
+
+	err = st25r3916_transport_init();
 	if (err) {
-		return err;
+		printk("NFC-A transport initialization failed err: %d.\n", err);
+		return;
 	}
 
-	while(1)
-{	printk("Starting NFC TAG Reader example\n");
-k_sleep(K_SECONDS(1));
-}
+	nfca_poller_init(&st25r3916_nfca_transport);
+
+	printk("Starting NFC TAG Reader example\n");
+
+	while (1) {
+		struct nfca_card card;
+		uint32_t elapsed_us;
+		uint32_t wait_ms;
+
+		/* Defer to a phone reading the setup tag, see HAPPlatformNfcCoexistence.h. */
+		wait_ms = (uint32_t)HAPPlatformNfcCoexistenceReaderAcquire();
+
+		HAPPlatformTapTraceStamp stamp = HAPPlatformTapTraceBegin();
+
+		err = st25r3916_field_on();
+		if (err) {
+			printk("Field on error %d.\n", err);
+			HAPPlatformNfcCoexistenceReaderRelease();
+			k_sleep(POLL_INTERVAL);
+			continue;
+		}
+
+		st25r3916_batch_stats_reset();
+
+		err = nfca_poller_select(&card, &elapsed_us);
+		if (!err) {
+			/* Only polls that found a card open a tap in the trace. */
+			HAPPlatformTapTraceStart(stamp);
+			HAPPlatformTapTraceEnd(kHAPPlatformTapTraceEvent_CardSelect, card.sak, stamp);
+			tap_report(&card, elapsed_us, wait_ms);
+		} else if (err != -ENOENT) {
+			printk("Card activation failed, err: %d.\n", err);
+		}
+
+		(void)st25r3916_field_off();
+		HAPPlatformNfcCoexistenceReaderRelease();
+		k_sleep(POLL_INTERVAL);
+	}
 }
 K_THREAD_DEFINE(tag, 2048, tag_reader, NULL, NULL, NULL, 5, 0, 0);
\ No newline at end of file